@@ -28,9 +28,11 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "sysemu/arch_init.h"
@@ -46,6 +48,9 @@
 #include "hw/pcspk.h"
 #include "migration/page_cache.h"
 #include "qemu/config-file.h"
+#include "qemu/thread.h"
+#include "qemu/sockets.h"
+#include "qemu/iov.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
@@ -113,6 +118,8 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x80
+#define RAM_SAVE_FLAG_CHANNELS 0x100
 
 #ifdef __ALTIVEC__
 #include <altivec.h>
@@ -164,12 +171,23 @@ int qemu_read_default_config_files(bool userconfig)
     return 0;
 }
 
+static bool is_zero_page(uint8_t *page)
+{
+    return buffer_find_nonzero_offset(page, TARGET_PAGE_SIZE) ==
+           TARGET_PAGE_SIZE;
+}
+
 static int is_dup_page(uint8_t *page)
 {
     VECTYPE *p = (VECTYPE *)page;
     VECTYPE val = SPLAT(page);
     int i;
 
+    /* most duplicate pages are zero pages, check them with wider vectors */
+    if (*page == 0) {
+        return is_zero_page(page);
+    }
+
     for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i++) {
         if (!ALL_EQ(val, p[i])) {
             return 0;
@@ -215,7 +233,10 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -260,11 +281,26 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -299,6 +335,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
         acct_info.xbzrle_cache_miss++;
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -347,6 +384,10 @@ static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
+/* the guest runs on the destination, pages are sent whole */
+static bool ram_postcopy_active;
+/* the first round over RAM, where every page is still dirty */
+static bool ram_bulk_stage;
 
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -365,46 +406,82 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
-                                              ram_addr_t offset)
+static inline bool migration_bitmap_test_and_reset_dirty(MemoryRegion *mr,
+                                                         ram_addr_t offset)
+{
+    unsigned long nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+
+    if (!test_and_clear_bit(nr, migration_bitmap)) {
+        return false;
+    }
+    migration_dirty_pages--;
+    return true;
+}
+
+/* Auto-converge: the guest is throttled by this much the first time, and
+ * by one more step each time it still dirties memory too fast. */
+#define MIG_THROTTLE_INITIAL 20
+#define MIG_THROTTLE_STEP    10
+
+static uint64_t bytes_xfer_prev;
+static int dirty_rate_high_cnt;
+
+static void mig_throttle_guest_down(void)
 {
-    bool ret;
-    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+    int pct = cpu_throttle_get_percentage();
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+    pct = pct ? pct + MIG_THROTTLE_STEP : MIG_THROTTLE_INITIAL;
+    DPRINTF("throttling guest vCPUs to %d%%\n", pct);
+    cpu_throttle_set(pct);
+}
 
-    if (!ret) {
-        migration_dirty_pages++;
+/* Called once per dirty rate period. */
+static void mig_throttle_check(uint64_t num_dirty_pages_period)
+{
+    uint64_t bytes_xfer_now = ram_bytes_transferred();
+    uint64_t bytes_dirty_period = num_dirty_pages_period * TARGET_PAGE_SIZE;
+
+    /* If the guest dirtied more than half of what was sent during the
+     * period for two periods in a row, the remaining dirty set is not
+     * shrinking fast enough. */
+    if (bytes_dirty_period > (bytes_xfer_now - bytes_xfer_prev) / 2) {
+        if (++dirty_rate_high_cnt >= 2) {
+            dirty_rate_high_cnt = 0;
+            mig_throttle_guest_down();
+        }
+    } else {
+        dirty_rate_high_cnt = 0;
     }
-    return ret;
+    bytes_xfer_prev = bytes_xfer_now;
 }
 
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
-    ram_addr_t addr;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
     static int64_t num_dirty_pages_period;
     int64_t end_time;
+    int64_t sync_start;
 
     if (!start_time) {
         start_time = qemu_get_clock_ms(rt_clock);
     }
 
     trace_migration_bitmap_sync_start();
+    sync_start = qemu_get_clock_ns(rt_clock);
     memory_global_sync_dirty_bitmap(get_system_memory());
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
-            }
-        }
+        migration_dirty_pages +=
+            memory_region_test_and_clear_dirty_bitmap(block->mr, 0,
+                                                      block->length,
+                                                      DIRTY_MEMORY_MIGRATION,
+                                                      migration_bitmap);
     }
+    s->dirty_sync_count++;
+    s->dirty_sync_time = (qemu_get_clock_ns(rt_clock) - sync_start) / 1000;
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
@@ -414,287 +491,1662 @@ static void migration_bitmap_sync(void)
     if (end_time > start_time + 1000) {
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
+        if (migrate_auto_converge() && !ram_postcopy_active) {
+            mig_throttle_check(num_dirty_pages_period);
+        }
         start_time = end_time;
         num_dirty_pages_period = 0;
     }
 }
 
-/*
- * ram_save_block: Writes a page of memory to the stream f
+/* Multi-threaded page compression
  *
- * Returns:  The number of bytes written.
- *           0 means no dirty pages
+ * The migration thread hands each page to an idle compression thread and
+ * writes out the result the next time that thread is picked, or when the
+ * threads are flushed at the end of an iteration.  A page is never handed
+ * out twice between two flushes, because its dirty bit is only set again
+ * by migration_bitmap_sync().
  */
-
-static int ram_save_block(QEMUFile *f, bool last_stage)
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuCond cond;
+    /* protected by comp_done_lock */
+    bool busy;
+    bool quit;
+    /* owned by the compression thread while busy, else by the caller */
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *host;              /* NULL if page already holds the data */
+    int len;
+    uint8_t *page;
+    uint8_t *buf;
+} CompressParam;
+
+static CompressParam *comp_param;
+static int comp_thread_count;
+static int comp_level;
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+
+static void *do_data_compress(void *opaque)
 {
-    RAMBlock *block = last_seen_block;
-    ram_addr_t offset = last_offset;
-    bool complete_round = false;
-    int bytes_sent = 0;
-    MemoryRegion *mr;
-    ram_addr_t current_addr;
-
-    if (!block)
-        block = QTAILQ_FIRST(&ram_list.blocks);
+    CompressParam *param = opaque;
 
-    while (true) {
-        mr = block->mr;
-        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
-        if (complete_round && block == last_seen_block &&
-            offset >= last_offset) {
-            break;
-        }
-        if (offset >= block->length) {
-            offset = 0;
-            block = QTAILQ_NEXT(block, next);
-            if (!block) {
-                block = QTAILQ_FIRST(&ram_list.blocks);
-                complete_round = true;
-            }
-        } else {
-            uint8_t *p;
-            int cont = (block == last_sent_block) ?
-                RAM_SAVE_FLAG_CONTINUE : 0;
-
-            p = memory_region_get_ram_ptr(mr) + offset;
-
-            /* In doubt sent page as normal */
-            bytes_sent = -1;
-            if (is_dup_page(p)) {
-                acct_info.dup_pages++;
-                bytes_sent = save_block_hdr(f, block, offset, cont,
-                                            RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-                bytes_sent += 1;
-            } else if (migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
-            }
+    qemu_mutex_lock(&comp_done_lock);
+    while (!param->quit) {
+        if (param->busy) {
+            uLongf len = compressBound(TARGET_PAGE_SIZE);
 
-            /* XBZRLE overflow or normal page */
-            if (bytes_sent == -1) {
-                bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent += TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
+            qemu_mutex_unlock(&comp_done_lock);
+            /* zlib must not see the page change under its feet */
+            if (param->host) {
+                memcpy(param->page, param->host, TARGET_PAGE_SIZE);
             }
-
-            /* if page is unmodified, continue to the next */
-            if (bytes_sent > 0) {
-                last_sent_block = block;
-                break;
+            if (compress2(param->buf, &len, param->page, TARGET_PAGE_SIZE,
+                          comp_level) != Z_OK || len >= TARGET_PAGE_SIZE) {
+                /* send it uncompressed */
+                len = 0;
             }
+            qemu_mutex_lock(&comp_done_lock);
+            param->len = len;
+            param->busy = false;
+            qemu_cond_signal(&comp_done_cond);
+        } else {
+            qemu_cond_wait(&param->cond, &comp_done_lock);
         }
     }
-    last_seen_block = block;
-    last_offset = offset;
+    qemu_mutex_unlock(&comp_done_lock);
 
-    return bytes_sent;
+    return NULL;
 }
 
-static uint64_t bytes_transferred;
-
-static ram_addr_t ram_save_remaining(void)
+static void compress_threads_save_setup(void)
 {
-    return migration_dirty_pages;
-}
+    int i;
 
-uint64_t ram_bytes_remaining(void)
-{
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
+    comp_thread_count = migrate_compress_threads();
+    comp_level = migrate_compress_level();
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    for (i = 0; i < comp_thread_count; i++) {
+        comp_param[i].page = g_malloc(TARGET_PAGE_SIZE);
+        comp_param[i].buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(&comp_param[i].thread, do_data_compress,
+                           comp_param + i, QEMU_THREAD_JOINABLE);
+    }
 }
 
-uint64_t ram_bytes_transferred(void)
+static void compress_threads_save_cleanup(void)
 {
-    return bytes_transferred;
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_mutex_lock(&comp_done_lock);
+        comp_param[i].quit = true;
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_done_lock);
+        qemu_thread_join(&comp_param[i].thread);
+        qemu_cond_destroy(&comp_param[i].cond);
+        g_free(comp_param[i].page);
+        g_free(comp_param[i].buf);
+    }
+    qemu_cond_destroy(&comp_done_cond);
+    qemu_mutex_destroy(&comp_done_lock);
+    g_free(comp_param);
+    comp_param = NULL;
 }
 
-uint64_t ram_bytes_total(void)
+/* Writes out the result of the last page handed to an idle thread */
+static int save_compressed_page(QEMUFile *f, CompressParam *param)
 {
-    RAMBlock *block;
-    uint64_t total = 0;
+    int cont, bytes_sent;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next)
-        total += block->length;
+    if (!param->block) {
+        return 0;
+    }
 
-    return total;
+    cont = (param->block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    if (param->len) {
+        bytes_sent = save_block_hdr(f, param->block, param->offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_sent += 4 + param->len;
+        acct_info.compress_pages++;
+        acct_info.compress_bytes += bytes_sent;
+    } else {
+        bytes_sent = save_block_hdr(f, param->block, param->offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->page, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+    last_sent_block = param->block;
+    param->block = NULL;
+
+    return bytes_sent;
 }
 
-static void migration_end(void)
+static int flush_compressed_data(QEMUFile *f)
 {
-    if (migration_bitmap) {
-        memory_global_dirty_log_stop();
-        g_free(migration_bitmap);
-        migration_bitmap = NULL;
+    int idx, bytes_sent = 0;
+
+    if (!comp_param) {
+        return 0;
     }
 
-    if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
-        g_free(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
-        g_free(XBZRLE.decoded_buf);
-        XBZRLE.cache = NULL;
+    for (idx = 0; idx < comp_thread_count; idx++) {
+        qemu_mutex_lock(&comp_done_lock);
+        while (comp_param[idx].busy) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+        qemu_mutex_unlock(&comp_done_lock);
+        bytes_sent += save_compressed_page(f, &comp_param[idx]);
     }
+    return bytes_sent;
 }
 
-static void ram_migration_cancel(void *opaque)
+/*
+ * Hands the page to an idle compression thread.  Returns the number of
+ * bytes written for the page that thread compressed before, which may
+ * be 0; the new page is accounted when its own data is written out.
+ * With copy set, p is copied before returning; use it for buffers that
+ * may go away before the thread runs, such as XBZRLE cache entries.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset, uint8_t *p,
+                                           bool copy)
 {
-    migration_end();
-}
+    CompressParam *param = NULL;
+    int idx, bytes_sent;
+
+    qemu_mutex_lock(&comp_done_lock);
+    while (!param) {
+        for (idx = 0; idx < comp_thread_count; idx++) {
+            if (!comp_param[idx].busy) {
+                param = &comp_param[idx];
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
 
-static void reset_ram_globals(void)
-{
-    last_seen_block = NULL;
-    last_sent_block = NULL;
-    last_offset = 0;
-    last_version = ram_list.version;
+    bytes_sent = save_compressed_page(f, param);
+
+    param->block = block;
+    param->offset = offset;
+    if (copy) {
+        memcpy(param->page, p, TARGET_PAGE_SIZE);
+        param->host = NULL;
+    } else {
+        param->host = p;
+    }
+
+    qemu_mutex_lock(&comp_done_lock);
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&comp_done_lock);
+
+    return bytes_sent;
 }
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+/* Multiple RAM channels
+ *
+ * With TCP, normal pages can be spread over extra connections, each with a
+ * sender thread of its own; a page always goes to the same channel.  Every
+ * end of section is a sync point: the channels send all the pages they were
+ * handed and an end marker, and the destination does not go past the end of
+ * the section before it has seen the marker on every channel.  A page is
+ * sent at most once between two sync points, so pages cannot overtake each
+ * other.  The sender threads read the pages straight from guest memory,
+ * which is why XBZRLE, whose cache must match what was sent, keeps all pages
+ * on the main stream.
+ */
+#define RAM_CHANNEL_BATCH 64
 
-static int ram_save_setup(QEMUFile *f, void *opaque)
-{
+typedef struct RAMChannelPage {
     RAMBlock *block;
-    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
-
-    migration_bitmap = bitmap_new(ram_pages);
-    bitmap_set(migration_bitmap, 0, ram_pages);
-    migration_dirty_pages = ram_pages;
+    ram_addr_t offset;
+} RAMChannelPage;
+
+typedef struct RAMChannel {
+    int fd;
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* protected by mutex */
+    RAMChannelPage pages[RAM_CHANNEL_BATCH];
+    int nr_pages;
+    int sync_requested;
+    int sync_done;
+    int error;
+    bool quit;
+    /* owned by the channel thread */
+    RAMBlock *last_block;
+    QEMUFile *file;
+} RAMChannel;
+
+/* the main stream is channel 0 and is not part of the array */
+static RAMChannel *ram_channels;
+static int ram_channel_count;
+static uint64_t ram_channel_bytes;
+/* connected by ram_channels_connect(), not yet handed to a channel thread */
+static int *ram_channel_fds;
+static int ram_channel_nr_fds;
+
+uint64_t ram_channels_bytes_transferred(void)
+{
+    return ram_channel_bytes;
+}
 
-    qemu_mutex_lock_ramlist();
-    bytes_transferred = 0;
-    reset_ram_globals();
+static int ram_channel_send(RAMChannel *c, RAMChannelPage *pages, int nr)
+{
+    struct iovec iov[RAM_CHANNEL_BATCH * 2];
+    uint8_t hdr[RAM_CHANNEL_BATCH][8 + 1 + 256];
+    size_t size = 0;
+    int i, iovcnt = 0;
+
+    for (i = 0; i < nr; i++) {
+        RAMBlock *block = pages[i].block;
+        size_t hdr_len = 8;
+
+        if (block == c->last_block) {
+            stq_be_p(hdr[i], pages[i].offset | RAM_SAVE_FLAG_PAGE |
+                     RAM_SAVE_FLAG_CONTINUE);
+        } else {
+            int len = strlen(block->idstr);
 
-    if (migrate_use_xbzrle()) {
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
-        if (!XBZRLE.cache) {
-            DPRINTF("Error creating cache\n");
-            return -1;
+            stq_be_p(hdr[i], pages[i].offset | RAM_SAVE_FLAG_PAGE);
+            hdr[i][8] = len;
+            memcpy(hdr[i] + 9, block->idstr, len);
+            hdr_len += 1 + len;
+            c->last_block = block;
         }
-        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
-        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
-        acct_clear();
+        iov[iovcnt].iov_base = hdr[i];
+        iov[iovcnt++].iov_len = hdr_len;
+        iov[iovcnt].iov_base = memory_region_get_ram_ptr(block->mr) +
+                               pages[i].offset;
+        iov[iovcnt++].iov_len = TARGET_PAGE_SIZE;
+        size += hdr_len + TARGET_PAGE_SIZE;
     }
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
-
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
-
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        qemu_put_byte(f, strlen(block->idstr));
-        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-        qemu_put_be64(f, block->length);
+    if (iov_send(c->fd, iov, iovcnt, 0, size) != size) {
+        return -EIO;
     }
-
-    qemu_mutex_unlock_ramlist();
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-
     return 0;
 }
 
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+static void *ram_channel_send_thread(void *opaque)
 {
-    int ret;
-    int i;
-    int64_t t0;
-    int total_sent = 0;
+    RAMChannel *c = opaque;
+    RAMChannelPage pages[RAM_CHANNEL_BATCH];
 
-    qemu_mutex_lock_ramlist();
+    qemu_mutex_lock(&c->mutex);
+    while (!c->quit) {
+        bool sync = c->sync_done != c->sync_requested;
+        int nr = c->nr_pages;
+        int ret = c->error;
 
-    if (ram_list.version != last_version) {
-        reset_ram_globals();
-    }
+        if (nr < RAM_CHANNEL_BATCH && !sync) {
+            qemu_cond_wait(&c->cond, &c->mutex);
+            continue;
+        }
 
-    t0 = qemu_get_clock_ns(rt_clock);
-    i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+        memcpy(pages, c->pages, nr * sizeof(pages[0]));
+        c->nr_pages = 0;
+        qemu_cond_broadcast(&c->cond);
+        qemu_mutex_unlock(&c->mutex);
 
-        bytes_sent = ram_save_block(f, false);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
-            break;
+        if (!ret && nr) {
+            ret = ram_channel_send(c, pages, nr);
         }
-        total_sent += bytes_sent;
-        acct_info.iterations++;
-        /* we want to check in the 1st loop, just in case it was the 1st time
-           and we had to sync the dirty bitmap.
-           qemu_get_clock_ns() is a bit expensive, so we only check each some
-           iterations
-        */
-        if ((i & 63) == 0) {
-            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - t0) / 1000000;
-            if (t1 > MAX_WAIT) {
-                DPRINTF("big wait: %" PRIu64 " milliseconds, %d iterations\n",
-                        t1, i);
-                break;
+        if (!ret && sync) {
+            uint8_t eos[8];
+            struct iovec iov = { .iov_base = eos, .iov_len = sizeof(eos) };
+
+            stq_be_p(eos, RAM_SAVE_FLAG_EOS);
+            if (iov_send(c->fd, &iov, 1, 0, sizeof(eos)) != sizeof(eos)) {
+                ret = -EIO;
             }
         }
-        i++;
-    }
-
-    qemu_mutex_unlock_ramlist();
 
-    if (ret < 0) {
-        bytes_transferred += total_sent;
-        return ret;
+        qemu_mutex_lock(&c->mutex);
+        c->error = ret;
+        if (sync) {
+            c->sync_done++;
+            qemu_cond_broadcast(&c->cond);
+        }
     }
+    qemu_mutex_unlock(&c->mutex);
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-    total_sent += 8;
-    bytes_transferred += total_sent;
+    return NULL;
+}
 
-    return total_sent;
+static void ram_channel_queue_page(RAMChannel *c, RAMBlock *block,
+                                   ram_addr_t offset)
+{
+    qemu_mutex_lock(&c->mutex);
+    while (c->nr_pages == RAM_CHANNEL_BATCH) {
+        qemu_cond_wait(&c->cond, &c->mutex);
+    }
+    c->pages[c->nr_pages].block = block;
+    c->pages[c->nr_pages].offset = offset;
+    if (++c->nr_pages == RAM_CHANNEL_BATCH) {
+        qemu_cond_broadcast(&c->cond);
+    }
+    qemu_mutex_unlock(&c->mutex);
 }
 
-static int ram_save_complete(QEMUFile *f, void *opaque)
+/* Waits until every channel has sent its pages and an end marker */
+static int ram_channels_sync(void)
 {
-    qemu_mutex_lock_ramlist();
-    migration_bitmap_sync();
+    int i, ret = 0;
 
-    /* try transferring iterative blocks of memory */
+    for (i = 0; i < ram_channel_count; i++) {
+        RAMChannel *c = &ram_channels[i];
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
+        qemu_mutex_lock(&c->mutex);
+        c->sync_requested++;
+        qemu_cond_broadcast(&c->cond);
+        qemu_mutex_unlock(&c->mutex);
+    }
+    for (i = 0; i < ram_channel_count; i++) {
+        RAMChannel *c = &ram_channels[i];
 
-        bytes_sent = ram_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
-            break;
+        qemu_mutex_lock(&c->mutex);
+        while (c->sync_done != c->sync_requested) {
+            qemu_cond_wait(&c->cond, &c->mutex);
         }
-        bytes_transferred += bytes_sent;
+        if (c->error) {
+            ret = c->error;
+        }
+        qemu_mutex_unlock(&c->mutex);
     }
-    migration_end();
+    return ret;
+}
 
-    qemu_mutex_unlock_ramlist();
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+static void ram_channels_cleanup(void)
+{
+    int i;
 
-    return 0;
+    for (i = 0; i < ram_channel_count; i++) {
+        RAMChannel *c = &ram_channels[i];
+
+        qemu_mutex_lock(&c->mutex);
+        c->quit = true;
+        qemu_cond_broadcast(&c->cond);
+        qemu_mutex_unlock(&c->mutex);
+        /* wakes up a thread that is blocked on the socket */
+        shutdown(c->fd, 2);
+        qemu_thread_join(&c->thread);
+        if (c->file) {
+            qemu_fclose(c->file);
+        } else {
+            closesocket(c->fd);
+        }
+        qemu_cond_destroy(&c->cond);
+        qemu_mutex_destroy(&c->mutex);
+    }
+    g_free(ram_channels);
+    ram_channels = NULL;
+    ram_channel_count = 0;
 }
 
-static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+static void ram_channel_start(RAMChannel *c, int fd,
+                              void *(*fn)(void *opaque))
 {
-    uint64_t remaining_size;
-
-    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    c->fd = fd;
+    qemu_mutex_init(&c->mutex);
+    qemu_cond_init(&c->cond);
+    qemu_thread_create(&c->thread, fn, c, QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * Opens the extra connections to the destination.  Called by the migration
+ * thread before it takes the iothread lock, because connecting can block
+ * for as long as the destination takes to answer.
+ */
+int ram_channels_connect(MigrationState *s)
+{
+    int nr = migrate_channels() - 1;
+    int i;
+
+    if (nr == 0) {
+        return 0;
+    }
+    if (!s->open_channel) {
+        fprintf(stderr, "migration: RAM channels need a TCP migration, "
+                "using a single connection\n");
+        return 0;
+    }
+
+    ram_channel_fds = g_new(int, nr);
+    for (i = 0; i < nr; i++) {
+        int fd = s->open_channel(s);
+
+        if (fd < 0) {
+            ram_channel_nr_fds = i;
+            ram_channels_disconnect();
+            return fd;
+        }
+        ram_channel_fds[i] = fd;
+    }
+    ram_channel_nr_fds = nr;
+    return 0;
+}
+
+/* Closes the connections that ram_channels_save_setup() did not take over */
+void ram_channels_disconnect(void)
+{
+    int i;
+
+    for (i = 0; i < ram_channel_nr_fds; i++) {
+        closesocket(ram_channel_fds[i]);
+    }
+    g_free(ram_channel_fds);
+    ram_channel_fds = NULL;
+    ram_channel_nr_fds = 0;
+}
+
+static int ram_channels_save_setup(QEMUFile *f)
+{
+    int nr = ram_channel_nr_fds;
+    int i;
+
+    /* only a migration connects channels, savevm uses the main stream */
+    if (nr == 0) {
+        return 0;
+    }
+
+    ram_channels = g_new0(RAMChannel, nr);
+    for (i = 0; i < nr; i++) {
+        ram_channel_start(&ram_channels[i], ram_channel_fds[i],
+                          ram_channel_send_thread);
+        ram_channel_count++;
+    }
+    g_free(ram_channel_fds);
+    ram_channel_fds = NULL;
+    ram_channel_nr_fds = 0;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNELS);
+    qemu_put_be32(f, nr);
+    return 0;
+}
+
+/* Returns true if the page was handed to one of the extra channels */
+static bool ram_channels_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+    int idx;
+
+    if (!ram_channel_count || ram_postcopy_active || migrate_use_xbzrle()) {
+        return false;
+    }
+
+    idx = nr % (ram_channel_count + 1);
+    if (idx == 0) {
+        return false;
+    }
+    ram_channel_queue_page(&ram_channels[idx - 1], block, offset);
+    return true;
+}
+
+/* Fixed-ram
+ *
+ * With the fixed-ram capability the migration goes to a file in which the
+ * pages of each RAM block sit at a fixed, aligned offset:
+ *
+ *   header | pages of block 0 | pages of block 1 | ... | migration stream
+ *
+ * Pages are written there with pwrite(), and written again in place when
+ * they get dirty; the stream itself only carries the list of blocks and
+ * the device state.  Zero pages of the bulk stage are not written at all
+ * and stay holes in the file.  The destination maps the pages of the file
+ * into guest RAM, so restoring does not take time proportional to the RAM
+ * size.
+ *
+ * header = magic version stream-offset nr-blocks block...
+ * block  = idstr-length idstr length file-offset
+ */
+#define RAM_FIXED_MAGIC   0x51454652  /* "QEFR" */
+#define RAM_FIXED_VERSION 1
+/* a multiple of the page size of any host */
+#define RAM_FIXED_ALIGN   0x10000
+
+typedef struct RAMFixedBlock {
+    RAMBlock *block;
+    int64_t offset;
+} RAMFixedBlock;
+
+static RAMFixedBlock *ram_fixed_blocks;
+static int ram_fixed_nr_blocks;
+/* the migration file while fixed-ram is active, -1 otherwise */
+static int ram_fixed_fd = -1;
+static uint64_t ram_fixed_bytes;
+
+uint64_t ram_fixed_bytes_transferred(void)
+{
+    return ram_fixed_bytes;
+}
+
+#ifdef CONFIG_POSIX
+static int ram_fixed_pio(int fd, void *buf, size_t len, off_t pos,
+                         bool is_write)
+{
+    while (len > 0) {
+        ssize_t ret = is_write ? pwrite(fd, buf, len, pos)
+                               : pread(fd, buf, len, pos);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            return -errno;
+        } else if (ret == 0) {
+            return -EIO;
+        }
+        buf += ret;
+        pos += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Lays out the RAM blocks in the migration file fd, writes the header and
+ * moves fd past the pages, where the migration stream starts.
+ */
+int ram_fixed_save_header(int fd)
+{
+    RAMBlock *block;
+    size_t size = 4 + 4 + 8 + 4;
+    int64_t offset;
+    uint8_t *buf, *p;
+    int i, ret;
+
+    ram_fixed_nr_blocks = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        size += 1 + strlen(block->idstr) + 8 + 8;
+        ram_fixed_nr_blocks++;
+    }
+    g_free(ram_fixed_blocks);
+    ram_fixed_blocks = g_new(RAMFixedBlock, ram_fixed_nr_blocks);
+
+    buf = p = g_malloc0(size);
+    stl_be_p(p, RAM_FIXED_MAGIC);
+    stl_be_p(p + 4, RAM_FIXED_VERSION);
+    /* stream offset, filled in below */
+    stl_be_p(p + 16, ram_fixed_nr_blocks);
+    p += 20;
+
+    offset = QEMU_ALIGN_UP(size, RAM_FIXED_ALIGN);
+    i = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        int len = strlen(block->idstr);
+
+        *p++ = len;
+        memcpy(p, block->idstr, len);
+        p += len;
+        stq_be_p(p, block->length);
+        stq_be_p(p + 8, offset);
+        p += 16;
+
+        ram_fixed_blocks[i].block = block;
+        ram_fixed_blocks[i].offset = offset;
+        i++;
+        offset += QEMU_ALIGN_UP(block->length, RAM_FIXED_ALIGN);
+    }
+    stq_be_p(buf + 8, offset);
+
+    ret = ram_fixed_pio(fd, buf, size, 0, true);
+    g_free(buf);
+    if (ret == 0 && lseek(fd, offset, SEEK_SET) < 0) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+static int ram_fixed_read_block(RAMBlock *block, int fd, int64_t offset)
+{
+    ram_addr_t done, len;
+    int ret;
+
+    /* in chunks, so that it can be interrupted */
+    for (done = 0; done < block->length; done += len) {
+        len = MIN(block->length - done, 1 << 20);
+        ret = ram_fixed_pio(fd, block->host + done, len, offset + done, false);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * If fd is a fixed-ram migration file, maps (or else reads) its pages into
+ * guest RAM and moves fd to the start of the migration stream.
+ *
+ * Returns 1 for a fixed-ram file, 0 for a plain migration stream, and
+ * -errno on error.
+ */
+int ram_fixed_load(int fd)
+{
+    uint8_t hdr[20];
+    int64_t pos = sizeof(hdr);
+    uint64_t stream_offset;
+    uint32_t nr;
+    int ret;
+
+    if (ram_fixed_pio(fd, hdr, sizeof(hdr), 0, false) < 0 ||
+        ldl_be_p(hdr) != RAM_FIXED_MAGIC) {
+        return lseek(fd, 0, SEEK_SET) < 0 ? -errno : 0;
+    }
+    if (ldl_be_p(hdr + 4) != RAM_FIXED_VERSION) {
+        fprintf(stderr, "Unsupported fixed-ram version %u\n",
+                ldl_be_p(hdr + 4));
+        return -EINVAL;
+    }
+    stream_offset = ldq_be_p(hdr + 8);
+    nr = ldl_be_p(hdr + 16);
+
+    while (nr--) {
+        char id[256];
+        uint8_t len, buf[16];
+        uint64_t length, offset;
+        RAMBlock *block;
+
+        ret = ram_fixed_pio(fd, &len, 1, pos, false);
+        if (ret == 0) {
+            ret = ram_fixed_pio(fd, id, len, pos + 1, false);
+        }
+        if (ret == 0) {
+            ret = ram_fixed_pio(fd, buf, sizeof(buf), pos + 1 + len, false);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        id[len] = 0;
+        length = ldq_be_p(buf);
+        offset = ldq_be_p(buf + 8);
+        pos += 1 + len + sizeof(buf);
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "Unknown ramblock \"%s\", cannot "
+                    "accept migration\n", id);
+            return -EINVAL;
+        }
+        if (block->length != length || offset % RAM_FIXED_ALIGN) {
+            fprintf(stderr, "Length mismatch: %s: " RAM_ADDR_FMT
+                    " in != " RAM_ADDR_FMT "\n", id, (ram_addr_t)length,
+                    block->length);
+            return -EINVAL;
+        }
+
+        if (qemu_ram_map_file(block->offset, fd, offset) < 0) {
+            DPRINTF("reading block %s\n", id);
+            ret = ram_fixed_read_block(block, fd, offset);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return lseek(fd, stream_offset, SEEK_SET) < 0 ? -errno : 1;
+}
+
+static int ram_fixed_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    int i, ret;
+
+    for (i = 0; i < ram_fixed_nr_blocks; i++) {
+        if (ram_fixed_blocks[i].block == block) {
+            break;
+        }
+    }
+    if (i == ram_fixed_nr_blocks) {
+        /* a block was added after the layout was written */
+        qemu_file_set_error(f, -EINVAL);
+        return 1;
+    }
+
+    ret = ram_fixed_pio(ram_fixed_fd, memory_region_get_ram_ptr(block->mr) +
+                        offset, TARGET_PAGE_SIZE,
+                        ram_fixed_blocks[i].offset + offset, true);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return 1;
+    }
+    ram_fixed_bytes += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+    return TARGET_PAGE_SIZE;
+}
+#else
+static int ram_fixed_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    abort();
+}
+#endif
+
+static void ram_fixed_cleanup(void)
+{
+    g_free(ram_fixed_blocks);
+    ram_fixed_blocks = NULL;
+    ram_fixed_nr_blocks = 0;
+    ram_fixed_fd = -1;
+}
+
+/*
+ * ram_save_page: Writes the page at offset in block to the stream f
+ *
+ * Returns:  The number of bytes written.
+ *           0 means the page was not modified since it was last sent
+ */
+static int ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         bool last_stage)
+{
+    int bytes_sent;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    ram_addr_t current_addr;
+    uint8_t *p;
+    bool send_async = true;
+
+    if (ram_fixed_fd >= 0) {
+        return ram_fixed_save_page(f, block, offset);
+    }
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    /* In doubt sent page as normal */
+    bytes_sent = -1;
+    if (is_dup_page(p)) {
+        acct_info.dup_pages++;
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_sent += 1;
+    } else if (migrate_use_xbzrle() && !ram_postcopy_active) {
+        current_addr = block->offset + offset;
+        bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                      offset, cont, last_stage);
+        if (!last_stage) {
+            p = get_cached_data(XBZRLE.cache, current_addr);
+            /* the cache entry may be replaced before the page is sent */
+            send_async = false;
+        }
+    }
+
+    /* Compress the page in a worker thread.  The page header is
+     * written later, together with the compressed data, so the
+     * last sent block is updated at that point.
+     */
+    if (bytes_sent == -1 && comp_param && !ram_postcopy_active) {
+        bytes_sent = compress_page_with_multi_thread(f, block, offset, p,
+                                                     !send_async);
+        /* a page is queued, make sure the caller keeps going */
+        return MAX(bytes_sent, 1);
+    }
+
+    /* the page header on a channel does not affect the main stream */
+    if (bytes_sent == -1 && ram_channels_queue_page(block, offset)) {
+        bytes_sent = 8 + TARGET_PAGE_SIZE;
+        ram_channel_bytes += bytes_sent;
+        acct_info.norm_pages++;
+        return bytes_sent;
+    }
+
+    /* XBZRLE overflow or normal page */
+    if (bytes_sent == -1) {
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        if (send_async) {
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        } else {
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        }
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    if (bytes_sent > 0) {
+        last_sent_block = block;
+    }
+    return bytes_sent;
+}
+
+/* Most of the memory of a freshly booted guest is zero, so zero pages come
+ * in long runs during the bulk stage.  Send up to this many of them in one
+ * go, after checking them with a single scan of the host memory.
+ */
+#define RAM_SAVE_ZERO_BATCH 64
+
+/*
+ * ram_save_zero_pages: Writes the run of dirty zero pages starting at
+ * *offset in block to the stream f.  The page at *offset must already be
+ * cleared in the migration bitmap.  On return *offset is the last page
+ * sent.
+ *
+ * Returns:  The number of bytes written, at least 1.
+ *           0 means the page at *offset is not a zero page
+ */
+static int ram_save_zero_pages(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t *offset)
+{
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + *offset;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    int bytes_sent = 0;
+    size_t max, len;
+    int i, nr;
+
+    max = MIN(RAM_SAVE_ZERO_BATCH,
+              (block->length - *offset) >> TARGET_PAGE_BITS);
+    len = buffer_find_nonzero_offset(p, max << TARGET_PAGE_BITS);
+    nr = len >> TARGET_PAGE_BITS;
+
+    for (i = 0; i < nr; i++) {
+        ram_addr_t page = *offset + ((ram_addr_t)i << TARGET_PAGE_BITS);
+
+        if (i && !migration_bitmap_test_and_reset_dirty(block->mr, page)) {
+            break;
+        }
+        acct_info.dup_pages++;
+        if (ram_fixed_fd >= 0) {
+            /* the page is a hole in the file, which reads as zero */
+            continue;
+        }
+        bytes_sent += save_block_hdr(f, block, page, cont,
+                                     RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent += 1;
+        cont = RAM_SAVE_FLAG_CONTINUE;
+    }
+
+    if (i == 0) {
+        return 0;
+    }
+    *offset += (ram_addr_t)(i - 1) << TARGET_PAGE_BITS;
+    if (bytes_sent) {
+        last_sent_block = block;
+    }
+    /* nothing may have been written, make sure the caller keeps going */
+    return MAX(bytes_sent, 1);
+}
+
+/*
+ * ram_save_block: Writes a page of memory to the stream f
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no dirty pages
+ */
+
+static int ram_save_block(QEMUFile *f, bool last_stage)
+{
+    RAMBlock *block = last_seen_block;
+    ram_addr_t offset = last_offset;
+    bool complete_round = false;
+    int bytes_sent = 0;
+    MemoryRegion *mr;
+
+    if (!block)
+        block = QTAILQ_FIRST(&ram_list.blocks);
+
+    while (true) {
+        mr = block->mr;
+        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        if (complete_round && block == last_seen_block &&
+            offset >= last_offset) {
+            break;
+        }
+        if (offset >= block->length) {
+            offset = 0;
+            block = QTAILQ_NEXT(block, next);
+            if (!block) {
+                block = QTAILQ_FIRST(&ram_list.blocks);
+                complete_round = true;
+                ram_bulk_stage = false;
+            }
+        } else {
+            bytes_sent = 0;
+            if (ram_bulk_stage && !ram_postcopy_active) {
+                bytes_sent = ram_save_zero_pages(f, block, &offset);
+            }
+            if (!bytes_sent) {
+                bytes_sent = ram_save_page(f, block, offset, last_stage);
+            }
+
+            /* if page is unmodified, continue to the next */
+            if (bytes_sent > 0) {
+                break;
+            }
+        }
+    }
+    last_seen_block = block;
+    last_offset = offset;
+
+    return bytes_sent;
+}
+
+static uint64_t bytes_transferred;
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next)
+        total += block->length;
+
+    return total;
+}
+
+static void migration_end(void)
+{
+    if (migration_bitmap) {
+        memory_global_dirty_log_stop();
+        g_free(migration_bitmap);
+        migration_bitmap = NULL;
+    }
+
+    if (XBZRLE.cache) {
+        cache_fini(XBZRLE.cache);
+        g_free(XBZRLE.cache);
+        g_free(XBZRLE.encoded_buf);
+        g_free(XBZRLE.current_buf);
+        g_free(XBZRLE.decoded_buf);
+        XBZRLE.cache = NULL;
+    }
+
+    compress_threads_save_cleanup();
+    ram_channels_cleanup();
+    ram_fixed_cleanup();
+}
+
+static void ram_migration_cancel(void *opaque)
+{
+    migration_end();
+}
+
+static void reset_ram_globals(void)
+{
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
+    last_version = ram_list.version;
+    ram_postcopy_active = false;
+    bytes_xfer_prev = 0;
+    dirty_rate_high_cnt = 0;
+}
+
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+static int ram_save_setup(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    int ret;
+
+    if (migrate_fixed_ram()) {
+        if (!ram_fixed_blocks) {
+            fprintf(stderr, "migration: fixed-ram needs a file: migration\n");
+            return -EINVAL;
+        }
+        ram_fixed_fd = qemu_get_fd(f);
+        ram_fixed_bytes = 0;
+    } else {
+        ram_fixed_cleanup();
+    }
+
+    migration_bitmap = bitmap_new(ram_pages);
+    bitmap_set(migration_bitmap, 0, ram_pages);
+    ram_bulk_stage = true;
+    migration_dirty_pages = ram_pages;
+
+    qemu_mutex_lock_ramlist();
+    bytes_transferred = 0;
+    reset_ram_globals();
+
+    if (migrate_use_xbzrle()) {
+        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                  TARGET_PAGE_SIZE,
+                                  TARGET_PAGE_SIZE);
+        if (!XBZRLE.cache) {
+            DPRINTF("Error creating cache\n");
+            return -1;
+        }
+        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+        acct_clear();
+    }
+
+    if (migrate_use_compression()) {
+        compress_threads_save_setup();
+        acct_clear();
+    }
+
+    memory_global_dirty_log_start();
+    migration_bitmap_sync();
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+
+    ret = ram_channels_save_setup(f);
+    if (ret == 0) {
+        ret = ram_channels_sync();
+    }
+    qemu_mutex_unlock_ramlist();
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    int ret;
+    int i;
+    int64_t t0;
+    int total_sent = 0;
+
+    qemu_mutex_lock_ramlist();
+
+    if (ram_list.version != last_version) {
+        reset_ram_globals();
+    }
+
+    t0 = qemu_get_clock_ns(rt_clock);
+    i = 0;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, false);
+        /* no more blocks to sent */
+        if (bytes_sent == 0) {
+            break;
+        }
+        total_sent += bytes_sent;
+        acct_info.iterations++;
+        /* we want to check in the 1st loop, just in case it was the 1st time
+           and we had to sync the dirty bitmap.
+           qemu_get_clock_ns() is a bit expensive, so we only check each some
+           iterations
+        */
+        if ((i & 63) == 0) {
+            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - t0) / 1000000;
+            if (t1 > MAX_WAIT) {
+                DPRINTF("big wait: %" PRIu64 " milliseconds, %d iterations\n",
+                        t1, i);
+                break;
+            }
+        }
+        i++;
+    }
+
+    total_sent += flush_compressed_data(f);
+    if (ret >= 0) {
+        ret = ram_channels_sync();
+    }
+
+    qemu_mutex_unlock_ramlist();
+
+    if (ret < 0) {
+        bytes_transferred += total_sent;
+        return ret;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    total_sent += 8;
+    bytes_transferred += total_sent;
+
+    return total_sent;
+}
+
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    int ret;
+
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+
+    /* try transferring iterative blocks of memory */
+
+    /* flush all remaining blocks regardless of rate limiting */
+    while (true) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, true);
+        /* no more blocks to sent */
+        if (bytes_sent == 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+    }
+    bytes_transferred += flush_compressed_data(f);
+    ret = ram_channels_sync();
+    migration_end();
+
+    qemu_mutex_unlock_ramlist();
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+{
+    uint64_t remaining_size;
+
+    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
 
     if (remaining_size < max_size) {
         migration_bitmap_sync();
         remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
     }
-    return remaining_size;
+    return remaining_size;
+}
+
+static int ram_load(QEMUFile *f, void *opaque, int version_id);
+
+/* Post-copy
+ *
+ * Once the source switches to post-copy, the guest runs on the destination
+ * while the rest of its RAM is still in flight.  The source first sends the
+ * list of pages that are still dirty; the destination makes them
+ * inaccessible, and a vCPU or device that touches one of them traps into
+ * postcopy_sigsegv_handler(), which asks the source for the page over the
+ * migration socket and waits for it to arrive.  Meanwhile the source pushes
+ * all remaining pages in the background and serves requested pages first.
+ *
+ * Trapping faults with mprotect() and SIGSEGV only works for accesses made
+ * by QEMU itself, so the destination must run with TCG.  The kernel returns
+ * EFAULT instead of faulting when a system call touches a missing page, so
+ * address_space_map() pulls in the pages it hands out for DMA with
+ * ram_postcopy_fault_in() before they reach preadv(), linux-aio or tap.
+ */
+
+static int ram_postcopy_send_block_ranges(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long base = block->offset >> TARGET_PAGE_BITS;
+    unsigned long size = base + (block->length >> TARGET_PAGE_BITS);
+    unsigned long start, end;
+    uint64_t nr_ranges = 0;
+    int len = strlen(block->idstr);
+
+    for (start = find_next_bit(migration_bitmap, size, base); start < size;
+         start = find_next_bit(migration_bitmap, size, end)) {
+        end = find_next_zero_bit(migration_bitmap, size, start);
+        nr_ranges++;
+    }
+    if (!nr_ranges) {
+        return 0;
+    }
+
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)block->idstr, len);
+    qemu_put_be64(f, nr_ranges);
+    for (start = find_next_bit(migration_bitmap, size, base); start < size;
+         start = find_next_bit(migration_bitmap, size, end)) {
+        end = find_next_zero_bit(migration_bitmap, size, start);
+        qemu_put_be64(f, (start - base) << TARGET_PAGE_BITS);
+        qemu_put_be64(f, (end - start) << TARGET_PAGE_BITS);
+    }
+    return 1 + len + 8 + nr_ranges * 16;
+}
+
+/*
+ * Called with the VM stopped: tells the destination which pages have not
+ * been sent yet, or were dirtied after they were.
+ */
+static int ram_save_postcopy(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+    int bytes_sent = 0;
+
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+    bytes_transferred += flush_compressed_data(f);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        bytes_sent += ram_postcopy_send_block_ranges(f, block);
+    }
+    qemu_put_byte(f, 0);
+    bytes_transferred += bytes_sent + 1;
+
+    /* the destination reads the rest with a fresh idea of the last block */
+    last_sent_block = NULL;
+    ram_postcopy_active = true;
+    qemu_mutex_unlock_ramlist();
+
+    return qemu_file_get_error(f);
+}
+
+static void ram_postcopy_send_requested(QEMUFile *f, ram_addr_t addr)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+            ram_addr_t offset = (addr - block->offset) & TARGET_PAGE_MASK;
+            unsigned long nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+
+            /* already on its way otherwise */
+            if (test_and_clear_bit(nr, migration_bitmap)) {
+                migration_dirty_pages--;
+                bytes_transferred += ram_save_page(f, block, offset, true);
+            }
+            return;
+        }
+    }
+}
+
+#define POSTCOPY_PAGES_PER_ITERATION 64
+
+/*
+ * Sends a batch of the remaining pages, serving the pages requested by the
+ * destination first.  Returns 1 once all pages have been sent, 0 if there
+ * are more, negative on error.
+ */
+int ram_postcopy_iterate(QEMUFile *f, int fd)
+{
+    static uint8_t req[8];
+    static int req_len;
+    int i;
+
+    qemu_mutex_lock_ramlist();
+    for (i = 0; i < POSTCOPY_PAGES_PER_ITERATION; i++) {
+        int bytes_sent;
+
+#ifdef CONFIG_LINUX
+        for (;;) {
+            ssize_t len = recv(fd, req + req_len, sizeof(req) - req_len,
+                               MSG_DONTWAIT);
+            if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+                qemu_mutex_unlock_ramlist();
+                return -EIO;
+            } else if (len < 0) {
+                break;
+            }
+            req_len += len;
+            if (req_len == sizeof(req)) {
+                ram_postcopy_send_requested(f, ldq_be_p(req));
+                req_len = 0;
+            }
+        }
+#endif
+
+        bytes_sent = ram_save_block(f, true);
+        if (bytes_sent == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            migration_end();
+            qemu_mutex_unlock_ramlist();
+            return qemu_file_get_error(f) ?: 1;
+        }
+        bytes_transferred += bytes_sent;
+    }
+    qemu_mutex_unlock_ramlist();
+
+    return qemu_file_get_error(f);
+}
+
+#ifdef CONFIG_LINUX
+typedef struct PostcopyBlock {
+    uintptr_t host;
+    ram_addr_t offset;
+    ram_addr_t length;
+} PostcopyBlock;
+
+static struct {
+    /* pages that have not arrived yet, indexed by ram_addr */
+    unsigned long *missing;
+    /* copy of the RAM block list that the signal handler can walk without
+     * taking locks; RAM blocks cannot come and go during post-copy */
+    PostcopyBlock *blocks;
+    int nr_blocks;
+    /* the migration socket, used to ask for missing pages */
+    int fd;
+    /* /proc/self/mem, to fill pages the guest cannot access yet */
+    int mem_fd;
+    QEMUFile *file;
+    QemuThread thread;
+    uint8_t *page;
+    struct sigaction old_action;
+    /* number of threads inside postcopy_sigsegv_handler() */
+    int faulting;
+} postcopy_incoming = {
+    .fd = -1,
+    .mem_fd = -1,
+};
+
+/* Async-signal-safe: translates a host address in guest RAM to a page index */
+static bool postcopy_find_page(void *host, unsigned long *nr)
+{
+    uintptr_t addr = (uintptr_t)host;
+    int i;
+
+    for (i = 0; i < postcopy_incoming.nr_blocks; i++) {
+        PostcopyBlock *b = &postcopy_incoming.blocks[i];
+
+        if (addr - b->host < b->length) {
+            *nr = (b->offset + (addr - b->host)) >> TARGET_PAGE_BITS;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool postcopy_page_missing(void *host, unsigned long *nr)
+{
+    if (!postcopy_incoming.missing || !postcopy_find_page(host, nr)) {
+        return false;
+    }
+    return test_bit(*nr, postcopy_incoming.missing);
+}
+
+static void postcopy_sigsegv_handler(int sig, siginfo_t *info, void *ctx)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 50000 };
+    int saved_errno = errno;
+    unsigned long nr;
+    uint8_t req[8];
+    size_t done = 0;
+
+    __sync_fetch_and_add(&postcopy_incoming.faulting, 1);
+
+    if (!postcopy_find_page(info->si_addr, &nr)) {
+        /* Not guest RAM: a real crash, fault again with the previous action */
+        sigaction(SIGSEGV, &postcopy_incoming.old_action, NULL);
+        goto out;
+    }
+    if (!test_bit(nr, postcopy_incoming.missing)) {
+        /* The page arrived since the fault; just retry the access */
+        goto out;
+    }
+
+    stq_be_p(req, (uint64_t)nr << TARGET_PAGE_BITS);
+    while (done < sizeof(req)) {
+        ssize_t len = write(postcopy_incoming.fd, req + done,
+                            sizeof(req) - done);
+        if (len < 0 && errno != EINTR) {
+            break;
+        }
+        done += MAX(len, 0);
+    }
+
+    while (test_bit(nr, postcopy_incoming.missing)) {
+        nanosleep(&ts, NULL);
+    }
+
+out:
+    __sync_fetch_and_sub(&postcopy_incoming.faulting, 1);
+    errno = saved_errno;
+}
+
+/*
+ * Makes a missing page accessible with its final contents in a single step,
+ * so that nobody can see it half written.
+ */
+static int postcopy_place_page(void *host, unsigned long nr)
+{
+    if (pwrite(postcopy_incoming.mem_fd, postcopy_incoming.page,
+               TARGET_PAGE_SIZE, (off_t)(uintptr_t)host) != TARGET_PAGE_SIZE) {
+        return -errno;
+    }
+    if (mprotect(host, TARGET_PAGE_SIZE, PROT_READ | PROT_WRITE) < 0) {
+        return -errno;
+    }
+    clear_bit(nr, postcopy_incoming.missing);
+    return 0;
+}
+
+static int postcopy_receive_page(QEMUFile *f, void *host, unsigned long nr)
+{
+    qemu_get_buffer(f, postcopy_incoming.page, TARGET_PAGE_SIZE);
+    return postcopy_place_page(host, nr);
+}
+
+static int postcopy_fill_page(void *host, unsigned long nr, uint8_t ch)
+{
+    memset(postcopy_incoming.page, ch, TARGET_PAGE_SIZE);
+    return postcopy_place_page(host, nr);
+}
+
+static void postcopy_incoming_cleanup(void)
+{
+    sigaction(SIGSEGV, &postcopy_incoming.old_action, NULL);
+    while (postcopy_incoming.faulting) {
+        g_usleep(1000);
+    }
+
+    if (postcopy_incoming.mem_fd >= 0) {
+        close(postcopy_incoming.mem_fd);
+        postcopy_incoming.mem_fd = -1;
+    }
+    g_free(postcopy_incoming.missing);
+    postcopy_incoming.missing = NULL;
+    g_free(postcopy_incoming.page);
+    postcopy_incoming.page = NULL;
+    postcopy_incoming.nr_blocks = 0;
+    g_free(postcopy_incoming.blocks);
+    postcopy_incoming.blocks = NULL;
+}
+
+/*
+ * Makes sure that the pages in a range of guest RAM are present before the
+ * host kernel accesses them, e.g. for DMA: the kernel fails such accesses
+ * with EFAULT instead of raising a signal.  Touching the pages from QEMU
+ * goes through postcopy_sigsegv_handler() and waits for them to arrive.
+ */
+void ram_postcopy_fault_in(void *host, size_t len)
+{
+    uintptr_t addr, end;
+
+    if (!postcopy_incoming.missing || !len) {
+        return;
+    }
+
+    end = (uintptr_t)host + len;
+    for (addr = (uintptr_t)host & TARGET_PAGE_MASK; addr < end;
+         addr += TARGET_PAGE_SIZE) {
+        (void)*(volatile uint8_t *)addr;
+    }
+}
+
+static void *postcopy_incoming_thread(void *opaque)
+{
+    QEMUFile *f = postcopy_incoming.file;
+    int64_t nr_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    int ret;
+
+    ret = ram_load(f, NULL, 4);
+    if (ret == 0 && !bitmap_empty(postcopy_incoming.missing, nr_pages)) {
+        ret = -EINVAL;
+    }
+    if (ret < 0) {
+        /* the source has stopped, the guest cannot go on without its RAM */
+        fprintf(stderr, "postcopy: failed to receive guest RAM: %s\n",
+                strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    DPRINTF("postcopy: all pages received\n");
+    postcopy_incoming_cleanup();
+    qemu_fclose(f);
+    return NULL;
+}
+
+/*
+ * Reads the list of pages that the source has not sent yet and makes them
+ * inaccessible, so that the first access asks the source for them.
+ */
+static int ram_load_postcopy(QEMUFile *f, void *opaque)
+{
+    int64_t nr_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    struct sigaction act;
+    struct stat st;
+    RAMBlock *block;
+    char id[256];
+    uint8_t len;
+    int i;
+
+    if (kvm_enabled() || mem_path || getpagesize() != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "postcopy: needs TCG and anonymous memory with "
+                "host-sized pages\n");
+        return -ENOTSUP;
+    }
+
+    /* the extra RAM channels are idle since the last end of section */
+    ram_channels_cleanup();
+
+    postcopy_incoming.fd = qemu_get_fd(f);
+    if (postcopy_incoming.fd < 0 || fstat(postcopy_incoming.fd, &st) < 0 ||
+        !S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "postcopy: migration channel is not a socket\n");
+        return -EINVAL;
+    }
+
+    postcopy_incoming.mem_fd = open("/proc/self/mem", O_RDWR);
+    if (postcopy_incoming.mem_fd < 0) {
+        return -errno;
+    }
+    postcopy_incoming.missing = bitmap_new(nr_pages);
+    postcopy_incoming.page = g_malloc(TARGET_PAGE_SIZE);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        postcopy_incoming.nr_blocks++;
+    }
+    postcopy_incoming.blocks = g_new(PostcopyBlock,
+                                     postcopy_incoming.nr_blocks);
+    i = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        postcopy_incoming.blocks[i].host =
+            (uintptr_t)memory_region_get_ram_ptr(block->mr);
+        postcopy_incoming.blocks[i].offset = block->offset;
+        postcopy_incoming.blocks[i].length = block->length;
+        i++;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = postcopy_sigsegv_handler;
+    act.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &act, &postcopy_incoming.old_action);
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        uint64_t nr_ranges;
+
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "postcopy: unknown ramblock \"%s\"\n", id);
+            goto fail;
+        }
+
+        for (nr_ranges = qemu_get_be64(f); nr_ranges; nr_ranges--) {
+            ram_addr_t start = qemu_get_be64(f);
+            ram_addr_t length = qemu_get_be64(f);
+            uint8_t *host = memory_region_get_ram_ptr(block->mr) + start;
+
+            if (start + length > block->length || start + length < start ||
+                (start | length) & ~TARGET_PAGE_MASK) {
+                fprintf(stderr, "postcopy: bad range in \"%s\"\n", id);
+                goto fail;
+            }
+            bitmap_set(postcopy_incoming.missing,
+                       (block->offset + start) >> TARGET_PAGE_BITS,
+                       length >> TARGET_PAGE_BITS);
+            qemu_madvise(host, length, QEMU_MADV_DONTNEED);
+            if (mprotect(host, length, PROT_NONE) < 0) {
+                goto fail;
+            }
+        }
+        if (qemu_file_get_error(f)) {
+            goto fail;
+        }
+    }
+    return qemu_file_get_error(f);
+
+fail:
+    postcopy_incoming_cleanup();
+    return -EINVAL;
+}
+
+/* From now on the remaining pages are received in a thread of their own */
+void ram_postcopy_incoming_listen(QEMUFile *f)
+{
+    postcopy_incoming.file = f;
+    qemu_set_block(postcopy_incoming.fd);
+    qemu_thread_create(&postcopy_incoming.thread, postcopy_incoming_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+}
+#else
+static bool postcopy_page_missing(void *host, unsigned long *nr)
+{
+    return false;
+}
+
+static int postcopy_receive_page(QEMUFile *f, void *host, unsigned long nr)
+{
+    return -ENOTSUP;
+}
+
+static int postcopy_fill_page(void *host, unsigned long nr, uint8_t ch)
+{
+    return -ENOTSUP;
+}
+
+static int ram_load_postcopy(QEMUFile *f, void *opaque)
+{
+    fprintf(stderr, "postcopy: not supported on this host\n");
+    return -ENOTSUP;
 }
 
+void ram_postcopy_incoming_listen(QEMUFile *f)
+{
+    abort();
+}
+
+void ram_postcopy_fault_in(void *host, size_t len)
+{
+}
+#endif
+
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 {
     int ret, rc = 0;
@@ -736,11 +2188,153 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return rc;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+/* Multi-threaded page decompression on the destination.  All pages of a
+ * section are decompressed before ram_load() returns.
+ */
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuCond cond;
+    /* protected by decomp_done_lock */
+    bool busy;
+    bool quit;
+    /* owned by the decompression thread while busy, else by the caller */
+    void *des;
+    uint8_t *compbuf;
+    int len;
+} DecompressParam;
+
+static DecompressParam *decomp_param;
+static int decomp_thread_count;
+static bool decomp_error;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+
+static void *do_data_decompress(void *opaque)
 {
-    static RAMBlock *block = NULL;
+    DecompressParam *param = opaque;
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (!param->quit) {
+        if (param->busy) {
+            uLongf pagesize = TARGET_PAGE_SIZE;
+            int ret;
+
+            qemu_mutex_unlock(&decomp_done_lock);
+            ret = uncompress(param->des, &pagesize, param->compbuf,
+                             param->len);
+            qemu_mutex_lock(&decomp_done_lock);
+            if (ret != Z_OK || pagesize != TARGET_PAGE_SIZE) {
+                decomp_error = true;
+            }
+            param->busy = false;
+            qemu_cond_signal(&decomp_done_cond);
+        } else {
+            qemu_cond_wait(&param->cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return NULL;
+}
+
+static void decompress_threads_load_setup(void)
+{
+    int i;
+
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    decomp_error = false;
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < decomp_thread_count; i++) {
+        decomp_param[i].compbuf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_cond_init(&decomp_param[i].cond);
+        qemu_thread_create(&decomp_param[i].thread, do_data_decompress,
+                           decomp_param + i, QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_mutex_lock(&decomp_done_lock);
+        decomp_param[i].quit = true;
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_done_lock);
+        qemu_thread_join(&decomp_param[i].thread);
+        qemu_cond_destroy(&decomp_param[i].cond);
+        g_free(decomp_param[i].compbuf);
+    }
+    qemu_cond_destroy(&decomp_done_cond);
+    qemu_mutex_destroy(&decomp_done_lock);
+    g_free(decomp_param);
+    decomp_param = NULL;
+}
+
+/* Returns -1 if any page failed to decompress */
+static int wait_for_decompress_done(void)
+{
+    int idx;
+
+    if (!decomp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (idx = 0; idx < decomp_thread_count; idx++) {
+        while (decomp_param[idx].busy) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return decomp_error ? -1 : 0;
+}
+
+static void decompress_data_with_multi_thread(QEMUFile *f, void *host,
+                                              int len)
+{
+    DecompressParam *param = NULL;
+    int idx;
+
+    if (!decomp_param) {
+        decompress_threads_load_setup();
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (!param) {
+        for (idx = 0; idx < decomp_thread_count; idx++) {
+            if (!decomp_param[idx].busy) {
+                param = &decomp_param[idx];
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    qemu_get_buffer(f, param->compbuf, len);
+    param->des = host;
+    param->len = len;
+
+    qemu_mutex_lock(&decomp_done_lock);
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&decomp_done_lock);
+}
+
+/* last_block tracks RAM_SAVE_FLAG_CONTINUE for one stream */
+static void *host_from_block_offset(QEMUFile *f, RAMBlock **last_block,
+                                    ram_addr_t offset, int flags)
+{
+    RAMBlock *block = *last_block;
     char id[256];
     uint8_t len;
 
@@ -758,14 +2352,127 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     id[len] = 0;
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *last_block = block;
             return memory_region_get_ram_ptr(block->mr) + offset;
+        }
     }
+    *last_block = NULL;
 
     fprintf(stderr, "Can't find block %s!\n", id);
     return NULL;
 }
 
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    static RAMBlock *block = NULL;
+
+    return host_from_block_offset(f, &block, offset, flags);
+}
+
+static void *ram_channel_recv_thread(void *opaque)
+{
+    RAMChannel *c = opaque;
+    int ret;
+
+    do {
+        ram_addr_t addr = qemu_get_be64(c->file);
+        int flags = addr & ~TARGET_PAGE_MASK;
+        void *host;
+
+        addr &= TARGET_PAGE_MASK;
+        ret = qemu_file_get_error(c->file);
+        if (ret == 0 && flags == RAM_SAVE_FLAG_EOS) {
+            qemu_mutex_lock(&c->mutex);
+            c->sync_done++;
+            qemu_cond_broadcast(&c->cond);
+            qemu_mutex_unlock(&c->mutex);
+        } else if (ret == 0 && (flags & RAM_SAVE_FLAG_PAGE)) {
+            host = host_from_block_offset(c->file, &c->last_block, addr,
+                                          flags);
+            if (!host) {
+                ret = -EINVAL;
+            } else {
+                qemu_get_buffer(c->file, host, TARGET_PAGE_SIZE);
+                ret = qemu_file_get_error(c->file);
+            }
+        } else if (ret == 0) {
+            ret = -EINVAL;
+        }
+    } while (ret == 0);
+
+    qemu_mutex_lock(&c->mutex);
+    if (!c->quit) {
+        fprintf(stderr, "migration: RAM channel failed: %s\n",
+                strerror(-ret));
+        c->error = ret;
+    }
+    qemu_cond_broadcast(&c->cond);
+    qemu_mutex_unlock(&c->mutex);
+
+    return NULL;
+}
+
+static int ram_channels_load_setup(QEMUFile *f)
+{
+    int nr = qemu_get_be32(f);
+    int *fds;
+    int i, ret;
+
+    if (nr != migrate_channels() - 1 || ram_channel_count) {
+        fprintf(stderr, "Migration uses %d RAM channels, the destination "
+                "expects %d\n", nr + 1, migrate_channels());
+        return -EINVAL;
+    }
+
+    fds = g_new(int, nr);
+    ret = tcp_accept_incoming_channels(fds, nr);
+    if (ret < 0) {
+        g_free(fds);
+        return ret;
+    }
+
+    ram_channels = g_new0(RAMChannel, nr);
+    for (i = 0; i < nr; i++) {
+        ram_channels[i].file = qemu_fopen_socket(fds[i]);
+        ram_channel_start(&ram_channels[i], fds[i], ram_channel_recv_thread);
+    }
+    ram_channel_count = nr;
+    g_free(fds);
+    return 0;
+}
+
+/* Waits until every channel has reached the end of the current section */
+static int ram_channels_load_sync(void)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < ram_channel_count; i++) {
+        RAMChannel *c = &ram_channels[i];
+
+        qemu_mutex_lock(&c->mutex);
+        c->sync_requested++;
+        while (c->sync_done < c->sync_requested && !c->error) {
+            qemu_cond_wait(&c->cond, &c->mutex);
+        }
+        if (c->error) {
+            ret = c->error;
+        }
+        qemu_mutex_unlock(&c->mutex);
+    }
+    return ret;
+}
+
+void migrate_channels_load_cleanup(void)
+{
+    /* only the destination reads the channels through a QEMUFile */
+    if (ram_channels && ram_channels[0].file) {
+        ram_channels_cleanup();
+    }
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -823,43 +2530,85 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        if (flags & RAM_SAVE_FLAG_CHANNELS) {
+            ret = ram_channels_load_setup(f);
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
             uint8_t ch;
+            unsigned long nr;
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
+            if (postcopy_page_missing(host, &nr)) {
+                ret = postcopy_fill_page(host, nr, ch);
+                if (ret < 0) {
+                    goto done;
+                }
+            } else if (ch != 0 || !is_zero_page(host)) {
+                /* Freshly allocated guest RAM is already zero; reading it
+                 * does not allocate host memory, writing it would. */
+                memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu()) &&
-                getpagesize() <= TARGET_PAGE_SIZE) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
-            }
+                if (ch == 0 &&
+                    (!kvm_enabled() || kvm_has_sync_mmu()) &&
+                    getpagesize() <= TARGET_PAGE_SIZE) {
+                    qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                }
 #endif
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
+            unsigned long nr;
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (postcopy_page_missing(host, &nr)) {
+                ret = postcopy_receive_page(f, host, nr);
+                if (ret < 0) {
+                    goto done;
+                }
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             if (load_xbzrle(f, addr, host) < 0) {
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            int len;
+
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+
+            len = qemu_get_be32(f);
+            if (len <= 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+                fprintf(stderr, "Invalid compressed data length: %d\n", len);
+                ret = -EINVAL;
+                goto done;
+            }
+            decompress_data_with_multi_thread(f, host, len);
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -868,7 +2617,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
+    ret = ram_channels_load_sync();
+
 done:
+    if (wait_for_decompress_done() < 0 && ret == 0) {
+        fprintf(stderr, "Failed to decompress page\n");
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -879,7 +2634,9 @@ SaveVMHandlers savevm_ram_handlers = {
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
     .save_live_pending = ram_save_pending,
+    .save_live_postcopy = ram_save_postcopy,
     .load_state = ram_load,
+    .load_postcopy = ram_load_postcopy,
     .cancel = ram_migration_cancel,
 };
 
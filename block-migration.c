@@ -18,6 +18,7 @@
 #include "hw/hw.h"
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "qemu/bitmap.h"
 #include "migration/block.h"
 #include "migration/migration.h"
 #include "sysemu/blockdev.h"
@@ -29,9 +30,13 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* chunks read by a single request, at most */
+#define MAX_REQUEST_CHUNKS 16
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -52,14 +57,18 @@ typedef struct BlkMigDevState {
     int64_t total_sectors;
     int64_t dirty;
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
+    /* chunks with a read in flight */
     unsigned long *aio_bitmap;
+    HBitmapIter hbi;
 } BlkMigDevState;
 
+/* a request covers one or more chunks; each is sent as its own record */
 typedef struct BlkMigBlock {
-    uint8_t *buf;
+    uint8_t *buf;               /* NULL if the range reads as zeroes */
     BlkMigDevState *bmds;
     int64_t sector;
     int nr_sectors;
+    int nr_chunks;              /* accounted in submitted/read_done */
     struct iovec iov;
     QEMUIOVector qiov;
     BlockDriverAIOCB *aiocb;
@@ -70,10 +79,12 @@ typedef struct BlkMigBlock {
 typedef struct BlkMigState {
     int blk_enable;
     int shared_base;
+    bool zero_blocks;
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
-    int submitted;
-    int read_done;
+    int reads;                  /* requests in flight */
+    int submitted;              /* chunks in flight */
+    int read_done;              /* chunks read and not sent yet */
     int transferred;
     int64_t total_sector_sum;
     int prev_progress;
@@ -85,18 +96,36 @@ static BlkMigState block_mig_state;
 
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
-    int len;
+    BlockDriverState *bs = blk->bmds->bs;
+    int len = strlen(bs->device_name);
+    int64_t sector;
+    uint8_t *buf;
 
-    /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    for (sector = blk->sector; sector < blk->sector + blk->nr_sectors;
+         sector += BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        int flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
-    /* device name */
-    len = strlen(blk->bmds->bs->device_name);
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+        buf = NULL;
+        if (blk->buf) {
+            buf = blk->buf + ((sector - blk->sector) << BDRV_SECTOR_BITS);
+        }
+        if (block_mig_state.zero_blocks &&
+            (!buf || buffer_find_nonzero_offset(buf, BLOCK_SIZE) ==
+                     BLOCK_SIZE)) {
+            flags = BLK_MIG_FLAG_ZERO_BLOCK;
+        }
+
+        /* sector number and flags */
+        qemu_put_be64(f, (sector << BDRV_SECTOR_BITS) | flags);
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+        /* device name */
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)bs->device_name, len);
+
+        if (flags & BLK_MIG_FLAG_DEVICE_BLOCK) {
+            qemu_put_buffer(f, buf, BLOCK_SIZE);
+        }
+    }
 }
 
 int blk_mig_active(void)
@@ -131,50 +160,57 @@ uint64_t blk_mig_bytes_total(void)
     return sum << BDRV_SECTOR_BITS;
 }
 
-static int bmds_aio_inflight(BlkMigDevState *bmds, int64_t sector)
+static bool bmds_aio_inflight(BlkMigDevState *bmds, int64_t sector)
 {
-    int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    if ((sector << BDRV_SECTOR_BITS) < bdrv_getlength(bmds->bs)) {
-        return !!(bmds->aio_bitmap[chunk / (sizeof(unsigned long) * 8)] &
-            (1UL << (chunk % (sizeof(unsigned long) * 8))));
-    } else {
-        return 0;
+    if (sector >= bmds->total_sectors) {
+        return false;
     }
+    return test_bit(sector / BDRV_SECTORS_PER_DIRTY_CHUNK, bmds->aio_bitmap);
 }
 
 static void bmds_set_aio_inflight(BlkMigDevState *bmds, int64_t sector_num,
-                             int nb_sectors, int set)
+                                  int nb_sectors, int set)
 {
     int64_t start, end;
-    unsigned long val, idx, bit;
 
     start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
     end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
 
-    for (; start <= end; start++) {
-        idx = start / (sizeof(unsigned long) * 8);
-        bit = start % (sizeof(unsigned long) * 8);
-        val = bmds->aio_bitmap[idx];
-        if (set) {
-            val |= 1UL << bit;
-        } else {
-            val &= ~(1UL << bit);
-        }
-        bmds->aio_bitmap[idx] = val;
+    if (set) {
+        bitmap_set(bmds->aio_bitmap, start, end - start + 1);
+    } else {
+        bitmap_clear(bmds->aio_bitmap, start, end - start + 1);
     }
 }
 
 static void alloc_aio_bitmap(BlkMigDevState *bmds)
 {
-    BlockDriverState *bs = bmds->bs;
-    int64_t bitmap_size;
+    int64_t nr_chunks;
+
+    nr_chunks = DIV_ROUND_UP(bmds->total_sectors, BDRV_SECTORS_PER_DIRTY_CHUNK);
+    bmds->aio_bitmap = bitmap_new(nr_chunks);
+}
+
+/* A chunk must not be read twice at the same time: the reads could
+ * complete out of order, and the older data would be sent last.
+ */
+static void bmds_wait_inflight(BlkMigDevState *bmds, int64_t sector)
+{
+    while (bmds_aio_inflight(bmds, sector)) {
+        qemu_aio_wait();
+    }
+}
 
-    bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS) +
-            BDRV_SECTORS_PER_DIRTY_CHUNK * 8 - 1;
-    bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * 8;
+/* Size the requests so that the reads in flight stay within what can be
+ * sent in one iteration; a slow link gets small requests, a fast one
+ * large ones.
+ */
+static int blk_mig_request_chunks(QEMUFile *f)
+{
+    int64_t limit = qemu_file_get_rate_limit(f);
+    int64_t chunks = limit / ((int64_t)migrate_block_inflight() * BLOCK_SIZE);
 
-    bmds->aio_bitmap = g_malloc0(bitmap_size);
+    return MAX(1, MIN(chunks, MAX_REQUEST_CHUNKS));
 }
 
 static void blk_mig_read_cb(void *opaque, int ret)
@@ -189,17 +225,84 @@ static void blk_mig_read_cb(void *opaque, int ret)
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
 
-    block_mig_state.submitted--;
-    block_mig_state.read_done++;
+    block_mig_state.reads--;
+    block_mig_state.submitted -= blk->nr_chunks;
+    block_mig_state.read_done += blk->nr_chunks;
     assert(block_mig_state.submitted >= 0);
 }
 
+static BlkMigBlock *blk_mig_new_block(BlkMigDevState *bmds, int64_t sector,
+                                      int nr_sectors)
+{
+    BlkMigBlock *blk = g_malloc0(sizeof(BlkMigBlock));
+
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+    return blk;
+}
+
+/* start reading the chunks at sector, and stop tracking their changes */
+static void blk_mig_submit_read(BlkMigDevState *bmds, int64_t sector,
+                                int nr_sectors)
+{
+    BlkMigBlock *blk = blk_mig_new_block(bmds, sector, nr_sectors);
+
+    blk->nr_chunks = DIV_ROUND_UP(nr_sectors, BDRV_SECTORS_PER_DIRTY_CHUNK);
+    blk->buf = g_malloc(blk->nr_chunks * BLOCK_SIZE);
+    blk->iov.iov_base = blk->buf;
+    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+    if (block_mig_state.reads == 0) {
+        block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+    }
+
+    blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                nr_sectors, blk_mig_read_cb, blk);
+    block_mig_state.reads++;
+    block_mig_state.submitted += blk->nr_chunks;
+    bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+
+    bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+}
+
+/* queue zero chunks, which take no time to read and little to send */
+static void blk_mig_queue_zero(BlkMigDevState *bmds, int64_t sector,
+                               int nr_sectors)
+{
+    BlkMigBlock *blk = blk_mig_new_block(bmds, sector, nr_sectors);
+
+    QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+    bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+}
+
+/* Return the number of sectors from the chunk-aligned sector that are
+ * known to read as zeroes, rounded down to whole chunks unless the range
+ * reaches the end of the device.
+ */
+static int bmds_zero_sectors(BlkMigDevState *bmds, int64_t sector)
+{
+    BlockDriverState *bs = bmds->bs;
+    int nr_sectors;
+
+    /* without a backing file, unallocated sectors read as zeroes */
+    if (!block_mig_state.zero_blocks || bs->backing_hd ||
+        bdrv_is_allocated(bs, sector, MAX_IS_ALLOCATED_SEARCH, &nr_sectors)) {
+        return 0;
+    }
+
+    if (sector + nr_sectors >= bmds->total_sectors) {
+        return bmds->total_sectors - sector;
+    }
+    return nr_sectors & ~(BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+}
+
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 {
     int64_t total_sectors = bmds->total_sectors;
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
-    BlkMigBlock *blk;
     int nr_sectors;
 
     if (bmds->shared_base) {
@@ -219,32 +322,17 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
-    /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-        nr_sectors = total_sectors - cur_sector;
-    }
-
-    blk = g_malloc(sizeof(BlkMigBlock));
-    blk->buf = g_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
-
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-    if (block_mig_state.submitted == 0) {
-        block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+    nr_sectors = bmds_zero_sectors(bmds, cur_sector);
+    if (nr_sectors > 0) {
+        blk_mig_queue_zero(bmds, cur_sector, nr_sectors);
+    } else {
+        /* we are going to transfer full chunks even if not allocated */
+        nr_sectors = MIN(total_sectors - cur_sector,
+                         (int64_t)blk_mig_request_chunks(f) *
+                         BDRV_SECTORS_PER_DIRTY_CHUNK);
+        blk_mig_submit_read(bmds, cur_sector, nr_sectors);
     }
 
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
-    block_mig_state.submitted++;
-
-    bdrv_reset_dirty(bs, cur_sector, nr_sectors);
     bmds->cur_sector = cur_sector + nr_sectors;
 
     return (bmds->cur_sector >= total_sectors);
@@ -295,12 +383,14 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
 
 static void init_blk_migration(QEMUFile *f)
 {
+    block_mig_state.reads = 0;
     block_mig_state.submitted = 0;
     block_mig_state.read_done = 0;
     block_mig_state.transferred = 0;
     block_mig_state.total_sector_sum = 0;
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
+    block_mig_state.zero_blocks = migrate_zero_blocks();
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
@@ -348,87 +438,72 @@ static void blk_mig_reset_dirty_cursor(void)
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         bmds->cur_dirty = 0;
+        bdrv_dirty_iter_init(bmds->bs, &bmds->hbi);
     }
 }
 
-static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
-                                 int is_async)
+/* return value:
+ * 0: a request for the next dirty chunks was queued
+ * 1: no more dirty chunks in this pass
+ */
+static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds)
 {
-    BlkMigBlock *blk;
+    BlockDriverState *bs = bmds->bs;
     int64_t total_sectors = bmds->total_sectors;
-    int64_t sector;
+    int64_t sector, next;
+    int nr_chunks, max_chunks;
     int nr_sectors;
-    int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        if (bmds_aio_inflight(bmds, sector)) {
-            bdrv_drain_all();
-        }
-        if (bdrv_get_dirty(bmds->bs, sector)) {
-
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                if (block_mig_state.submitted == 0) {
-                    block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-                }
-
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
-
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    if (bmds->cur_dirty >= total_sectors) {
+        return 1;
+    }
 
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-            break;
+    /* The iterator may return chunks that a request of this pass already
+     * covered, or that are clean again; skip them.
+     */
+    do {
+        sector = hbitmap_iter_next(&bmds->hbi);
+        if (sector < 0) {
+            bmds->cur_dirty = total_sectors;
+            return 1;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+    } while (sector < bmds->cur_dirty || !bdrv_get_dirty(bs, sector));
+
+    bmds_wait_inflight(bmds, sector);
+
+    /* extend the request over the following dirty chunks */
+    max_chunks = blk_mig_request_chunks(f);
+    nr_chunks = 1;
+    next = sector + BDRV_SECTORS_PER_DIRTY_CHUNK;
+    while (nr_chunks < max_chunks && next < total_sectors &&
+           bdrv_get_dirty(bs, next) && !bmds_aio_inflight(bmds, next)) {
+        nr_chunks++;
+        next += BDRV_SECTORS_PER_DIRTY_CHUNK;
     }
+    nr_sectors = MIN(next, total_sectors) - sector;
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    if (bmds_zero_sectors(bmds, sector) >= nr_sectors) {
+        blk_mig_queue_zero(bmds, sector, nr_sectors);
+    } else {
+        blk_mig_submit_read(bmds, sector, nr_sectors);
+    }
+    bmds->cur_dirty = sector + nr_sectors;
 
-error:
-    DPRINTF("Error reading sector %" PRId64 "\n", sector);
-    g_free(blk->buf);
-    g_free(blk);
-    return ret;
+    return 0;
 }
 
 /* return value:
- * 0: too much data for max_downtime
- * 1: few enough data for max_downtime
-*/
-static int blk_mig_save_dirty_block(QEMUFile *f, int is_async)
+ * 0: a request was queued
+ * 1: no more dirty chunks in this pass, on any device
+ */
+static int blk_mig_save_dirty_block(QEMUFile *f)
 {
     BlkMigDevState *bmds;
     int ret = 1;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        ret = mig_save_device_dirty(f, bmds, is_async);
-        if (ret <= 0) {
+        ret = mig_save_device_dirty(f, bmds);
+        if (ret == 0) {
             break;
         }
     }
@@ -436,7 +511,10 @@ static int blk_mig_save_dirty_block(QEMUFile *f, int is_async)
     return ret;
 }
 
-static int flush_blks(QEMUFile *f)
+/* send the requests that completed, in order; with rate_limit, stop when
+ * the rate limit is reached
+ */
+static int flush_blks(QEMUFile *f, bool rate_limit)
 {
     BlkMigBlock *blk;
     int ret = 0;
@@ -446,7 +524,7 @@ static int flush_blks(QEMUFile *f)
             block_mig_state.transferred);
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
-        if (qemu_file_rate_limit(f)) {
+        if (rate_limit && qemu_file_rate_limit(f)) {
             break;
         }
         if (blk->ret < 0) {
@@ -456,12 +534,11 @@ static int flush_blks(QEMUFile *f)
         blk_send(f, blk);
 
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
+        block_mig_state.read_done -= blk->nr_chunks;
+        block_mig_state.transferred += blk->nr_chunks;
+        assert(block_mig_state.read_done >= 0);
         g_free(blk->buf);
         g_free(blk);
-
-        block_mig_state.read_done--;
-        block_mig_state.transferred++;
-        assert(block_mig_state.read_done >= 0);
     }
 
     DPRINTF("%s Exit submitted %d read_done %d transferred %d\n", __FUNCTION__,
@@ -523,7 +600,7 @@ static int block_save_setup(QEMUFile *f, void *opaque)
     /* start track dirty blocks */
     set_dirty_tracking(1);
 
-    ret = flush_blks(f);
+    ret = flush_blks(f, true);
     if (ret) {
         blk_mig_cleanup();
         return ret;
@@ -544,7 +621,7 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     DPRINTF("Enter save live iterate submitted %d transferred %d\n",
             block_mig_state.submitted, block_mig_state.transferred);
 
-    ret = flush_blks(f);
+    ret = flush_blks(f, true);
     if (ret) {
         blk_mig_cleanup();
         return ret;
@@ -552,8 +629,9 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
     blk_mig_reset_dirty_cursor();
 
-    /* control the rate of transfer */
-    while ((block_mig_state.submitted +
+    /* control the rate of transfer, and the number of reads in flight */
+    while (block_mig_state.reads < migrate_block_inflight() &&
+           (block_mig_state.submitted +
             block_mig_state.read_done) * BLOCK_SIZE <
            qemu_file_get_rate_limit(f)) {
         if (block_mig_state.bulk_completed == 0) {
@@ -563,19 +641,20 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
                 block_mig_state.bulk_completed = 1;
             }
         } else {
-            ret = blk_mig_save_dirty_block(f, 1);
-            if (ret != 0) {
+            if (blk_mig_save_dirty_block(f) != 0) {
                 /* no more dirty blocks */
                 break;
             }
         }
-    }
-    if (ret < 0) {
-        blk_mig_cleanup();
-        return ret;
+        /* send what is already read while the other reads run */
+        ret = flush_blks(f, true);
+        if (ret) {
+            blk_mig_cleanup();
+            return ret;
+        }
     }
 
-    ret = flush_blks(f);
+    ret = flush_blks(f, true);
     if (ret) {
         blk_mig_cleanup();
         return ret;
@@ -588,27 +667,32 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
 static int block_save_complete(QEMUFile *f, void *opaque)
 {
-    int ret;
+    int ret, err;
 
     DPRINTF("Enter save live complete submitted %d transferred %d\n",
             block_mig_state.submitted, block_mig_state.transferred);
 
-    ret = flush_blks(f);
-    if (ret) {
-        blk_mig_cleanup();
-        return ret;
-    }
-
+    /* we know for sure that save bulk is completed; the guest is
+       stopped, so the dirty chunks found now are the last ones */
     blk_mig_reset_dirty_cursor();
 
-    /* we know for sure that save bulk is completed and
-       all async read completed */
-    assert(block_mig_state.submitted == 0);
-
+    /* keep the reads in flight, and send each one as it completes */
     do {
-        ret = blk_mig_save_dirty_block(f, 0);
+        while (block_mig_state.reads >= migrate_block_inflight()) {
+            qemu_aio_wait();
+        }
+        ret = blk_mig_save_dirty_block(f);
+        if (ret != 0) {
+            /* nothing left to read, wait for the last reads */
+            bdrv_drain_all();
+        }
+        err = flush_blks(f, false);
+        if (err) {
+            ret = err;
+        }
     } while (ret == 0);
 
+    assert(block_mig_state.submitted == 0);
     blk_mig_cleanup();
     if (ret < 0) {
         return ret;
@@ -657,7 +741,7 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
         flags = addr & ~BDRV_SECTOR_MASK;
         addr >>= BDRV_SECTOR_BITS;
 
-        if (flags & BLK_MIG_FLAG_DEVICE_BLOCK) {
+        if (flags & (BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_BLOCK)) {
             /* get device name */
             len = qemu_get_byte(f);
             qemu_get_buffer(f, (uint8_t *)device_name, len);
@@ -686,12 +770,14 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = g_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
-            ret = bdrv_write(bs, addr, buf, nr_sectors);
-
-            g_free(buf);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                ret = bdrv_write_zeroes(bs, addr, nr_sectors);
+            } else {
+                buf = g_malloc(BLOCK_SIZE);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+                ret = bdrv_write(bs, addr, buf, nr_sectors);
+                g_free(buf);
+            }
             if (ret < 0) {
                 return ret;
             }
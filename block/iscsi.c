@@ -48,6 +48,7 @@ typedef struct IscsiLun {
     int block_size;
     uint64_t num_blocks;
     int events;
+    int plugged;
     QEMUTimer *nop_timer;
 } IscsiLun;
 
@@ -156,6 +157,11 @@ iscsi_set_events(IscsiLun *iscsilun)
     struct iscsi_context *iscsi = iscsilun->iscsi;
     int ev;
 
+    /* PDUs queued while plugged are written out on unplug */
+    if (iscsilun->plugged) {
+        return;
+    }
+
     /* We always register a read handler.  */
     ev = POLLIN;
     ev |= iscsi_which_events(iscsi);
@@ -191,6 +197,32 @@ iscsi_process_write(void *arg)
     iscsi_set_events(iscsilun);
 }
 
+static void iscsi_io_plug(BlockDriverState *bs)
+{
+    IscsiLun *iscsilun = bs->opaque;
+
+    iscsilun->plugged++;
+}
+
+static void iscsi_io_unplug(BlockDriverState *bs)
+{
+    IscsiLun *iscsilun = bs->opaque;
+
+    if (iscsilun->plugged == 0 || --iscsilun->plugged > 0) {
+        return;
+    }
+
+    /*
+     * Write all PDUs that were queued in the meantime right away instead
+     * of waiting for the main loop to report the socket as writable.
+     */
+    if (iscsi_which_events(iscsilun->iscsi) & POLLOUT) {
+        iscsi_process_write(iscsilun);
+    } else {
+        iscsi_set_events(iscsilun);
+    }
+}
+
 
 static void
 iscsi_aio_write16_cb(struct iscsi_context *iscsi, int status,
@@ -1101,6 +1133,9 @@ static BlockDriver bdrv_iscsi = {
     .bdrv_aio_discard = iscsi_aio_discard,
     .bdrv_has_zero_init = iscsi_has_zero_init,
 
+    .bdrv_io_plug     = iscsi_io_plug,
+    .bdrv_io_unplug   = iscsi_io_unplug,
+
 #ifdef __linux__
     .bdrv_ioctl       = iscsi_ioctl,
     .bdrv_aio_ioctl   = iscsi_aio_ioctl,
@@ -25,6 +25,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Maximum number of requests held back while the queue is plugged */
+#define MAX_QUEUED_IO 128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -36,10 +39,19 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+typedef struct {
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    int plugged;
+    unsigned int idx;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
     int count;
+
+    /* io queue for submit at batch */
+    LaioQueue io_q;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -101,6 +113,82 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/*
+ * Submits all requests that were queued while plugged with a single
+ * io_submit() call.  Requests that the kernel did not accept are completed
+ * with an error, as they would have been without batching.
+ */
+static int ioq_submit(struct qemu_laio_state *s)
+{
+    int ret, i = 0;
+    int len = s->io_q.idx;
+
+    do {
+        ret = io_submit(s->ctx, len, s->io_q.iocbs);
+    } while (i++ < 3 && ret == -EAGAIN);
+
+    /* empty io queue */
+    s->io_q.idx = 0;
+
+    for (i = MAX(ret, 0); i < len; i++) {
+        struct qemu_laiocb *laiocb =
+            container_of(s->io_q.iocbs[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = (ret < 0) ? ret : -EIO;
+        qemu_laio_process_completion(s, laiocb);
+    }
+    return ret;
+}
+
+static void ioq_enqueue(struct qemu_laio_state *s, struct iocb *iocb)
+{
+    /* make room by submitting what we have if the queue is full */
+    if (s->io_q.idx == MAX_QUEUED_IO) {
+        ioq_submit(s);
+    }
+
+    s->io_q.iocbs[s->io_q.idx++] = iocb;
+}
+
+/*
+ * Drops a request from the plugged queue before it reached the kernel.
+ * Returns true if the request was found.
+ */
+static bool ioq_remove(struct qemu_laio_state *s, struct iocb *iocb)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->io_q.idx; i++) {
+        if (s->io_q.iocbs[i] == iocb) {
+            memmove(&s->io_q.iocbs[i], &s->io_q.iocbs[i + 1],
+                    (s->io_q.idx - i - 1) * sizeof(s->io_q.iocbs[0]));
+            s->io_q.idx--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    if (s->io_q.plugged == 0 || --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+}
+
 static int qemu_laio_flush_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
@@ -117,6 +205,13 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* Not submitted yet? Then it can simply be dropped from the queue */
+    if (ioq_remove(laiocb->ctx, &laiocb->iocb)) {
+        laiocb->ret = -ECANCELED;
+        qemu_laio_process_completion(laiocb->ctx, laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -179,8 +274,11 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
+    if (s->io_q.plugged) {
+        ioq_enqueue(s, iocbs);
+    } else if (io_submit(s->ctx, 1, &iocbs) < 0) {
         goto out_dec_count;
+    }
     return &laiocb->common;
 
 out_dec_count:
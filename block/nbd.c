@@ -61,6 +61,7 @@ typedef struct BDRVNBDState {
     CoMutex free_sema;
     Coroutine *send_coroutine;
     int in_flight;
+    int plugged;
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
@@ -376,6 +377,31 @@ static void nbd_teardown_connection(BlockDriverState *bs)
     closesocket(s->sock);
 }
 
+/*
+ * Cork the socket while plugged, so that the headers and payloads of all
+ * requests are coalesced into as few segments as possible.
+ */
+static void nbd_io_plug(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    if (s->plugged++ == 0 && !s->is_unix) {
+        socket_set_cork(s->sock, 1);
+    }
+}
+
+static void nbd_io_unplug(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    if (s->plugged == 0 || --s->plugged > 0) {
+        return;
+    }
+    if (!s->is_unix) {
+        socket_set_cork(s->sock, 0);
+    }
+}
+
 static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
 {
     BDRVNBDState *s = bs->opaque;
@@ -572,6 +598,8 @@ static BlockDriver bdrv_nbd = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_io_plug        = nbd_io_plug,
+    .bdrv_io_unplug      = nbd_io_unplug,
 };
 
 static BlockDriver bdrv_nbd_tcp = {
@@ -585,6 +613,8 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_io_plug        = nbd_io_plug,
+    .bdrv_io_unplug      = nbd_io_unplug,
 };
 
 static BlockDriver bdrv_nbd_unix = {
@@ -598,6 +628,8 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_io_plug        = nbd_io_plug,
+    .bdrv_io_unplug      = nbd_io_unplug,
 };
 
 static void bdrv_nbd_init(void)
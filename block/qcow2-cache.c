@@ -28,32 +28,116 @@
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
+
+    /* Tables have been written to the image file since it was last flushed */
+    bool                    needs_flush;
+    void*                   table_array;
+
+    /* Cached offsets are found through a chained hash table; each bucket
+     * holds the index of its first entry, or -1 */
+    int*                    buckets;
+    unsigned int            bucket_mask;
+
+    /* All entries, least recently used first */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
+
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *) c->table_array + (size_t) i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset / c->table_size;
+
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
+    return idx;
+}
+
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t key = offset / c->table_size;
+
+    return (key * 0x9e3779b97f4a7c15ULL >> 32) & c->bucket_mask;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i != -1;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *bucket = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    c->entries[i].hash_next = *bucket;
+    *bucket = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p != -1);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
-    int i;
+    int i, num_buckets;
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_size = s->cluster_size;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t) num_tables * c->table_size);
+
+    num_buckets = pow2floor(num_tables);
+    if (num_buckets < num_tables) {
+        num_buckets <<= 1;
+    }
+    c->bucket_mask = num_buckets - 1;
+    c->buckets = g_malloc(sizeof(*c->buckets) * num_buckets);
+    for (i = 0; i < num_buckets; i++) {
+        c->buckets[i] = -1;
+    }
 
+    QTAILQ_INIT(&c->lru_list);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru);
     }
 
     return c;
@@ -65,26 +149,54 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
+/* Whether qcow2_cache_flush() on this cache will sync bs->file */
+static bool qcow2_cache_needs_sync(Qcow2Cache *c)
+{
+    int i;
+
+    if (c->needs_flush) {
+        return true;
+    }
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].dirty && c->entries[i].offset) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
+    bool synced;
     int ret;
 
+    synced = qcow2_cache_needs_sync(c->depends);
     ret = qcow2_cache_flush(bs, c->depends);
     if (ret < 0) {
         return ret;
     }
 
     c->depends = NULL;
-    c->depends_on_flush = false;
+    /* The same sync orders the data written by COW, if there was one */
+    if (synced) {
+        c->depends_on_flush = false;
+    }
 
     return 0;
 }
@@ -103,7 +215,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c->depends) {
         ret = qcow2_cache_flush_dependency(bs, c);
-    } else if (c->depends_on_flush) {
+    }
+    if (ret >= 0 && c->depends_on_flush) {
         ret = bdrv_flush(bs->file);
         if (ret >= 0) {
             c->depends_on_flush = false;
@@ -120,26 +233,25 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+        qcow2_cache_get_table_addr(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
 
     c->entries[i].dirty = false;
+    c->needs_flush = true;
 
     return 0;
 }
 
-int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+/* Write back all dirty tables, without syncing bs->file afterwards */
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c)
 {
-    BDRVQcowState *s = bs->opaque;
     int result = 0;
     int ret;
     int i;
 
-    trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
-
     for (i = 0; i < c->size; i++) {
         ret = qcow2_cache_entry_flush(bs, c, i);
         if (ret < 0 && result != -ENOSPC) {
@@ -147,10 +259,28 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
         }
     }
 
-    if (result == 0) {
+    return result;
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcowState *s = bs->opaque;
+    int result;
+    int ret;
+
+    trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
+
+    result = qcow2_cache_write(bs, c);
+
+    /* Nothing to order against if no table was written since the last
+     * flush; a guest-visible flush still reaches bs->file through
+     * bdrv_co_flush() */
+    if (result == 0 && c->needs_flush) {
         ret = bdrv_flush(bs->file);
         if (ret < 0) {
             result = ret;
+        } else {
+            c->needs_flush = false;
         }
     }
 
@@ -187,32 +317,24 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
+    Qcow2CachedTable *entry;
 
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+    /* Evict the least recently used table that nobody holds a reference to */
+    QTAILQ_FOREACH(entry, &c->lru_list, lru) {
+        if (!entry->ref) {
+            return entry - c->entries;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
+}
+
+static void qcow2_cache_touch(Qcow2Cache *c, int i)
+{
+    QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru);
+    QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru);
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -226,11 +348,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -247,28 +370,30 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    qcow2_cache_touch(c, i);
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -290,16 +415,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
-
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -309,15 +426,7 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
@@ -675,8 +676,11 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
         qcow2_mark_dirty(bs);
     }
     if (qcow2_need_accurate_refcounts(s)) {
-        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                   s->refcount_block_cache);
+        ret = qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                         s->refcount_block_cache);
+        if (ret < 0) {
+            goto err;
+        }
     }
 
     ret = get_cluster_table(bs, m->offset, &l2_table, &l2_index);
@@ -1061,29 +1065,87 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+static int decompress_buffer_pool_func(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    return decompress_buffer(data->out_buf, data->out_buf_size,
+                             data->buf, data->buf_size);
+}
+
+/*
+ * Reads and inflates a compressed cluster into s->cluster_cache.  Must be
+ * called with s->lock held; the lock is dropped while the compressed data is
+ * read and inflated in the thread pool, so that several compressed clusters
+ * can be decompressed in parallel.
+ */
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset)
 {
     BDRVQcowState *s = bs->opaque;
     int ret, csize, nb_csectors, sector_offset;
     uint64_t coffset;
+    uint8_t *in_buf, *out_buf;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    Qcow2DecompressData data;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+    if (s->cluster_cache_offset == coffset) {
+        return 0;
+    }
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    in_buf = qemu_blockalign(bs, nb_csectors * 512);
+    out_buf = g_malloc(s->cluster_size);
+
+    iov.iov_base = in_buf;
+    iov.iov_len = nb_csectors * 512;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_readv(bs->file, coffset >> 9, nb_csectors, &qiov);
+    if (ret >= 0) {
+        data = (Qcow2DecompressData) {
+            .out_buf        = out_buf,
+            .out_buf_size   = s->cluster_size,
+            .buf            = in_buf + sector_offset,
+            .buf_size       = csize,
+        };
+        if (thread_pool_submit_co(decompress_buffer_pool_func, &data) < 0) {
+            ret = -EIO;
         }
-        s->cluster_cache_offset = coffset;
     }
-    return 0;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    if (ret < 0) {
+        g_free(out_buf);
+        goto out;
+    }
+
+    /* Another request may have filled the cache in the meantime, but the
+     * newest result is as good as any other. */
+    g_free(s->cluster_cache);
+    s->cluster_cache = out_buf;
+    s->cluster_cache_offset = coffset;
+    ret = 0;
+
+out:
+    qemu_vfree(in_buf);
+    return ret;
 }
 
 /*
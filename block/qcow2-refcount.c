@@ -532,8 +532,6 @@ static int update_cluster_refcount(BlockDriverState *bs,
         return ret;
     }
 
-    bdrv_flush(bs->file);
-
     return get_refcount(bs, cluster_index);
 }
 
@@ -567,9 +565,83 @@ retry:
             size,
             (s->free_cluster_index - nb_clusters) << s->cluster_bits);
 #endif
+    s->alloc_frontier = MAX(s->alloc_frontier,
+                            s->free_cluster_index << s->cluster_bits);
     return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
 }
 
+/*
+ * Reserves the next QCOW2_PREALLOC_CHUNK of host space behind the allocation
+ * frontier, so that the clusters handed out from there have their blocks
+ * allocated (and zeroed) in the host file already.
+ *
+ * The protocol extends the file without s->lock, so allocating writes are
+ * not held up.  It only zeroes the range if it can do so without writing
+ * (fallocate() past the end of the file), which leaves clusters that get
+ * written in the meantime alone.  If it cannot, the pool is disabled
+ * rather than falling back to writing out zeroes.
+ */
+static void coroutine_fn qcow2_prealloc_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    int64_t start, file_end;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    file_end = bdrv_getlength(bs->file);
+    start = MAX(s->prealloc_end, s->alloc_frontier);
+    start = MAX(start, file_end);
+    start = align_offset(start, s->cluster_size);
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (file_end < 0) {
+        ret = file_end;
+    } else {
+        ret = bdrv_co_try_write_zeroes(bs->file,
+                                       start >> BDRV_SECTOR_BITS,
+                                       QCOW2_PREALLOC_CHUNK >> BDRV_SECTOR_BITS);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret >= 0) {
+        s->prealloc_end = MAX(s->prealloc_end, start + QCOW2_PREALLOC_CHUNK);
+    } else {
+        /* Allocation on write still works, just without the head start */
+        s->prealloc_enabled = false;
+    }
+    s->prealloc_busy = false;
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static void qcow2_prealloc_kick(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Coroutine *co;
+
+    /* Callers outside of coroutines don't hold s->lock in a way that the
+     * background reservation could wait for */
+    if (!s->prealloc_enabled || s->prealloc_busy || !qemu_in_coroutine()) {
+        return;
+    }
+    if (s->alloc_frontier + QCOW2_PREALLOC_CHUNK / 2 <= s->prealloc_end) {
+        return;
+    }
+
+    s->prealloc_busy = true;
+    co = qemu_coroutine_create(qcow2_prealloc_entry);
+    qemu_coroutine_enter(co, bs);
+}
+
+void qcow2_prealloc_drain(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    while (s->prealloc_busy) {
+        qemu_aio_wait();
+    }
+}
+
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
 {
     int64_t offset;
@@ -586,6 +658,7 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
         return ret;
     }
 
+    qcow2_prealloc_kick(bs);
     return offset;
 }
 
@@ -619,7 +692,10 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     }
 
     s->free_cluster_index = old_free_cluster_index;
+    s->alloc_frontier = MAX(s->alloc_frontier,
+                            offset + ((int64_t)i << s->cluster_bits));
 
+    qcow2_prealloc_kick(bs);
     return i;
 }
 
@@ -630,6 +706,7 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
     BDRVQcowState *s = bs->opaque;
     int64_t offset, cluster_offset;
     int free_in_cluster;
+    int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_ALLOC_BYTES);
     assert(size > 0 && size <= s->cluster_size);
@@ -669,7 +746,15 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
         }
     }
 
-    bdrv_flush(bs->file);
+    /* The cluster refcount was incremented; refcount blocks must be written
+     * out before the caller's L2 table update. Using the cache dependency
+     * avoids a flush for every compressed cluster. */
+    ret = qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                     s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
     return offset;
 }
 
@@ -788,10 +873,6 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             if (ret < 0) {
                                 goto fail;
                             }
-
-                            /* TODO Flushing once for the whole function should
-                             * be enough */
-                            bdrv_flush(bs->file);
                         }
                         /* compressed clusters are never modified */
                         refcount = 2;
@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "block/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "trace.h"
@@ -289,6 +290,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
+    int64_t l2_cache_size;
     QCowHeader header;
     uint64_t ext_end;
 
@@ -430,13 +432,16 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
+    l2_cache_size = L2_CACHE_SIZE;
+    if (bs->l2_cache_size) {
+        l2_cache_size = MAX(bs->l2_cache_size / s->cluster_size,
+                            MIN_L2_CACHE_SIZE);
+        l2_cache_size = MIN(l2_cache_size, MAX_L2_CACHE_SIZE);
+    }
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
     s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
 
     s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
@@ -483,6 +488,12 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_queue);
+
+    /* Only reserve host space in the background if the protocol can do it
+     * without writing out the zeroes */
+    s->prealloc_enabled = !bs->read_only &&
+                          bs->file->drv->bdrv_co_write_zeroes != NULL;
 
     /* Repair image if dirty */
     if (!(flags & BDRV_O_CHECK) && !bs->read_only &&
@@ -513,7 +524,6 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     return ret;
 }
 
@@ -867,6 +877,8 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_prealloc_drain(bs);
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
@@ -881,7 +893,6 @@ static void qcow2_close(BlockDriverState *bs)
     cleanup_unknown_header_ext(bs);
 
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1115,42 +1126,119 @@ static int qcow2_change_backing_file(BlockDriverState *bs,
     return qcow2_update_header(bs);
 }
 
+enum {
+    PREALLOC_MODE_OFF,
+    PREALLOC_MODE_METADATA,
+    PREALLOC_MODE_FALLOC,
+};
+
+/*
+ * Returns the host file size of a fully allocated image of the given guest
+ * size: the data clusters plus the L1/L2 tables, the refcount table and the
+ * refcount blocks that describe all of them.
+ */
+static int64_t qcow2_full_host_size(int64_t total_size, int cluster_bits)
+{
+    int64_t cluster_size = 1 << cluster_bits;
+    int64_t refblock_entries = cluster_size >> REFCOUNT_SHIFT;
+    int64_t data_clusters, l2_clusters, l1_clusters, fixed_clusters;
+    int64_t refblocks = 0, reftable_clusters = 0, prev;
+
+    data_clusters = DIV_ROUND_UP(total_size, cluster_size);
+    l2_clusters = DIV_ROUND_UP(data_clusters, cluster_size / sizeof(uint64_t));
+    l1_clusters = DIV_ROUND_UP(l2_clusters * sizeof(uint64_t), cluster_size);
+
+    /* Header and the initial refcount table */
+    fixed_clusters = 2 + data_clusters + l2_clusters + l1_clusters;
+
+    /* Refcount blocks need to cover themselves and the table, too */
+    do {
+        prev = refblocks;
+        refblocks = DIV_ROUND_UP(fixed_clusters + refblocks + reftable_clusters,
+                                 refblock_entries);
+        reftable_clusters = DIV_ROUND_UP(refblocks * sizeof(uint64_t),
+                                         cluster_size);
+    } while (refblocks != prev);
+
+    return (fixed_clusters + refblocks + reftable_clusters) << cluster_bits;
+}
+
+/*
+ * Maps every guest cluster of a newly created image. The L2 tables are
+ * allocated as one contiguous run and filled in memory, so that they are
+ * written out in large batches followed by a single L1 table update, rather
+ * than going through the L2 cache and a table write per L2 table.
+ */
 static int preallocate(BlockDriverState *bs)
 {
-    uint64_t nb_sectors;
-    uint64_t offset;
-    uint64_t host_offset = 0;
-    int num;
+    BDRVQcowState *s = bs->opaque;
+    int64_t nb_clusters, l2_offset, data_offset, data_end = 0;
+    int64_t first, count, j;
+    int nb_l2, tables_per_batch, i, n;
+    uint64_t *l2_tables, *l1_table;
     int ret;
-    QCowL2Meta *meta;
 
-    nb_sectors = bdrv_getlength(bs) >> 9;
-    offset = 0;
+    nb_clusters = DIV_ROUND_UP(bdrv_getlength(bs), s->cluster_size);
+    if (nb_clusters == 0) {
+        return 0;
+    }
 
-    while (nb_sectors) {
-        num = MIN(nb_sectors, INT_MAX >> 9);
-        ret = qcow2_alloc_cluster_offset(bs, offset, 0, num, &num,
-                                         &host_offset, &meta);
-        if (ret < 0) {
-            return ret;
+    nb_l2 = DIV_ROUND_UP(nb_clusters, s->l2_size);
+    assert(nb_l2 <= s->l1_size);
+
+    l2_offset = qcow2_alloc_clusters(bs, (int64_t)nb_l2 << s->cluster_bits);
+    if (l2_offset < 0) {
+        return l2_offset;
+    }
+
+    tables_per_batch = MAX(1, (1 << 20) >> s->cluster_bits);
+    l2_tables = qemu_blockalign(bs, tables_per_batch << s->cluster_bits);
+
+    for (i = 0; i < nb_l2; i += n) {
+        n = MIN(tables_per_batch, nb_l2 - i);
+        first = (int64_t)i << s->l2_bits;
+        count = MIN(nb_clusters - first, (int64_t)n << s->l2_bits);
+
+        data_offset = qcow2_alloc_clusters(bs, count << s->cluster_bits);
+        if (data_offset < 0) {
+            ret = data_offset;
+            goto fail;
         }
+        data_end = data_offset + (count << s->cluster_bits);
 
-        ret = qcow2_alloc_cluster_link_l2(bs, meta);
-        if (ret < 0) {
-            qcow2_free_any_clusters(bs, meta->alloc_offset, meta->nb_clusters);
-            return ret;
+        memset(l2_tables, 0, n << s->cluster_bits);
+        for (j = 0; j < count; j++) {
+            l2_tables[j] = cpu_to_be64((data_offset + (j << s->cluster_bits)) |
+                                       QCOW_OFLAG_COPIED);
         }
 
-        /* There are no dependent requests, but we need to remove our request
-         * from the list of in-flight requests */
-        if (meta != NULL) {
-            QLIST_REMOVE(meta, next_in_flight);
+        ret = bdrv_pwrite(bs->file, l2_offset + ((int64_t)i << s->cluster_bits),
+                          l2_tables, n << s->cluster_bits);
+        if (ret < 0) {
+            goto fail;
         }
+    }
 
-        /* TODO Preallocate data if requested */
+    /* The refcounts of the new clusters go to disk before the L1 table
+     * references them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
 
-        nb_sectors -= num;
-        offset += num << 9;
+    l1_table = g_malloc0(s->l1_size * sizeof(uint64_t));
+    for (i = 0; i < s->l1_size; i++) {
+        if (i < nb_l2) {
+            s->l1_table[i] = (l2_offset + ((int64_t)i << s->cluster_bits)) |
+                             QCOW_OFLAG_COPIED;
+        }
+        l1_table[i] = cpu_to_be64(s->l1_table[i]);
+    }
+    ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset, l1_table,
+                           s->l1_size * sizeof(uint64_t));
+    g_free(l1_table);
+    if (ret < 0) {
+        goto fail;
     }
 
     /*
@@ -1158,16 +1246,19 @@ static int preallocate(BlockDriverState *bs)
      * all of the allocated clusters (otherwise we get failing reads after
      * EOF). Extend the image to the last allocated sector.
      */
-    if (host_offset != 0) {
+    if (bdrv_getlength(bs->file) < data_end) {
         uint8_t buf[512];
         memset(buf, 0, 512);
-        ret = bdrv_write(bs->file, (host_offset >> 9) + num - 1, buf, 1);
+        ret = bdrv_write(bs->file, (data_end >> 9) - 1, buf, 1);
         if (ret < 0) {
-            return ret;
+            goto fail;
         }
     }
 
-    return 0;
+    ret = 0;
+fail:
+    qemu_vfree(l2_tables);
+    return ret;
 }
 
 static int qcow2_create2(const char *filename, int64_t total_size,
@@ -1204,7 +1295,43 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     uint8_t* refcount_table;
     int ret;
 
-    ret = bdrv_create_file(filename, options);
+    if (prealloc == PREALLOC_MODE_FALLOC) {
+        /*
+         * Let the protocol reserve the whole file up front, so that guest
+         * writes never have to wait for the host filesystem to allocate
+         * blocks behind the clusters that are preallocated below.
+         */
+        BlockDriver *proto_drv = bdrv_find_protocol(filename);
+        QEMUOptionParameter *proto_options;
+        int64_t host_size;
+
+        if (!proto_drv || !proto_drv->create_options) {
+            return -ENOTSUP;
+        }
+
+        proto_options = parse_option_parameters("", proto_drv->create_options,
+                                                NULL);
+        host_size = qcow2_full_host_size(total_size * BDRV_SECTOR_SIZE,
+                                         cluster_bits);
+        if (set_option_parameter_int(proto_options, BLOCK_OPT_SIZE,
+                                     host_size) < 0 ||
+            set_option_parameter(proto_options, BLOCK_OPT_PREALLOC,
+                                 "falloc") < 0) {
+            error_report("Protocol does not support preallocation mode "
+                         "'falloc'");
+            free_option_parameters(proto_options);
+            return -ENOTSUP;
+        }
+
+        ret = bdrv_create_file(filename, proto_options);
+        free_option_parameters(proto_options);
+    } else {
+        /*
+         * The options are those of qcow2 (e.g. preallocation=metadata) and
+         * mean nothing to the protocol; let it create an empty file.
+         */
+        ret = bdrv_create_file(filename, NULL);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -1290,8 +1417,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         }
     }
 
-    /* And if we're supposed to preallocate metadata, do that now */
-    if (prealloc) {
+    /*
+     * And if we're supposed to preallocate metadata, do that now. With falloc
+     * this also maps every guest cluster onto the space reserved above.
+     */
+    if (prealloc != PREALLOC_MODE_OFF) {
         BDRVQcowState *s = bs->opaque;
         qemu_co_mutex_lock(&s->lock);
         ret = preallocate(bs);
@@ -1314,7 +1444,7 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
     uint64_t sectors = 0;
     int flags = 0;
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
-    int prealloc = 0;
+    int prealloc = PREALLOC_MODE_OFF;
     int version = 2;
 
     /* Read out options */
@@ -1333,9 +1463,11 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
             }
         } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
             if (!options->value.s || !strcmp(options->value.s, "off")) {
-                prealloc = 0;
+                prealloc = PREALLOC_MODE_OFF;
             } else if (!strcmp(options->value.s, "metadata")) {
-                prealloc = 1;
+                prealloc = PREALLOC_MODE_METADATA;
+            } else if (!strcmp(options->value.s, "falloc")) {
+                prealloc = PREALLOC_MODE_FALLOC;
             } else {
                 fprintf(stderr, "Invalid preallocation mode: '%s'\n",
                     options->value.s);
@@ -1466,72 +1598,146 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressData {
+    uint8_t *dest;
+    int dest_size;
+    const uint8_t *src;
+    int src_size;
+} Qcow2CompressData;
+
+/*
+ * Deflates src into dest.  Runs in a thread pool worker, so it must not
+ * touch any BlockDriverState.
+ *
+ * Returns the compressed size on success, -1 if the data does not fit into
+ * dest_size bytes and -2 on any other error.
+ */
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -2;
+    }
+
+    strm.avail_in = data->src_size;
+    strm.next_in = (uint8_t *)data->src;
+    strm.avail_out = data->dest_size;
+    strm.next_out = data->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = strm.next_out - data->dest;
+    } else {
+        ret = (ret == Z_OK) ? -1 : -2;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+static void coroutine_fn qcow2_compress_wait_turn(BDRVQcowState *s,
+                                                  uint64_t ticket)
+{
+    while (s->compress_cur_ticket != ticket) {
+        qemu_co_queue_wait(&s->compress_queue);
+    }
+}
+
+static void qcow2_compress_end_turn(BDRVQcowState *s)
+{
+    s->compress_cur_ticket++;
+    qemu_co_queue_restart_all(&s->compress_queue);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    Qcow2CompressData data;
     int ret, out_len;
     uint8_t *out_buf;
-    uint64_t cluster_offset;
+    uint64_t cluster_offset, ticket;
+
+    if (nb_sectors != 0 && nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    ticket = s->compress_next_ticket++;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
            sector based I/Os */
+        qcow2_compress_wait_turn(s, ticket);
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = bdrv_getlength(bs->file);
         cluster_offset = (cluster_offset + 511) & ~511;
         bdrv_truncate(bs->file, cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
+        qcow2_compress_end_turn(s);
         return 0;
     }
 
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
+    /* Deflate in the thread pool without holding s->lock, so that a caller
+     * with many writes in flight keeps several host CPUs busy */
+    data = (Qcow2CompressData) {
+        .dest       = out_buf,
+        .dest_size  = s->cluster_size,
+        .src        = buf,
+        .src_size   = s->cluster_size,
+    };
+    out_len = thread_pool_submit_co(qcow2_compress_pool_func, &data);
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    qcow2_compress_wait_turn(s, ticket);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
+    if (out_len == -2) {
+        qcow2_compress_end_turn(s);
         ret = -EINVAL;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len < 0 || out_len >= s->cluster_size) {
         /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+        qcow2_compress_end_turn(s);
+        iov.iov_base = (void *)buf;
+        iov.iov_len = s->cluster_size;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(bs, sector_num, s->cluster_sectors, &qiov);
         if (ret < 0) {
             goto fail;
         }
     } else {
+        /* Compressed clusters are packed at byte granularity, so neighbouring
+         * clusters may share a host sector.  Keep the turn across the
+         * read-modify-write done by bdrv_pwrite. */
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
         if (!cluster_offset) {
+            qemu_co_mutex_unlock(&s->lock);
+            qcow2_compress_end_turn(s);
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        qemu_co_mutex_unlock(&s->lock);
+        qcow2_compress_end_turn(s);
         if (ret < 0) {
             goto fail;
         }
@@ -1548,15 +1754,19 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret;
 
+    /* The dependencies between the caches still order refcount updates,
+     * COW data and L2 updates against each other; the final sync is left
+     * to the bdrv_co_flush(bs->file) that follows, so that a guest flush
+     * commits a whole batch of allocations at once. */
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    ret = qcow2_cache_write(bs, s->l2_table_cache);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         return ret;
     }
 
     if (qcow2_need_accurate_refcounts(s)) {
-        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        ret = qcow2_cache_write(bs, s->refcount_block_cache);
         if (ret < 0) {
             qemu_co_mutex_unlock(&s->lock);
             return ret;
@@ -1577,6 +1787,8 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     BDRVQcowState *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+    qcow2_cache_get_stats(s->l2_table_cache, &bdi->l2_cache_hits,
+                          &bdi->l2_cache_misses);
     return 0;
 }
 
@@ -1666,7 +1878,7 @@ static QEMUOptionParameter qcow2_create_options[] = {
     {
         .name = BLOCK_OPT_PREALLOC,
         .type = OPT_STRING,
-        .help = "Preallocation mode (allowed values: off, metadata)"
+        .help = "Preallocation mode (allowed values: off, metadata, falloc)"
     },
     {
         .name = BLOCK_OPT_LAZY_REFCOUNTS,
@@ -1695,7 +1907,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
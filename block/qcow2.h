@@ -52,12 +52,17 @@
 #define MAX_CLUSTER_BITS 21
 
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2
+#define MAX_L2_CACHE_SIZE (1 << 20)
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Host space reserved ahead of the allocation frontier at a time */
+#define QCOW2_PREALLOC_CHUNK (8 * 1024 * 1024)
+
 typedef struct QCowHeader {
     uint32_t magic;
     uint32_t version;
@@ -150,7 +155,6 @@ typedef struct BDRVQcowState {
     Qcow2Cache* refcount_block_cache;
 
     uint8_t *cluster_cache;
-    uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
@@ -160,8 +164,21 @@ typedef struct BDRVQcowState {
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
+    /* Host clusters up to prealloc_end are reserved in bs->file; no cluster
+     * at or after alloc_frontier has been handed out yet */
+    bool prealloc_enabled;
+    bool prealloc_busy;
+    int64_t alloc_frontier;
+    int64_t prealloc_end;
+
     CoMutex lock;
 
+    /* Compressed clusters are allocated in the order in which the writes
+     * were submitted, even if they finish compressing out of order */
+    uint64_t compress_next_ticket;
+    uint64_t compress_cur_ticket;
+    CoQueue compress_queue;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -310,6 +327,7 @@ int qcow2_update_header(BlockDriverState *bs);
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_prealloc_drain(BlockDriverState *bs);
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
@@ -329,7 +347,8 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                         uint64_t cluster_offset);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -361,8 +380,10 @@ int qcow2_read_snapshots(BlockDriverState *bs);
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
@@ -142,6 +142,7 @@ typedef struct BDRVRawState {
     bool is_xfs : 1;
 #endif
     bool has_discard : 1;
+    bool has_fallocate : 1;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -294,6 +295,7 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
 #endif
 
     s->has_discard = 1;
+    s->has_fallocate = 1;
 #ifdef CONFIG_XFS
     if (platform_test_xfs_fd(s->fd)) {
         s->is_xfs = 1;
@@ -698,6 +700,44 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+#ifdef CONFIG_FALLOCATE
+/*
+ * Zeroes are written by allocating the range with fallocate(), which only
+ * reads back as zeroes where nothing has been written yet. Therefore only
+ * ranges at or after the end of the file are handled here; everything else
+ * is left to the generic bounce buffer emulation.
+ */
+static ssize_t handle_aiocb_write_zeroes(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    struct stat st;
+
+    if (s->has_fallocate == 0) {
+        return -ENOTSUP;
+    }
+
+    if (fstat(aiocb->aio_fildes, &st) < 0) {
+        return -errno;
+    }
+    if (aiocb->aio_offset < st.st_size) {
+        return -ENOTSUP;
+    }
+
+    do {
+        if (fallocate(aiocb->aio_fildes, 0, aiocb->aio_offset,
+                      aiocb->aio_nbytes) == 0) {
+            return 0;
+        }
+    } while (errno == EINTR);
+
+    if (errno == ENOSYS || errno == EOPNOTSUPP) {
+        s->has_fallocate = 0;
+        return -ENOTSUP;
+    }
+    return -errno;
+}
+#endif
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -735,6 +775,11 @@ static int aio_worker(void *arg)
     case QEMU_AIO_DISCARD:
         ret = handle_aiocb_discard(aiocb);
         break;
+#ifdef CONFIG_FALLOCATE
+    case QEMU_AIO_WRITE_ZEROES:
+        ret = handle_aiocb_write_zeroes(aiocb);
+        break;
+#endif
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -811,6 +856,26 @@ static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
                           cb, opaque, QEMU_AIO_WRITE);
 }
 
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx);
+    }
+#endif
+}
+
 static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -1011,15 +1076,32 @@ static int raw_create(const char *filename, QEMUOptionParameter *options)
     int fd;
     int result = 0;
     int64_t total_size = 0;
+    bool falloc = false;
 
     /* Read out options */
     while (options && options->name) {
         if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
             total_size = options->value.n / BDRV_SECTOR_SIZE;
+        } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
+            if (!options->value.s || !strcmp(options->value.s, "off")) {
+                falloc = false;
+            } else if (!strcmp(options->value.s, "falloc")) {
+                falloc = true;
+            } else {
+                fprintf(stderr, "Invalid preallocation mode: '%s'\n",
+                    options->value.s);
+                return -EINVAL;
+            }
         }
         options++;
     }
 
+#ifndef CONFIG_FALLOCATE
+    if (falloc) {
+        return -ENOTSUP;
+    }
+#endif
+
     fd = qemu_open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
                    0644);
     if (fd < 0) {
@@ -1028,6 +1110,14 @@ static int raw_create(const char *filename, QEMUOptionParameter *options)
         if (ftruncate(fd, total_size * BDRV_SECTOR_SIZE) != 0) {
             result = -errno;
         }
+#ifdef CONFIG_FALLOCATE
+        /* Reserve the blocks now, so that the first write to each of them
+         * does not have to wait for the host filesystem to allocate it */
+        if (result == 0 && falloc && total_size &&
+            fallocate(fd, 0, 0, total_size * BDRV_SECTOR_SIZE) != 0) {
+            result = -errno;
+        }
+#endif
         if (qemu_close(fd) != 0) {
             result = -errno;
         }
@@ -1145,12 +1235,35 @@ static coroutine_fn BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
                        cb, opaque, QEMU_AIO_DISCARD);
 }
 
+#ifdef CONFIG_FALLOCATE
+static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    RawPosixAIOData *acb = g_slice_new0(RawPosixAIOData);
+
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_WRITE_ZEROES;
+    acb->aio_fildes = s->fd;
+    acb->aio_nbytes = (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    acb->aio_offset = sector_num * BDRV_SECTOR_SIZE;
+
+    trace_paio_submit_co(sector_num, nb_sectors, QEMU_AIO_WRITE_ZEROES);
+    return thread_pool_submit_co(aio_worker, acb);
+}
+#endif
+
 static QEMUOptionParameter raw_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
         .type = OPT_SIZE,
         .help = "Virtual disk size"
     },
+    {
+        .name = BLOCK_OPT_PREALLOC,
+        .type = OPT_STRING,
+        .help = "Preallocation mode (allowed values: off, falloc)"
+    },
     { NULL }
 };
 
@@ -1170,7 +1283,12 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_aio_discard = raw_aio_discard,
+#ifdef CONFIG_FALLOCATE
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
+#endif
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -1511,6 +1629,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug	= raw_aio_plug,
+    .bdrv_io_unplug	= raw_aio_unplug,
     .bdrv_aio_discard   = hdev_aio_discard,
 
     .bdrv_truncate      = raw_truncate,
@@ -1636,6 +1756,8 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug	= raw_aio_plug,
+    .bdrv_io_unplug	= raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -1738,6 +1860,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug	= raw_aio_plug,
+    .bdrv_io_unplug	= raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength     = raw_getlength,
@@ -1860,6 +1984,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug	= raw_aio_plug,
+    .bdrv_io_unplug	= raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength     = raw_getlength,
@@ -296,6 +296,7 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
     BlockIOLimit io_limits;
     int snapshot = 0;
     bool copy_on_read;
+    uint64_t l2_cache_size;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -313,6 +314,7 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "readonly", 0);
     copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", false);
+    l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -615,6 +617,8 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
         error_report("warning: disabling copy_on_read on readonly drive");
     }
 
+    bdrv_set_l2_cache_size(dinfo->bdrv, l2_cache_size);
+
     ret = bdrv_open(dinfo->bdrv, file, bdrv_flags, drv);
     if (ret < 0) {
         if (ret == -EMEDIUMTYPE) {
@@ -1552,6 +1556,10 @@ QemuOptsList qemu_drive_opts = {
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum L2 table cache size (qcow2 only)",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
@@ -21,6 +21,7 @@
 #include "disas/disas.h"
 #include "tcg.h"
 #include "qemu/atomic.h"
+#include "qemu/main-loop.h"
 #include "sysemu/qtest.h"
 
 int tb_invalidated_flag;
@@ -94,57 +95,58 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     tb_free(tb);
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* Execute one instruction while the other vCPU threads are stopped.  The
+   TB is never looked up again: outside an exclusive section the atomic
+   instruction must stop with EXCP_ATOMIC once more.  */
+static void cpu_exec_exclusive(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    qemu_mutex_lock_tb();
+    tb = tb_gen_code(env, pc, cs_base, flags, 1 | CF_EXCLUSIVE);
+    tb_phys_invalidate(tb, -1);
+    qemu_mutex_unlock_tb();
+    env->current_tb = tb;
+    /* execute the generated code */
+    cpu_tb_exec(env, tb->tc_ptr);
+    env->current_tb = NULL;
+    qemu_mutex_lock_tb();
+    tb_free(tb);
+    qemu_mutex_unlock_tb();
+}
+#endif
+
 static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong pc,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
 
     tb_invalidated_flag = 0;
 
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
+    tb = tb_phys_hash_lookup(env, phys_pc, pc, cs_base, flags);
+    if (!tb) {
+        qemu_mutex_lock_tb();
+        /* the lookup did not take the lock, so another vCPU may have
+           translated the block in the meantime */
+        if (mttcg_enabled) {
+            tb = tb_phys_hash_lookup(env, phys_pc, pc, cs_base, flags);
         }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(env, pc, cs_base, flags, 0);
+        }
+        qemu_mutex_unlock_tb();
     }
+
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -161,8 +163,10 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    /* with multi-threaded TCG, another vCPU can invalidate the TB between
+       our lookup and the store into tb_jmp_cache, so check the flag */
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
-                 tb->flags != flags)) {
+                 tb->flags != flags || tb->invalid)) {
         tb = tb_find_slow(env, pc, cs_base, flags);
     }
     return tb;
@@ -278,6 +282,13 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    /* interrupt controllers are devices; exclusive
+                       sections already hold the global mutex */
+                    if (mttcg_enabled && !cpu_in_exclusive_context()) {
+                        qemu_mutex_lock_iothread();
+                    }
+#endif
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -552,6 +563,11 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    if (mttcg_enabled && !cpu_in_exclusive_context()) {
+                        qemu_mutex_unlock_iothread();
+                    }
+#endif
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -577,6 +593,21 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
+#if !defined(CONFIG_USER_ONLY)
+                if (unlikely(mttcg_enabled && cpu_in_exclusive_context())) {
+                    /* the vCPU thread stopped the others (EXCP_ATOMIC),
+                       for an atomic instruction or to translate code from
+                       a page that is not protected yet: translate the
+                       regular TB, then run just one instruction */
+                    spin_lock(&tb_lock);
+                    tb_find_fast(env);
+                    spin_unlock(&tb_lock);
+                    cpu_exec_exclusive(env);
+                    env->exception_index = EXCP_INTERRUPT;
+                    next_tb = 0;
+                    cpu_loop_exit(env);
+                }
+#endif
                 spin_lock(&tb_lock);
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
@@ -597,8 +628,15 @@ int cpu_exec(CPUArchState *env)
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    qemu_mutex_lock_tb();
+                    /* the lookup is lock-free, so the TB may have been
+                       invalidated since; never chain to it then */
+                    if (!tb->invalid) {
+                        tb_add_jump((TranslationBlock *)
+                                    (next_tb & ~TB_EXIT_MASK),
+                                    next_tb & TB_EXIT_MASK, tb);
+                    }
+                    qemu_mutex_unlock_tb();
                 }
                 spin_unlock(&tb_lock);
 
@@ -654,6 +692,14 @@ int cpu_exec(CPUArchState *env)
                     default:
                         break;
                     }
+                    /* a first tier TB has taken a jump that its superblock
+                       would follow often enough */
+                    if (unlikely(env->hot_tb != NULL)) {
+                        spin_lock(&tb_lock);
+                        tb_promote(env, env->hot_tb);
+                        spin_unlock(&tb_lock);
+                        env->hot_tb = NULL;
+                    }
                 }
                 env->current_tb = NULL;
                 /* reset soft MMU for next block (it can currently
@@ -663,6 +709,18 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+#if !defined(CONFIG_USER_ONLY)
+            if (mttcg_enabled) {
+                /* Release whatever the faulting code was holding; the
+                 * vCPU thread enters cpu_exec() without any lock, except
+                 * the global mutex in an exclusive section. */
+                tb_lock_reset();
+                if (qemu_mutex_iothread_locked() &&
+                    !cpu_in_exclusive_context()) {
+                    qemu_mutex_unlock_iothread();
+                }
+            }
+#endif
         }
     } /* for(;;) */
 
@@ -624,6 +624,16 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* Only meaningful with mttcg_enabled, see qemu_mutex_iothread_locked() */
+static DEFINE_TLS(bool, iothread_locked);
+
+/* exclusive sections for multi-threaded TCG */
+static QemuMutex exclusive_lock;
+static QemuCond exclusive_cond;
+static QemuCond exclusive_resume;
+static int pending_cpus;
+static DEFINE_TLS(int, exclusive_depth);
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -638,6 +648,9 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&exclusive_lock);
+    qemu_cond_init(&exclusive_cond);
+    qemu_cond_init(&exclusive_resume);
 
     qemu_thread_get_self(&io_thread);
 }
@@ -653,6 +666,7 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 
     wi.func = func;
     wi.data = data;
+    wi.free = false;
     if (cpu->queued_work_first == NULL) {
         cpu->queued_work_first = &wi;
     } else {
@@ -671,6 +685,29 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     }
 }
 
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(cpu)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+
+    qemu_cpu_kick(cpu);
+}
+
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
@@ -682,12 +719,100 @@ static void flush_queued_work(CPUState *cpu)
     while ((wi = cpu->queued_work_first)) {
         cpu->queued_work_first = wi->next;
         wi->func(wi->data);
-        wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        } else {
+            wi->done = true;
+        }
     }
     cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+/***********************************************************/
+/* vCPU throttling */
+
+/* the vCPUs run for this long between two throttle sleeps */
+#define CPU_THROTTLE_TIMESLICE_MS 10
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
+static int64_t cpu_throttle_sleep_us(void)
+{
+    return (int64_t)CPU_THROTTLE_TIMESLICE_MS * 1000 * throttle_percentage /
+           (100 - throttle_percentage);
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+
+    if (!throttle_percentage) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        cpu->throttle_pending = true;
+        qemu_cpu_kick(cpu);
+    }
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ms(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_MS +
+                   cpu_throttle_sleep_us() / 1000);
+}
+
+/* Called from the vCPU thread with the global mutex held. */
+static void cpu_throttle_wait(CPUState *cpu)
+{
+    CPUArchState *self_env = cpu_single_env;
+    int64_t sleep_us;
+
+    if (!cpu->throttle_pending) {
+        return;
+    }
+    cpu->throttle_pending = false;
+    if (!throttle_percentage || cpu->stop || cpu->stopped) {
+        return;
+    }
+
+    sleep_us = cpu_throttle_sleep_us();
+    cpu_single_env = NULL;
+    qemu_mutex_unlock(&qemu_global_mutex);
+    g_usleep(sleep_us);
+    qemu_mutex_lock(&qemu_global_mutex);
+    cpu_single_env = self_env;
+}
+
+void cpu_throttle_set(int percentage)
+{
+    bool was_throttled = throttle_percentage > 0;
+
+    percentage = MAX(percentage, 0);
+    percentage = MIN(percentage, CPU_THROTTLE_PCT_MAX);
+    throttle_percentage = percentage;
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ms(rt_clock,
+                                           cpu_throttle_timer_tick, NULL);
+    }
+    if (percentage && !was_throttled) {
+        qemu_mod_timer(throttle_timer, qemu_get_clock_ms(rt_clock) +
+                       CPU_THROTTLE_TIMESLICE_MS);
+    }
+}
+
+/* Can be called without the global mutex; the timer stops rearming itself. */
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void qemu_wait_io_event_common(CPUState *cpu)
 {
     if (cpu->stop) {
@@ -717,6 +842,14 @@ static void qemu_tcg_wait_io_event(void)
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         qemu_wait_io_event_common(ENV_GET_CPU(env));
     }
+
+    /* All vCPUs share this thread, so sleep only once for all of them */
+    if (ENV_GET_CPU(first_cpu)->throttle_pending) {
+        cpu_throttle_wait(ENV_GET_CPU(first_cpu));
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            ENV_GET_CPU(env)->throttle_pending = false;
+        }
+    }
 }
 
 static void qemu_kvm_wait_io_event(CPUArchState *env)
@@ -729,6 +862,7 @@ static void qemu_kvm_wait_io_event(CPUArchState *env)
 
     qemu_kvm_eat_signals(cpu);
     qemu_wait_io_event_common(cpu);
+    cpu_throttle_wait(cpu);
 }
 
 static void *qemu_kvm_cpu_thread_fn(void *arg)
@@ -811,6 +945,7 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 }
 
 static void tcg_exec_all(void);
+static int tcg_cpu_exec(CPUArchState *env);
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
@@ -850,6 +985,157 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* To implement exclusive operations we force all vCPU threads out of
+   cpu_exec(), as linux-user does.  These are only used with one thread
+   per vCPU, where translated code runs without the global mutex.
+
+   Exclusive sections are started with the global mutex held, and a vCPU
+   thread does not count as running while it waits for the global mutex
+   (see qemu_mutex_lock_iothread), so any holder of the mutex can stop
+   the vCPUs, and no exclusive section is pending once a vCPU thread got
+   the mutex.  */
+
+/* Wait for pending exclusive operations to complete.  The exclusive lock
+   must be held.  */
+static void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&exclusive_resume, &exclusive_lock);
+    }
+}
+
+/* Start an exclusive operation.  Must be called with the global mutex
+   held.  Sections nest; a vCPU thread may start one from within
+   cpu_exec(), e.g. for a memory map update done by an MMIO write.  */
+void start_exclusive(void)
+{
+    CPUArchState *env;
+
+    if (tls_var(exclusive_depth)++ > 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+
+    pending_cpus = 1;
+    /* Make all other cpus stop executing.  */
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env->running && env != cpu_single_env) {
+            pending_cpus++;
+            cpu_exit(env);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&exclusive_cond, &exclusive_lock);
+    }
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+/* Finish an exclusive operation.  */
+void end_exclusive(void)
+{
+    if (--tls_var(exclusive_depth) > 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&exclusive_lock);
+    pending_cpus = 0;
+    qemu_cond_broadcast(&exclusive_resume);
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+bool cpu_in_exclusive_context(void)
+{
+    return tls_var(exclusive_depth) > 0;
+}
+
+/* Wait for exclusive ops to finish, and begin cpu execution.  */
+static void cpu_exec_start(CPUArchState *env)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+    env->running = 1;
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+/* Mark cpu as not executing, and release pending exclusive ops.  */
+static void cpu_exec_end(CPUArchState *env)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    env->running = 0;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&exclusive_cond);
+        }
+    }
+    exclusive_idle();
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+static void qemu_mttcg_wait_io_event(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    while (cpu_thread_is_idle(env)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+    cpu_throttle_wait(cpu);
+}
+
+static void *qemu_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUArchState *env = arg;
+    CPUState *cpu = ENV_GET_CPU(env);
+    int r;
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            if (tb_flush_requested || tb_evict_requested) {
+                start_exclusive();
+                /* another vCPU thread may have done it meanwhile */
+                if (tb_flush_requested) {
+                    tb_flush(env);
+                } else if (tb_evict_requested) {
+                    tb_evict_region(env);
+                }
+                end_exclusive();
+            }
+            /* translated code takes the global mutex only for I/O */
+            qemu_mutex_unlock_iothread();
+            cpu_exec_start(env);
+            r = tcg_cpu_exec(env);
+            cpu_exec_end(env);
+            qemu_mutex_lock_iothread();
+            if (r == EXCP_ATOMIC) {
+                /* LOCK-prefixed instruction or STREX: run it again with
+                   the other vCPUs stopped, so that it is atomic against
+                   their plain stores too */
+                start_exclusive();
+                r = tcg_cpu_exec(env);
+                end_exclusive();
+            }
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+        }
+        qemu_mttcg_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -872,7 +1158,16 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (mttcg_enabled) {
+        CPUArchState *env;
+
+        /* translated code polls tcg_exit_req, no need for a signal */
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (ENV_GET_CPU(env) == cpu) {
+                cpu_exit(env);
+            }
+        }
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -905,7 +1200,15 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    CPUArchState *env = cpu_single_env;
+
+    if (mttcg_enabled && env && env->running) {
+        /* from translated code: a holder of the mutex may want to stop
+           the vCPUs, so this one must not count as running meanwhile */
+        cpu_exec_end(env);
+        qemu_mutex_lock(&qemu_global_mutex);
+        cpu_exec_start(env);
+    } else if (!tcg_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -916,13 +1219,22 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    /* with a single TCG thread, translated code always runs under the
+       global mutex */
+    return !mttcg_enabled || tls_var(iothread_locked);
+}
+
 static int all_vcpus_paused(void)
 {
     CPUArchState *penv = first_cpu;
@@ -952,7 +1264,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             while (penv) {
                 CPUState *pcpu = ENV_GET_CPU(penv);
                 pcpu->stop = 0;
@@ -987,6 +1299,20 @@ void resume_all_vcpus(void)
     }
 }
 
+static void qemu_mttcg_start_vcpu(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    cpu->thread = g_malloc0(sizeof(QemuThread));
+    cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+    qemu_cond_init(cpu->halt_cond);
+    qemu_thread_create(cpu->thread, qemu_mttcg_cpu_thread_fn, env,
+                       QEMU_THREAD_JOINABLE);
+    while (!cpu->created) {
+        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+    }
+}
+
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
     /* share a single thread for all cpus with TCG */
@@ -1048,6 +1374,8 @@ void qemu_init_vcpu(void *_env)
     cpu->stopped = true;
     if (kvm_enabled()) {
         qemu_kvm_start_vcpu(env);
+    } else if (mttcg_enabled) {
+        qemu_mttcg_start_vcpu(env);
     } else if (tcg_enabled()) {
         qemu_tcg_init_vcpu(cpu);
     } else {
@@ -40,6 +40,35 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
     .addend     = -1,
 };
 
+typedef struct TLBFlushPage {
+    CPUArchState *env;
+    target_ulong addr;
+} TLBFlushPage;
+
+/* With multi-threaded TCG, the TLB of another vCPU can only be touched by
+   its own thread, or while it is stopped by an exclusive section: other
+   flushes are queued to it as asynchronous work.  */
+static bool tlb_flush_is_remote(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    return mttcg_enabled && cpu->created && !qemu_cpu_is_self(cpu) &&
+           !cpu_in_exclusive_context();
+}
+
+static void tlb_flush_async_work(void *data)
+{
+    tlb_flush(data, 1);
+}
+
+static void tlb_flush_page_async_work(void *data)
+{
+    TLBFlushPage *flush = data;
+
+    tlb_flush_page(flush->env, flush->addr);
+    g_free(flush);
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -56,6 +85,11 @@ void tlb_flush(CPUArchState *env, int flush_global)
 {
     int i;
 
+    if (tlb_flush_is_remote(env)) {
+        async_run_on_cpu(ENV_GET_CPU(env), tlb_flush_async_work, env);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
@@ -70,6 +104,14 @@ void tlb_flush(CPUArchState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
+    env->vtlb_index = 0;
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
@@ -78,14 +120,19 @@ void tlb_flush(CPUArchState *env, int flush_global)
     tlb_flush_count++;
 }
 
+static inline bool tlb_hit_page(CPUTLBEntry *tlb_entry, target_ulong addr)
+{
+    return addr == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_hit_page(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
@@ -95,6 +142,15 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
     int i;
     int mmu_idx;
 
+    if (tlb_flush_is_remote(env)) {
+        TLBFlushPage *flush = g_malloc(sizeof(*flush));
+
+        flush->env = env;
+        flush->addr = addr;
+        async_run_on_cpu(ENV_GET_CPU(env), tlb_flush_page_async_work, flush);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
@@ -118,6 +174,15 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
     }
 
+    /* check whether there are entries that need to be flushed in the vtlb */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
+    }
+
     tb_flush_jmp_cache(env, addr);
 }
 
@@ -185,6 +250,10 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -208,6 +277,101 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
+}
+
+static inline bool tlb_entry_is_empty(CPUTLBEntry *tlb_entry)
+{
+    return tlb_entry->addr_read == -1 &&
+           tlb_entry->addr_write == -1 &&
+           tlb_entry->addr_code == -1;
+}
+
+/* Called on a miss in tlb_table, before walking the guest page tables:
+   if the page is in the victim TLB, swap it with the conflicting entry
+   of tlb_table and return true.  */
+bool tlb_victim_lookup(CPUArchState *env, target_ulong addr, int mmu_idx,
+                       int access_type)
+{
+    unsigned int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry tmp, *te, *ve;
+    hwaddr tmp_iotlb;
+    target_ulong tlb_addr;
+    int vidx;
+
+    env->tlb_miss_count++;
+    addr &= TARGET_PAGE_MASK;
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        ve = &env->tlb_v_table[mmu_idx][vidx];
+        if (access_type == 0) {
+            tlb_addr = ve->addr_read;
+        } else if (access_type == 1) {
+            tlb_addr = ve->addr_write;
+        } else {
+            tlb_addr = ve->addr_code;
+        }
+        if (addr == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            te = &env->tlb_table[mmu_idx][index];
+            tmp = *te;
+            *te = *ve;
+            *ve = tmp;
+            tmp_iotlb = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = tmp_iotlb;
+            env->tlb_victim_hit_count++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Return the host address of size bytes at addr if they are in RAM that
+   the TLB allows to be read and written directly, or NULL if the access
+   has to take the slow path (miss, MMIO, dirty tracking, watchpoints) or
+   is not naturally aligned.  Guest atomic operations use it to work on
+   guest memory with host atomic instructions.  */
+void *tlb_vaddr_to_host_rw(CPUArchState *env, target_ulong addr, int size,
+                           int mmu_idx)
+{
+    unsigned int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+    target_ulong page = addr & TARGET_PAGE_MASK;
+
+    if (addr & (size - 1)) {
+        return NULL;
+    }
+    if (te->addr_write != page &&
+        !tlb_victim_lookup(env, addr, mmu_idx, 1)) {
+        return NULL;
+    }
+    if (te->addr_write != page || te->addr_read != page) {
+        return NULL;
+    }
+    return (void *)((uintptr_t)addr + te->addend);
+}
+
+void tlb_dump_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUArchState *env;
+    uint64_t misses, hits;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        misses = env->tlb_miss_count;
+        hits = env->tlb_victim_hit_count;
+        cpu_fprintf(f, "CPU #%d TLB misses   %" PRIu64
+                    " (victim TLB hits %" PRIu64 " %d%%, page walks %"
+                    PRIu64 ")\n",
+                    ENV_GET_CPU(env)->cpu_index, misses, hits,
+                    misses ? (int)((hits * 100) / misses) : 0,
+                    misses - hits);
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -278,8 +442,18 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* keep the entry of a conflicting page in the victim TLB */
+    if (!tlb_entry_is_empty(te) &&
+        !tlb_hit_page(te, vaddr & TARGET_PAGE_MASK)) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
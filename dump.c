@@ -21,9 +21,26 @@
 #include "sysemu/dump.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/memory_mapping.h"
+#include "exec/address-spaces.h"
+#include "exec/memory.h"
 #include "qapi/error.h"
 #include "qmp-commands.h"
 #include "exec/gdbstub.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+
+#include <zlib.h>
+#ifdef CONFIG_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef CONFIG_SNAPPY
+#include <snappy-c.h>
+#endif
+
+#ifndef ELF_MACHINE_UNAME
+#define ELF_MACHINE_UNAME "Unknown"
+#endif
 
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
 {
@@ -58,7 +75,51 @@ static uint64_t cpu_convert_to_target64(uint64_t val, int endian)
     return val;
 }
 
-typedef struct DumpState {
+/* pages compressed by a worker in one go */
+#define DUMP_CHUNK_PAGES 256
+#define DUMP_MAX_WORKERS 16
+/* page descriptors written in one go */
+#define DUMP_DESC_BUF_NR 1024
+
+typedef struct DumpState DumpState;
+
+/* guest RAM that is contiguous both in guest physical and host memory */
+typedef struct DumpPhysBlock {
+    hwaddr phys;
+    ram_addr_t length;
+    uint8_t *host;
+} DumpPhysBlock;
+
+typedef enum {
+    DUMP_WORKER_IDLE,
+    DUMP_WORKER_QUEUED,
+    DUMP_WORKER_DONE,
+} DumpWorkerState;
+
+/* compresses chunks of contiguous pages for the kdump formats */
+typedef struct DumpWorker {
+    DumpState *s;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    DumpWorkerState state;
+    bool quit;
+
+    /* the chunk, copied out of guest RAM */
+    uint64_t pfn;
+    int nr_pages;
+    uint8_t *src;
+
+    /* the pages of the chunk, back to back; 0 size for zero pages */
+    uint8_t *buf;
+    uint32_t size[DUMP_CHUNK_PAGES];
+    uint32_t flags[DUMP_CHUNK_PAGES];
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem;
+#endif
+} DumpWorker;
+
+struct DumpState {
     ArchDumpInfo dump_info;
     MemoryMappingList list;
     uint16_t phdr_num;
@@ -75,7 +136,47 @@ typedef struct DumpState {
     int64_t begin;
     int64_t length;
     Error **errp;
-} DumpState;
+
+    /* kdump-compressed formats */
+    uint32_t flag_compress;
+    uint32_t nr_cpus;
+    uint8_t *note_buf;
+    size_t note_buf_offset;
+    DumpPhysBlock *blocks;      /* sorted by guest physical address */
+    int nr_blocks;
+    uint32_t ram_list_version;
+    uint64_t max_mapnr;
+    uint64_t nr_pages;
+    size_t len_dump_bitmap;     /* of one bitmap */
+    uint8_t *dump_bitmap1;      /* pages in guest RAM */
+    uint8_t *dump_bitmap2;      /* pages in the dump */
+    off_t offset_dump_bitmap;
+    off_t offset_page_desc;
+    off_t offset_page_data;
+    PageDescriptor *desc_buf;
+    int desc_buf_count;
+    DumpWorker *workers;
+    int nr_workers;
+};
+
+/*
+ * progress of the last dump, for query-dump.  A live dump updates these
+ * from its own thread, so they are only accessed atomically.
+ */
+static DumpStatus dump_status;
+static int64_t dump_bytes_completed;
+static int64_t dump_bytes_total;
+
+static void dump_set_status(DumpStatus status)
+{
+    smp_wmb();
+    atomic_set(&dump_status, status);
+}
+
+static void dump_add_completed(int64_t bytes)
+{
+    __sync_fetch_and_add(&dump_bytes_completed, bytes);
+}
 
 static int dump_cleanup(DumpState *s)
 {
@@ -84,9 +185,21 @@ static int dump_cleanup(DumpState *s)
     memory_mapping_list_free(&s->list);
     if (s->fd != -1) {
         close(s->fd);
+        s->fd = -1;
     }
+    g_free(s->note_buf);
+    s->note_buf = NULL;
+    g_free(s->blocks);
+    s->blocks = NULL;
+    g_free(s->dump_bitmap1);
+    s->dump_bitmap1 = NULL;
+    g_free(s->dump_bitmap2);
+    s->dump_bitmap2 = NULL;
+    g_free(s->desc_buf);
+    s->desc_buf = NULL;
     if (s->resume) {
         vm_start();
+        s->resume = false;
     }
 
     return ret;
@@ -268,7 +381,7 @@ static int write_elf64_note(DumpState *s)
     return 0;
 }
 
-static int write_elf64_notes(DumpState *s)
+static int write_elf64_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -276,7 +389,7 @@ static int write_elf64_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf64_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf64_note(f, env, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -284,7 +397,7 @@ static int write_elf64_notes(DumpState *s)
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf64_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf64_qemunote(f, env, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -318,7 +431,7 @@ static int write_elf32_note(DumpState *s)
     return 0;
 }
 
-static int write_elf32_notes(DumpState *s)
+static int write_elf32_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -326,7 +439,7 @@ static int write_elf32_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf32_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf32_note(f, env, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -334,7 +447,7 @@ static int write_elf32_notes(DumpState *s)
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf32_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf32_qemunote(f, env, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -400,6 +513,7 @@ static int write_memory(DumpState *s, RAMBlock *block, ram_addr_t start,
         if (ret < 0) {
             return ret;
         }
+        dump_add_completed(TARGET_PAGE_SIZE);
     }
 
     if ((size % TARGET_PAGE_SIZE) != 0) {
@@ -408,6 +522,7 @@ static int write_memory(DumpState *s, RAMBlock *block, ram_addr_t start,
         if (ret < 0) {
             return ret;
         }
+        dump_add_completed(size % TARGET_PAGE_SIZE);
     }
 
     return 0;
@@ -553,7 +668,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf64_notes(s) < 0) {
+        if (write_elf64_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
 
@@ -576,7 +691,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf32_notes(s) < 0) {
+        if (write_elf32_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
     }
@@ -665,6 +780,653 @@ static int create_vmcore(DumpState *s)
     return 0;
 }
 
+/*
+ * kdump-compressed format
+ *
+ *   ---------------------------
+ *   |  disk dump header       |  block 0
+ *   ---------------------------
+ *   |  kdump sub header       |
+ *   |  elf notes              |  sub_hdr_size blocks
+ *   ---------------------------
+ *   |  1st bitmap             |  pages present in guest RAM
+ *   |  2nd bitmap             |  pages in the dump, i.e. not zero
+ *   ---------------------------
+ *   |  page descriptors       |  one for each page in the dump
+ *   ---------------------------
+ *   |  page data              |
+ *   ---------------------------
+ *
+ * Zero pages are only found while the pages are compressed, so room is
+ * left for the descriptors of all pages; the unused end of that area is a
+ * hole in the file.  All parts are written with pwrite().
+ */
+
+static int buf_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (s->note_buf_offset + size > s->note_size) {
+        return -1;
+    }
+
+    memcpy(s->note_buf + s->note_buf_offset, buf, size);
+    s->note_buf_offset += size;
+
+    return 0;
+}
+
+static int dump_pwrite(DumpState *s, const void *buf, size_t size, off_t offset)
+{
+    const uint8_t *p = buf;
+
+    while (size > 0) {
+        ssize_t ret = pwrite(s->fd, p, size, offset);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        offset += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+static void fill_utsname(DumpState *s, NewUtsname *utsname)
+{
+    strncpy(utsname->sysname, "Linux", sizeof(utsname->sysname));
+    strncpy(utsname->machine, ELF_MACHINE_UNAME, sizeof(utsname->machine));
+}
+
+static int write_kdump_header32(DumpState *s, uint32_t sub_hdr_size,
+                                uint32_t bitmap_blocks)
+{
+    int endian = s->dump_info.d_endian;
+    size_t size = sizeof(DiskDumpHeader32) + TARGET_PAGE_SIZE +
+                  sub_hdr_size * TARGET_PAGE_SIZE;
+    DiskDumpHeader32 *dh;
+    KdumpSubHeader32 *kh;
+    uint8_t *buf;
+    int ret;
+
+    buf = g_malloc0(size);
+    dh = (DiskDumpHeader32 *)buf;
+    memcpy(dh->signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh->header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION, endian);
+    fill_utsname(s, &dh->utsname);
+    dh->status = cpu_convert_to_target32(s->flag_compress, endian);
+    dh->block_size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    dh->sub_hdr_size = cpu_convert_to_target32(sub_hdr_size, endian);
+    dh->bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+    dh->max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT_MAX),
+                                            endian);
+    dh->nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+    kh = (KdumpSubHeader32 *)(buf + DISKDUMP_HEADER_BLOCKS * TARGET_PAGE_SIZE);
+    kh->dump_level = cpu_convert_to_target32(KDUMP_DUMP_LEVEL, endian);
+    kh->offset_note = cpu_convert_to_target64(DISKDUMP_HEADER_BLOCKS *
+                                              TARGET_PAGE_SIZE + sizeof(*kh),
+                                              endian);
+    kh->note_size = cpu_convert_to_target32(s->note_size, endian);
+    kh->max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    memcpy(kh + 1, s->note_buf, s->note_size);
+
+    ret = dump_pwrite(s, buf, (DISKDUMP_HEADER_BLOCKS + sub_hdr_size) *
+                      TARGET_PAGE_SIZE, 0);
+    g_free(buf);
+    return ret;
+}
+
+static int write_kdump_header64(DumpState *s, uint32_t sub_hdr_size,
+                                uint32_t bitmap_blocks)
+{
+    int endian = s->dump_info.d_endian;
+    size_t size = sizeof(DiskDumpHeader64) + TARGET_PAGE_SIZE +
+                  sub_hdr_size * TARGET_PAGE_SIZE;
+    DiskDumpHeader64 *dh;
+    KdumpSubHeader64 *kh;
+    uint8_t *buf;
+    int ret;
+
+    buf = g_malloc0(size);
+    dh = (DiskDumpHeader64 *)buf;
+    memcpy(dh->signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh->header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION, endian);
+    fill_utsname(s, &dh->utsname);
+    dh->status = cpu_convert_to_target32(s->flag_compress, endian);
+    dh->block_size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    dh->sub_hdr_size = cpu_convert_to_target32(sub_hdr_size, endian);
+    dh->bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+    dh->max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT_MAX),
+                                            endian);
+    dh->nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+    kh = (KdumpSubHeader64 *)(buf + DISKDUMP_HEADER_BLOCKS * TARGET_PAGE_SIZE);
+    kh->dump_level = cpu_convert_to_target32(KDUMP_DUMP_LEVEL, endian);
+    kh->offset_note = cpu_convert_to_target64(DISKDUMP_HEADER_BLOCKS *
+                                              TARGET_PAGE_SIZE + sizeof(*kh),
+                                              endian);
+    kh->note_size = cpu_convert_to_target64(s->note_size, endian);
+    kh->max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    memcpy(kh + 1, s->note_buf, s->note_size);
+
+    ret = dump_pwrite(s, buf, (DISKDUMP_HEADER_BLOCKS + sub_hdr_size) *
+                      TARGET_PAGE_SIZE, 0);
+    g_free(buf);
+    return ret;
+}
+
+/* lay out the file, and write the headers and the notes */
+static int write_kdump_header(DumpState *s)
+{
+    size_t sub_hdr_len, bitmap_blocks, sub_hdr_size;
+    int ret;
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        sub_hdr_len = sizeof(KdumpSubHeader64);
+    } else {
+        sub_hdr_len = sizeof(KdumpSubHeader32);
+    }
+    sub_hdr_size = DIV_ROUND_UP(sub_hdr_len + s->note_size, TARGET_PAGE_SIZE);
+
+    /* the two bitmaps take the same number of blocks */
+    s->len_dump_bitmap = DIV_ROUND_UP(s->max_mapnr, TARGET_PAGE_SIZE * 8) *
+                         TARGET_PAGE_SIZE;
+    bitmap_blocks = 2 * s->len_dump_bitmap / TARGET_PAGE_SIZE;
+
+    s->offset_dump_bitmap = (DISKDUMP_HEADER_BLOCKS + sub_hdr_size) *
+                            TARGET_PAGE_SIZE;
+    s->offset_page_desc = s->offset_dump_bitmap + 2 * s->len_dump_bitmap;
+    s->offset_page_data = QEMU_ALIGN_UP(s->offset_page_desc + s->nr_pages *
+                                        sizeof(PageDescriptor),
+                                        TARGET_PAGE_SIZE);
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        ret = write_kdump_header64(s, sub_hdr_size, bitmap_blocks);
+    } else {
+        ret = write_kdump_header32(s, sub_hdr_size, bitmap_blocks);
+    }
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write kdump header.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static size_t dump_compress_page(DumpState *s, DumpWorker *w,
+                                 uint8_t *page, uint8_t *out)
+{
+    switch (s->flag_compress) {
+    case DUMP_DH_COMPRESSED_ZLIB: {
+        uLongf len = compressBound(TARGET_PAGE_SIZE);
+
+        if (compress2(out, &len, page, TARGET_PAGE_SIZE,
+                      Z_BEST_SPEED) != Z_OK) {
+            return 0;
+        }
+        return len;
+    }
+#ifdef CONFIG_LZO
+    case DUMP_DH_COMPRESSED_LZO: {
+        lzo_uint len;
+
+        if (lzo1x_1_compress(page, TARGET_PAGE_SIZE, out, &len,
+                             w->wrkmem) != LZO_E_OK) {
+            return 0;
+        }
+        return len;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_DH_COMPRESSED_SNAPPY: {
+        size_t len = snappy_max_compressed_length(TARGET_PAGE_SIZE);
+
+        if (snappy_compress((char *)page, TARGET_PAGE_SIZE, (char *)out,
+                            &len) != SNAPPY_OK) {
+            return 0;
+        }
+        return len;
+    }
+#endif
+    default:
+        abort();
+    }
+}
+
+/* room for a compressed page; more than a page if it does not compress */
+static size_t dump_compress_bound(DumpState *s)
+{
+    switch (s->flag_compress) {
+#ifdef CONFIG_LZO
+    case DUMP_DH_COMPRESSED_LZO:
+        return TARGET_PAGE_SIZE + TARGET_PAGE_SIZE / 16 + 64 + 3;
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_DH_COMPRESSED_SNAPPY:
+        return snappy_max_compressed_length(TARGET_PAGE_SIZE);
+#endif
+    default:
+        return compressBound(TARGET_PAGE_SIZE);
+    }
+}
+
+static void dump_compress_chunk(DumpWorker *w)
+{
+    uint8_t *out = w->buf;
+    int i;
+
+    for (i = 0; i < w->nr_pages; i++) {
+        uint8_t *page = w->src + i * TARGET_PAGE_SIZE;
+        size_t len;
+
+        w->flags[i] = 0;
+        if (buffer_find_nonzero_offset(page, TARGET_PAGE_SIZE) ==
+            TARGET_PAGE_SIZE) {
+            w->size[i] = 0;
+            continue;
+        }
+
+        len = dump_compress_page(w->s, w, page, out);
+        if (len == 0 || len >= TARGET_PAGE_SIZE) {
+            /* store the page as is */
+            memcpy(out, page, TARGET_PAGE_SIZE);
+            len = TARGET_PAGE_SIZE;
+        } else {
+            w->flags[i] = w->s->flag_compress;
+        }
+        w->size[i] = len;
+        out += len;
+    }
+}
+
+static void *dump_worker_thread(void *opaque)
+{
+    DumpWorker *w = opaque;
+
+    qemu_mutex_lock(&w->lock);
+    while (!w->quit) {
+        if (w->state == DUMP_WORKER_QUEUED) {
+            qemu_mutex_unlock(&w->lock);
+            dump_compress_chunk(w);
+            qemu_mutex_lock(&w->lock);
+            w->state = DUMP_WORKER_DONE;
+            qemu_cond_broadcast(&w->cond);
+        } else {
+            qemu_cond_wait(&w->cond, &w->lock);
+        }
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static void dump_workers_start(DumpState *s)
+{
+    int i;
+
+    s->workers = g_new0(DumpWorker, s->nr_workers);
+    for (i = 0; i < s->nr_workers; i++) {
+        DumpWorker *w = &s->workers[i];
+
+        w->s = s;
+        w->src = g_malloc(DUMP_CHUNK_PAGES * TARGET_PAGE_SIZE);
+        w->buf = g_malloc((DUMP_CHUNK_PAGES - 1) * TARGET_PAGE_SIZE +
+                          dump_compress_bound(s));
+#ifdef CONFIG_LZO
+        w->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+        qemu_mutex_init(&w->lock);
+        qemu_cond_init(&w->cond);
+        qemu_thread_create(&w->thread, dump_worker_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_workers_stop(DumpState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_workers; i++) {
+        DumpWorker *w = &s->workers[i];
+
+        qemu_mutex_lock(&w->lock);
+        w->quit = true;
+        qemu_cond_broadcast(&w->cond);
+        qemu_mutex_unlock(&w->lock);
+        qemu_thread_join(&w->thread);
+        qemu_cond_destroy(&w->cond);
+        qemu_mutex_destroy(&w->lock);
+        g_free(w->src);
+        g_free(w->buf);
+#ifdef CONFIG_LZO
+        g_free(w->wrkmem);
+#endif
+    }
+    g_free(s->workers);
+    s->workers = NULL;
+}
+
+/* waits for the chunk of w to be compressed */
+static void dump_worker_wait(DumpWorker *w)
+{
+    qemu_mutex_lock(&w->lock);
+    while (w->state == DUMP_WORKER_QUEUED) {
+        qemu_cond_wait(&w->cond, &w->lock);
+    }
+    qemu_mutex_unlock(&w->lock);
+}
+
+/*
+ * Copies a chunk of guest RAM for w and queues it.  The RAM list lock is
+ * only held for the copy, so that a live dump does not hold off migration
+ * or RAM hotplug for its whole duration; if a RAM block went away in the
+ * meantime the host pointers are stale and the dump fails.
+ */
+static int dump_worker_queue(DumpState *s, DumpWorker *w, DumpPhysBlock *block,
+                             ram_addr_t start, int nr_pages)
+{
+    qemu_mutex_lock_ramlist();
+    if (ram_list.version != s->ram_list_version) {
+        qemu_mutex_unlock_ramlist();
+        return -1;
+    }
+    memcpy(w->src, block->host + start, nr_pages * TARGET_PAGE_SIZE);
+    qemu_mutex_unlock_ramlist();
+
+    qemu_mutex_lock(&w->lock);
+    w->pfn = (block->phys + start) >> TARGET_PAGE_BITS;
+    w->nr_pages = nr_pages;
+    w->state = DUMP_WORKER_QUEUED;
+    qemu_cond_broadcast(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+static int flush_page_desc(DumpState *s)
+{
+    size_t size = s->desc_buf_count * sizeof(PageDescriptor);
+
+    if (dump_pwrite(s, s->desc_buf, size, s->offset_page_desc) < 0) {
+        return -1;
+    }
+    s->offset_page_desc += size;
+    s->desc_buf_count = 0;
+
+    return 0;
+}
+
+/* writes the descriptors and the data of a compressed chunk */
+static int write_chunk(DumpState *s, DumpWorker *w)
+{
+    int endian = s->dump_info.d_endian;
+    uint64_t pfn = w->pfn;
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < w->nr_pages; i++, pfn++) {
+        PageDescriptor *pd;
+
+        if (!w->size[i]) {
+            s->dump_bitmap2[pfn / 8] &= ~(1 << (pfn % 8));
+            continue;
+        }
+
+        pd = &s->desc_buf[s->desc_buf_count++];
+        pd->offset = cpu_convert_to_target64(s->offset_page_data + total,
+                                             endian);
+        pd->size = cpu_convert_to_target32(w->size[i], endian);
+        pd->flags = cpu_convert_to_target32(w->flags[i], endian);
+        pd->page_flags = 0;
+        total += w->size[i];
+
+        if (s->desc_buf_count == DUMP_DESC_BUF_NR && flush_page_desc(s) < 0) {
+            return -1;
+        }
+    }
+
+    if (dump_pwrite(s, w->buf, total, s->offset_page_data) < 0) {
+        return -1;
+    }
+    s->offset_page_data += total;
+    dump_add_completed((int64_t)w->nr_pages * TARGET_PAGE_SIZE);
+    w->state = DUMP_WORKER_IDLE;
+
+    return 0;
+}
+
+/*
+ * The chunks go to the workers in turn, so they come back in order: the
+ * oldest chunk in flight is always the one of the next worker.
+ */
+static int write_dump_pages(DumpState *s)
+{
+    int i, next = 0, ret = 0;
+    ram_addr_t start;
+
+    s->desc_buf = g_new(PageDescriptor, DUMP_DESC_BUF_NR);
+    s->desc_buf_count = 0;
+    dump_workers_start(s);
+
+    for (i = 0; i < s->nr_blocks && ret == 0; i++) {
+        DumpPhysBlock *block = &s->blocks[i];
+
+        for (start = 0; start < block->length && ret == 0;
+             start += DUMP_CHUNK_PAGES * TARGET_PAGE_SIZE) {
+            DumpWorker *w = &s->workers[next];
+            int nr = MIN(DUMP_CHUNK_PAGES,
+                         (block->length - start) >> TARGET_PAGE_BITS);
+
+            next = (next + 1) % s->nr_workers;
+            dump_worker_wait(w);
+            if (w->state == DUMP_WORKER_DONE) {
+                ret = write_chunk(s, w);
+            }
+            if (ret == 0) {
+                ret = dump_worker_queue(s, w, block, start, nr);
+            }
+        }
+    }
+
+    /* collect the chunks still in flight */
+    for (i = 0; i < s->nr_workers; i++) {
+        DumpWorker *w = &s->workers[(next + i) % s->nr_workers];
+
+        dump_worker_wait(w);
+        if (w->state == DUMP_WORKER_DONE && ret == 0) {
+            ret = write_chunk(s, w);
+        }
+    }
+
+    dump_workers_stop(s);
+    if (ret == 0 && s->desc_buf_count) {
+        ret = flush_page_desc(s);
+    }
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write pages.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_dump_bitmap(DumpState *s)
+{
+    if (dump_pwrite(s, s->dump_bitmap1, s->len_dump_bitmap,
+                    s->offset_dump_bitmap) < 0 ||
+        dump_pwrite(s, s->dump_bitmap2, s->len_dump_bitmap,
+                    s->offset_dump_bitmap + s->len_dump_bitmap) < 0) {
+        dump_error(s, "dump: failed to write bitmap.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int create_kdump_vmcore(DumpState *s)
+{
+    int ret;
+
+    ret = write_kdump_header(s);
+    if (ret == 0) {
+        ret = write_dump_pages(s);
+    }
+    /* the 2nd bitmap is only complete once the pages are written */
+    if (ret == 0) {
+        ret = write_dump_bitmap(s);
+    }
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    dump_completed(s);
+    return 0;
+}
+
+typedef struct DumpPhysListener {
+    MemoryListener listener;
+    GArray *blocks;
+} DumpPhysListener;
+
+static void dump_phys_region_add(MemoryListener *listener,
+                                 MemoryRegionSection *section)
+{
+    DumpPhysListener *l = container_of(listener, DumpPhysListener, listener);
+    DumpPhysBlock *last;
+    DumpPhysBlock block;
+
+    /* ROMs and MMIO are not part of the guest RAM that crash looks for */
+    if (!memory_region_is_ram(section->mr) || section->readonly) {
+        return;
+    }
+
+    block.phys = section->offset_within_address_space;
+    block.length = section->size;
+    block.host = (uint8_t *)memory_region_get_ram_ptr(section->mr) +
+                 section->offset_within_region;
+
+    /* the flat view comes in address order, merge what is contiguous */
+    if (l->blocks->len) {
+        last = &g_array_index(l->blocks, DumpPhysBlock, l->blocks->len - 1);
+        if (last->phys + last->length == block.phys &&
+            last->host + last->length == block.host) {
+            last->length += block.length;
+            return;
+        }
+    }
+    g_array_append_val(l->blocks, block);
+}
+
+/*
+ * kdump files index pages by guest physical frame number, so the blocks
+ * are taken from the guest physical memory map rather than from the RAM
+ * block offsets, which only say where RAM lives in ram_addr_t space.
+ */
+static void dump_get_phys_blocks(DumpState *s)
+{
+    DumpPhysListener l = {
+        .listener = {
+            .region_add = dump_phys_region_add,
+        },
+    };
+
+    l.blocks = g_array_new(false, false, sizeof(DumpPhysBlock));
+    memory_listener_register(&l.listener, &address_space_memory);
+    memory_listener_unregister(&l.listener);
+
+    s->nr_blocks = l.blocks->len;
+    s->blocks = (DumpPhysBlock *)g_array_free(l.blocks, false);
+}
+
+static int kdump_init(DumpState *s, DumpGuestMemoryFormat format,
+                      Error **errp)
+{
+    int i, nr_host_cpus = 1;
+
+    switch (format) {
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB:
+        s->flag_compress = DUMP_DH_COMPRESSED_ZLIB;
+        break;
+#ifdef CONFIG_LZO
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO:
+        if (lzo_init() != LZO_E_OK) {
+            error_setg(errp, "failed to initialize the lzo library");
+            return -1;
+        }
+        s->flag_compress = DUMP_DH_COMPRESSED_LZO;
+        break;
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY:
+        s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
+        break;
+#endif
+    default:
+        error_setg(errp, "dump format %s is not supported by this QEMU",
+                   DumpGuestMemoryFormat_lookup[format]);
+        return -1;
+    }
+
+    if (lseek(s->fd, 0, SEEK_CUR) < 0) {
+        error_setg(errp, "kdump-compressed dumps need a seekable file");
+        return -1;
+    }
+
+    /* the notes go to the sub header, take them now */
+    s->note_buf = g_malloc0(s->note_size);
+    s->note_buf_offset = 0;
+    if (s->dump_info.d_class == ELFCLASS64) {
+        i = write_elf64_notes(buf_write_note, s);
+    } else {
+        i = write_elf32_notes(buf_write_note, s);
+    }
+    if (i < 0) {
+        error_setg(errp, "failed to get the CPU state");
+        return -1;
+    }
+
+    /* the page descriptors must be in the order of the pages */
+    s->ram_list_version = ram_list.version;
+    dump_get_phys_blocks(s);
+    s->max_mapnr = 0;
+    s->nr_pages = 0;
+    for (i = 0; i < s->nr_blocks; i++) {
+        DumpPhysBlock *block = &s->blocks[i];
+
+        s->max_mapnr = MAX(s->max_mapnr, (block->phys + block->length) >>
+                                         TARGET_PAGE_BITS);
+        s->nr_pages += block->length >> TARGET_PAGE_BITS;
+    }
+
+    s->len_dump_bitmap = DIV_ROUND_UP(s->max_mapnr, TARGET_PAGE_SIZE * 8) *
+                         TARGET_PAGE_SIZE;
+    s->dump_bitmap1 = g_malloc0(s->len_dump_bitmap);
+    for (i = 0; i < s->nr_blocks; i++) {
+        uint64_t pfn = s->blocks[i].phys >> TARGET_PAGE_BITS;
+        uint64_t end = pfn + (s->blocks[i].length >> TARGET_PAGE_BITS);
+
+        for (; pfn < end; pfn++) {
+            s->dump_bitmap1[pfn / 8] |= 1 << (pfn % 8);
+        }
+    }
+    s->dump_bitmap2 = g_memdup(s->dump_bitmap1, s->len_dump_bitmap);
+
+#ifdef _SC_NPROCESSORS_ONLN
+    nr_host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    /* leave a CPU to the thread that writes the file */
+    s->nr_workers = MAX(1, MIN(nr_host_cpus - 1, DUMP_MAX_WORKERS));
+    dump_bytes_total = s->nr_pages * TARGET_PAGE_SIZE;
+
+    return 0;
+}
+
 static ram_addr_t get_start_block(DumpState *s)
 {
     RAMBlock *block;
@@ -694,13 +1456,15 @@ static ram_addr_t get_start_block(DumpState *s)
 }
 
 static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
-                     int64_t begin, int64_t length, Error **errp)
+                     int64_t begin, int64_t length,
+                     DumpGuestMemoryFormat format, bool live, Error **errp)
 {
     CPUArchState *env;
+    RAMBlock *block;
     int nr_cpus;
     int ret;
 
-    if (runstate_is_running()) {
+    if (!live && runstate_is_running()) {
         vm_stop(RUN_STATE_SAVE_VM);
         s->resume = true;
     } else {
@@ -738,6 +1502,7 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         goto cleanup;
     }
 
+    s->nr_cpus = nr_cpus;
     s->note_size = cpu_get_note_size(s->dump_info.d_class,
                                      s->dump_info.d_machine, nr_cpus);
     if (ret < 0) {
@@ -745,6 +1510,28 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         goto cleanup;
     }
 
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        memory_mapping_list_init(&s->list);
+        if (kdump_init(s, format, errp) < 0) {
+            dump_cleanup(s);
+            return -1;
+        }
+        return 0;
+    }
+
+    dump_bytes_total = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        int64_t from = block->offset, to = block->offset + block->length;
+
+        if (s->has_filter) {
+            from = MAX(from, s->begin);
+            to = MIN(to, s->begin + s->length);
+        }
+        if (to > from) {
+            dump_bytes_total += to - from;
+        }
+    }
+
     /* get memory mapping */
     memory_mapping_list_init(&s->list);
     if (paging) {
@@ -809,15 +1596,41 @@ cleanup:
     return -1;
 }
 
+static void *dump_live_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (create_kdump_vmcore(s) < 0) {
+        error_report("dump: live dump failed");
+        dump_set_status(DUMP_STATUS_FAILED);
+    } else {
+        dump_set_status(DUMP_STATUS_COMPLETED);
+    }
+    g_free(s);
+
+    return NULL;
+}
+
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
-                           Error **errp)
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_live, bool live, Error **errp)
 {
     const char *p;
     int fd = -1;
     DumpState *s;
+    QemuThread thread;
     int ret;
 
+    if (!has_format) {
+        format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+    }
+    live = has_live && live;
+
+    if (atomic_read(&dump_status) == DUMP_STATUS_ACTIVE) {
+        error_setg(errp, "a dump is already in progress");
+        return;
+    }
     if (has_begin && !has_length) {
         error_set(errp, QERR_MISSING_PARAMETER, "length");
         return;
@@ -826,6 +1639,15 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         error_set(errp, QERR_MISSING_PARAMETER, "begin");
         return;
     }
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF && (paging || has_begin)) {
+        error_setg(errp, "kdump-compressed dumps cannot use paging or "
+                   "begin/length");
+        return;
+    }
+    if (live && format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        error_setg(errp, "live dumps need a kdump-compressed format");
+        return;
+    }
 
 #if !defined(WIN32)
     if (strstart(file, "fd:", &p)) {
@@ -849,17 +1671,51 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc(sizeof(DumpState));
+    s = g_malloc0(sizeof(DumpState));
 
-    ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
+    atomic_set(&dump_bytes_completed, 0);
+    ret = dump_init(s, fd, paging, has_begin, begin, length, format, live,
+                    errp);
     if (ret < 0) {
+        dump_set_status(DUMP_STATUS_FAILED);
         g_free(s);
         return;
     }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
-        error_set(errp, QERR_IO_ERROR);
+    dump_set_status(DUMP_STATUS_ACTIVE);
+    if (live) {
+        /* errors are reported by the thread, the command has returned */
+        s->errp = NULL;
+        qemu_thread_create(&thread, dump_live_thread, s,
+                           QEMU_THREAD_DETACHED);
+        return;
+    }
+
+    if (format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        ret = create_vmcore(s);
+    } else {
+        ret = create_kdump_vmcore(s);
+    }
+    if (ret < 0) {
+        dump_set_status(DUMP_STATUS_FAILED);
+        if (!error_is_set(s->errp)) {
+            error_set(errp, QERR_IO_ERROR);
+        }
+    } else {
+        dump_set_status(DUMP_STATUS_COMPLETED);
     }
 
     g_free(s);
 }
+
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpQueryResult *result = g_new0(DumpQueryResult, 1);
+
+    result->status = atomic_read(&dump_status);
+    smp_rmb();
+    result->completed = __sync_fetch_and_add(&dump_bytes_completed, 0);
+    result->total = dump_bytes_total;
+
+    return result;
+}
@@ -31,12 +31,15 @@
 #include "hw/qdev.h"
 #include "qemu/osdep.h"
 #include "sysemu/kvm.h"
+#include "sysemu/cpus.h"
 #include "hw/xen.h"
 #include "qemu/timer.h"
 #include "qemu/config-file.h"
+#include "qemu/bitops.h"
 #include "exec/memory.h"
 #include "sysemu/dma.h"
 #include "exec/address-spaces.h"
+#include "migration/migration.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #else /* !CONFIG_USER_ONLY */
@@ -575,8 +578,15 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t end,
             != (end - 1) - start) {
         abort();
     }
+    /* the TLBs of the other vCPU threads can only be written while
+       they are stopped */
+    if (mttcg_enabled) {
+        start_exclusive();
+    }
     cpu_tlb_reset_dirty_all(start1, length);
-
+    if (mttcg_enabled) {
+        end_exclusive();
+    }
 }
 
 /* Note: start and end must be within the same ram block.  */
@@ -598,6 +608,69 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 }
 
+/*
+ * Moves dirty_flag of every page in [start, start + length) into bitmap,
+ * which is indexed by page number, and clears it.  The flags are read
+ * sizeof(unsigned long) pages at a time, and those of a word are cleared
+ * with one atomic operation, so a page dirtied meanwhile is never lost.
+ * Returns the number of bits that were not set in bitmap before.
+ */
+uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *bitmap,
+                                               ram_addr_t start,
+                                               ram_addr_t length,
+                                               int dirty_flag)
+{
+    const unsigned long mask = (~0UL / 0xff) * (uint8_t)dirty_flag;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = page + (length >> TARGET_PAGE_BITS);
+    uint8_t *flags = ram_list.phys_dirty;
+    uint64_t num_dirty = 0;
+    bool cleared = false;
+
+    while (page < end) {
+        unsigned long bits = 0;
+        int i, n;
+
+        if (page % sizeof(unsigned long) == 0 &&
+            end - page >= sizeof(unsigned long)) {
+            unsigned long *word = (unsigned long *)(flags + page);
+            unsigned long old;
+
+            n = sizeof(unsigned long);
+            if (*word & mask) {
+                old = __sync_fetch_and_and(word, ~mask);
+                for (i = 0; i < n; i++) {
+                    if (((uint8_t *)&old)[i] & dirty_flag) {
+                        bits |= 1UL << i;
+                    }
+                }
+            }
+        } else {
+            n = 1;
+            if (flags[page] & dirty_flag &&
+                __sync_fetch_and_and(flags + page, ~dirty_flag) & dirty_flag) {
+                bits = 1;
+            }
+        }
+
+        if (bits) {
+            unsigned long *dest = bitmap + BIT_WORD(page);
+
+            bits <<= page % BITS_PER_LONG;
+            num_dirty += ctpop64(bits & ~*dest);
+            *dest |= bits;
+            cleared = true;
+        }
+        page += n;
+    }
+
+    /* once for the whole range, instead of once per page */
+    if (cleared && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, start + length, length);
+    }
+    return num_dirty;
+}
+
 static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -1213,6 +1286,54 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/*
+ * Replaces the memory of the RAM block at addr with a private mapping of
+ * fd at file_offset, so that its pages are read from the file when they
+ * are first accessed.  Returns 0 on success, -1 if the block cannot be
+ * mapped and must be read instead.
+ */
+int qemu_ram_map_file(ram_addr_t addr, int fd, off_t file_offset)
+{
+    RAMBlock *block;
+    void *area;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->offset == addr) {
+            break;
+        }
+    }
+    if (!block || (block->flags & RAM_PREALLOC_MASK) || mem_path ||
+        xen_enabled() || (kvm_enabled() && !kvm_has_sync_mmu())) {
+        return -1;
+    }
+#if defined(TARGET_S390X) && defined(CONFIG_KVM)
+    /* guest memory must stay MAP_SHARED */
+    return -1;
+#endif
+
+    area = mmap(block->host, block->length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, file_offset);
+    if (area != block->host) {
+        /* a failed MAP_FIXED mapping may have dropped the old one */
+        area = mmap(block->host, block->length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (area != block->host) {
+            fprintf(stderr, "Could not remap addr: "
+                    RAM_ADDR_FMT "@" RAM_ADDR_FMT "\n",
+                    block->length, addr);
+            exit(1);
+        }
+        memory_try_enable_merging(block->host, block->length);
+        return -1;
+    }
+    memory_try_enable_merging(block->host, block->length);
+    qemu_ram_setup_dump(block->host, block->length);
+    if (kvm_enabled()) {
+        kvm_setup_guest_memory(block->host, block->length);
+    }
+    return 0;
+}
 #endif /* !_WIN32 */
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
@@ -2111,6 +2232,7 @@ void *address_space_map(AddressSpace *as,
     }
     rlen = todo;
     ret = qemu_ram_ptr_length(raddr, &rlen);
+    ram_postcopy_fault_in(ret, rlen);
     *plen = rlen;
     return ret;
 }
@@ -307,19 +307,45 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,file:-f,name:s?",
+        .params     = "[-l] [-f] [tag|id|file]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to save the VM state while the guest keeps running"
+                      "\n\t\t\t -f to only save the VM state, to the given file",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [-f] [@var{tag}|@var{id}|@var{file}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the VM state is written in the background while the
+guest keeps running, and the guest is only stopped for the final part,
+within the maximum migration downtime.  The command returns at once; the
+snapshot is listed by @code{info snapshots} once it is complete.
+
+With @option{-f}, only the VM state is written, to @var{file}, in the
+migration stream format; no snapshot of the images is created.
+ETEXI
+
+    {
+        .name       = "savevm_cancel",
+        .args_type  = "",
+        .params     = "",
+        .help       = "cancel the live snapshot in progress",
+        .mhandler.cmd = do_savevm_cancel,
+    },
+
+STEXI
+@item savevm_cancel
+@findex savevm_cancel
+Cancel the live snapshot started with @code{savevm -l}.  No snapshot is
+created.  @code{info snapshots} shows how much of the VM state a live
+snapshot has written so far.
 ETEXI
 
     {
@@ -911,6 +937,21 @@ STEXI
 @findex migrate_cancel
 Cancel the current VM migration.
 
+ETEXI
+
+    {
+        .name       = "migrate_start_postcopy",
+        .args_type  = "",
+        .params     = "",
+        .help       = "switch the current VM migration to post-copy",
+        .mhandler.cmd = hmp_migrate_start_postcopy,
+    },
+
+STEXI
+@item migrate_start_postcopy
+@findex migrate_start_postcopy
+Switch the current VM migration to post-copy.  The postcopy capability
+must be enabled.
 ETEXI
 
     {
@@ -973,6 +1014,20 @@ STEXI
 @item migrate_set_capability @var{capability} @var{state}
 @findex migrate_set_capability
 Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the parameter @var{parameter} for migration.
 ETEXI
 
     {
@@ -996,9 +1051,14 @@ ETEXI
 #if defined(CONFIG_HAVE_CORE_DUMP)
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,filename:F,begin:i?,length:i?",
-        .params     = "[-p] filename [begin] [length]",
+        .args_type  = "paging:-p,zlib:-z,lzo:-l,snappy:-s,live:-L,"
+                      "filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-z|-l|-s] [-L] filename [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -z|-l|-s: kdump-compressed format, with"
+                      " zlib, lzo or snappy compression"
+                      "\n\t\t\t -L: dump while the guest keeps running"
+                      " (kdump-compressed only)"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .mhandler.cmd = hmp_dump_guest_memory,
@@ -1006,12 +1066,18 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-z|-l|-s] [-L] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   filename: dump file name
     paging: do paging to get guest's memory mapping
+  zlib/lzo/snappy: write the kdump-compressed format, compressing the pages
+            with zlib (-z), lzo (-l) or snappy (-s); zero pages are left out.
+            The format can only be processed with crash, and cannot be used
+            with paging, begin or length.
+      live: dump in the background while the guest keeps running; the
+            progress is shown by @code{info dump}.  Needs -z, -l or -s.
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -1632,10 +1698,14 @@ show user network stack connection states
 show migration status
 @item info migrate_capabilities
 show current migration capabilities
+@item info migrate_parameters
+show current migration parameters
 @item info migrate_cache_size
 show current migration XBZRLE cache size
 @item info balloon
 show balloon information
+@item info dump
+show the progress of the last guest memory dump
 @item info qtree
 show device tree
 @item info qdm
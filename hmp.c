@@ -181,6 +181,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        if (info->ram->dirty_sync_count) {
+            monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
+                           info->ram->dirty_sync_count);
+            monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                           info->ram->dirty_sync_time);
+        }
     }
 
     if (info->has_disk) {
@@ -201,10 +207,24 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->pages);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->cpu_throttle_percentage);
+    }
+
+    if (info->has_compression) {
+        monitor_printf(mon, "compressed pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed transferred: %" PRIu64 " kbytes\n",
+                       info->compression->bytes >> 10);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -228,6 +248,38 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    if (params) {
+        monitor_printf(mon, "parameters:");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_LEVEL],
+            params->compress_level);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_THREADS],
+            params->compress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
+            params->decompress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CHANNELS],
+            params->channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_BUFFER_SIZE],
+            params->buffer_size);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_BLOCK_INFLIGHT],
+            params->block_inflight);
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
@@ -355,6 +407,12 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        if (stats->value->stats->has_l2_cache_hits) {
+            monitor_printf(mon, "    l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64 "\n",
+                           stats->value->stats->l2_cache_hits,
+                           stats->value->stats->l2_cache_misses);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -470,6 +528,29 @@ void hmp_info_balloon(Monitor *mon, const QDict *qdict)
     qapi_free_BalloonInfo(info);
 }
 
+void hmp_info_dump(Monitor *mon, const QDict *qdict)
+{
+    DumpQueryResult *result;
+    Error *err = NULL;
+
+    result = qmp_query_dump(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "status: %s\n", DumpStatus_lookup[result->status]);
+    if (result->total) {
+        monitor_printf(mon, "completed: %" PRId64 " of %" PRId64 " kbytes"
+                       " (%" PRId64 "%%)\n", result->completed >> 10,
+                       result->total >> 10,
+                       result->completed * 100 / result->total);
+    }
+
+    qapi_free_DumpQueryResult(result);
+}
+
 static void hmp_info_pci_device(Monitor *mon, const PciDeviceInfo *dev)
 {
     PciMemoryRegionList *region;
@@ -846,7 +927,18 @@ void hmp_snapshot_blkdev(Monitor *mon, const QDict *qdict)
 
 void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
 {
-    qmp_migrate_cancel(NULL);
+    Error *err = NULL;
+
+    qmp_migrate_cancel(&err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
 }
 
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
@@ -906,6 +998,63 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+    bool has_compress_level = false;
+    bool has_compress_threads = false;
+    bool has_decompress_threads = false;
+    bool has_channels = false;
+    bool has_buffer_size = false;
+    bool has_block_inflight = false;
+    int i;
+
+    for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
+        if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            switch (i) {
+            case MIGRATION_PARAMETER_COMPRESS_LEVEL:
+                has_compress_level = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_THREADS:
+                has_compress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_DECOMPRESS_THREADS:
+                has_decompress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_CHANNELS:
+                has_channels = true;
+                break;
+            case MIGRATION_PARAMETER_BUFFER_SIZE:
+                has_buffer_size = true;
+                break;
+            case MIGRATION_PARAMETER_BLOCK_INFLIGHT:
+                has_block_inflight = true;
+                break;
+            }
+            qmp_migrate_set_parameters(has_compress_level, value,
+                                       has_compress_threads, value,
+                                       has_decompress_threads, value,
+                                       has_channels, value,
+                                       has_buffer_size, value,
+                                       has_block_inflight, value,
+                                       &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_PARAMETER_MAX) {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -1136,13 +1285,30 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *errp = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    int zlib = qdict_get_try_bool(qdict, "zlib", 0);
+    int lzo = qdict_get_try_bool(qdict, "lzo", 0);
+    int snappy = qdict_get_try_bool(qdict, "snappy", 0);
+    int live = qdict_get_try_bool(qdict, "live", 0);
     const char *file = qdict_get_str(qdict, "filename");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
     int64_t begin = 0;
     int64_t length = 0;
+    DumpGuestMemoryFormat format = DUMP_GUEST_MEMORY_FORMAT_ELF;
     char *prot;
 
+    if (zlib + lzo + snappy > 1) {
+        monitor_printf(mon, "only one of -z, -l and -s can be given\n");
+        return;
+    }
+    if (zlib) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB;
+    } else if (lzo) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO;
+    } else if (snappy) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY;
+    }
+
     if (has_begin) {
         begin = qdict_get_int(qdict, "begin");
     }
@@ -1153,7 +1319,7 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          &errp);
+                          true, format, true, live, &errp);
     hmp_handle_error(mon, &errp);
     g_free(prot);
 }
@@ -428,12 +428,16 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 #endif
 
+    bdrv_io_plug(s->bs);
+
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
 
+    bdrv_io_unplug(s->bs);
+
     /*
      * FIXME: Want to check for completions before returning to guest mode,
      * so cached reads and writes are reported as quickly as possible. But
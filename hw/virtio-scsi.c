@@ -150,6 +150,7 @@ typedef struct VirtIOSCSIReq {
     VirtQueueElement elem;
     QEMUSGList qsgl;
     SCSIRequest *sreq;
+    struct VirtIOSCSIReq *next;
     union {
         char                  *buf;
         VirtIOSCSICmdReq      *cmd;
@@ -470,8 +471,8 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
 static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
-    VirtIOSCSIReq *req;
-    int n;
+    VirtIOSCSIReq *req, *next;
+    VirtIOSCSIReq *head = NULL, **tail = &head;
 
     while ((req = virtio_scsi_pop_req(s, vq))) {
         SCSIDevice *d;
@@ -514,10 +515,24 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
             }
         }
 
-        n = scsi_req_enqueue(req->sreq);
-        if (n) {
+        /*
+         * Hold back the host I/O until the whole virtqueue has been
+         * parsed, so that requests to the same disk go out in one batch.
+         */
+        bdrv_io_plug(d->conf.bs);
+        req->next = NULL;
+        *tail = req;
+        tail = &req->next;
+    }
+
+    for (req = head; req; req = next) {
+        BlockDriverState *bs = req->sreq->dev->conf.bs;
+
+        next = req->next;
+        if (scsi_req_enqueue(req->sreq)) {
             scsi_req_continue(req->sreq);
         }
+        bdrv_io_unplug(bs);
     }
 }
 
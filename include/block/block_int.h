@@ -147,6 +147,8 @@ struct BlockDriver {
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -204,6 +206,13 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Hold back submission of new requests between plug and unplug, so
+     * that they can be passed to the host in one go.  Calls nest.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -268,6 +277,10 @@ struct BlockDriverState {
     /* the memory alignment required for the buffers handled by this driver */
     int buffer_alignment;
 
+    /* size in bytes of the L2 table cache for formats that have one,
+     * 0 for the driver's default */
+    uint64_t l2_cache_size;
+
     /* do we need to tell the quest if we have a volatile write cache? */
     int enable_write_cache;
 
@@ -292,6 +305,7 @@ int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
+void bdrv_set_l2_cache_size(BlockDriverState *bs, uint64_t size);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
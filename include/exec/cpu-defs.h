@@ -64,6 +64,7 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define EXCP_HLT        0x10001 /* hlt instruction reached */
 #define EXCP_DEBUG      0x10002 /* cpu stopped after a breakpoint or singlestep */
 #define EXCP_HALTED     0x10003 /* cpu is halted (waiting for external event) */
+#define EXCP_ATOMIC     0x10004 /* must run with other cpus stopped */
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
@@ -79,6 +80,9 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #if !defined(CONFIG_USER_ONLY)
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* The victim TLB is a small fully associative cache of the entries that
+   were evicted from tlb_table by a conflicting page.  */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -112,8 +116,14 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
+    unsigned int vtlb_index; /* next victim TLB entry to replace */     \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    /* misses in tlb_table, and how many of them the victim TLB served */ \
+    uint64_t tlb_miss_count;                                            \
+    uint64_t tlb_victim_hit_count;
 
 #else
 
@@ -194,6 +204,13 @@ typedef struct CPUWatchpoint {
     CPUArchState *next_cpu; /* next CPU sharing TB cache */                 \
     uint32_t host_tid; /* host thread ID */                             \
     int running; /* Nonzero if cpu is currently running(usermode).  */  \
+    /* tb_phys_hash_lookup() statistics, kept per CPU so that vCPU      \
+       threads do not bounce a shared cache line on every lookup */     \
+    unsigned long tb_phys_hash_lookups;                                 \
+    unsigned long tb_phys_hash_hits;                                    \
+    unsigned long tb_phys_hash_steps;                                   \
+    /* first tier TB whose counter ran out, set by generated code */    \
+    struct TranslationBlock *hot_tb;                                    \
     /* user data */                                                     \
     void *opaque;                                                       \
                                                                         \
@@ -114,6 +114,8 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* initial size of the physical TB hash table; it grows with the number
+   of TBs so that the average chain stays short */
 #define CODE_GEN_PHYS_HASH_BITS     15
 #define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
 
@@ -139,13 +141,23 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_SUPERBLOCK  0x10000 /* Second tier translation of a hot TB.  */
+#define CF_EXCLUSIVE   0x20000 /* Runs while the other vCPUs are stopped.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
     struct TranslationBlock *phys_hash_next;
+    uint32_t phys_hash;  /* tb_phys_hash_func() of this block */
+    /* set when the TB has been removed from the physical hash table; a
+       lock-free lookup may still return it to a concurrent vCPU */
+    uint8_t invalid;
+    /* executions left before a first tier TB is retranslated as a
+       superblock, decremented by the generated code each time it takes
+       a jump that a superblock would follow */
+    int32_t hot_count;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -183,16 +195,42 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* The physical hash is keyed by everything tb_find_slow() compares, so
+   that blocks translated for the same address in different CPU modes
+   land in different buckets.  The caller masks the result with the
+   current table size.  */
+static inline uint32_t tb_phys_hash_func(tb_page_addr_t phys_pc,
+                                         target_ulong pc, uint64_t flags,
+                                         target_ulong cs_base)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    h = (uint64_t)phys_pc ^ ((uint64_t)pc << 7) ^ flags ^
+        ((uint64_t)cs_base << 13);
+    h *= 0x9e3779b97f4a7c15ULL;
+    return h >> 32;
 }
 
+/* Chained hash table of the TBs, indexed by tb_phys_hash_func().  It is
+   replaced by a larger copy when it fills up; the old copy stays valid
+   for readers until the next tb_flush().  */
+typedef struct TBPhysHashTable {
+    unsigned int mask;  /* number of buckets - 1 */
+    struct TBPhysHashTable *retired_next;
+    TranslationBlock *buckets[];
+} TBPhysHashTable;
+
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
+void tb_evict_region(CPUArchState *env);
+void tb_promote(CPUArchState *env, TranslationBlock *tb);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+TranslationBlock *tb_phys_hash_lookup(CPUArchState *env,
+                                      tb_page_addr_t phys_pc, target_ulong pc,
+                                      target_ulong cs_base, uint64_t flags);
+
+extern TBPhysHashTable *tb_phys_hash;
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -279,6 +317,25 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
 
 extern spinlock_t tb_lock;
 
+#if !defined(CONFIG_USER_ONLY)
+/* translate-all.c, only taken when mttcg_enabled */
+extern volatile bool tb_flush_requested;
+extern volatile bool tb_evict_requested;
+void qemu_mutex_lock_tb(void);
+void qemu_mutex_unlock_tb(void);
+void tb_lock_reset(void);
+/* cpus.c */
+bool cpu_in_exclusive_context(void);
+#else
+static inline void qemu_mutex_lock_tb(void)
+{
+}
+
+static inline void qemu_mutex_unlock_tb(void)
+{
+}
+#endif
+
 extern int tb_invalidated_flag;
 
 /* The return address may point to the start of the next instruction.
@@ -346,6 +403,10 @@ void io_mem_write(struct MemoryRegion *mr, hwaddr addr,
 
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
+bool tlb_victim_lookup(CPUArchState *env, target_ulong addr, int mmu_idx,
+                       int access_type);
+void *tlb_vaddr_to_host_rw(CPUArchState *env, target_ulong addr, int size,
+                           int mmu_idx);
 
 #include "exec/softmmu_defs.h"
 
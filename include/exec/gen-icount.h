@@ -35,6 +35,39 @@ static inline void gen_icount_start(void)
     tcg_temp_free_i32(count);
 }
 
+/* Count the executions of a first tier TB through a direct jump that a
+   superblock would follow; the caller has already stored the target pc.
+   Once the jump has been taken tcg_superblock_threshold times, the TB
+   leaves to cpu_exec() instead of chaining, with env->hot_tb set, and is
+   retranslated as a superblock.  TBs that do not end in such a jump never
+   count.  Neither do TBs with an instruction limit or a final I/O
+   instruction, which are one-off translations.  */
+static inline void gen_tb_hot_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr, hot_tb;
+    TCGv_i32 count;
+    int label;
+
+    if (!tcg_superblock_threshold ||
+        (tb->cflags & (CF_SUPERBLOCK | CF_COUNT_MASK | CF_LAST_IO))) {
+        return;
+    }
+    label = gen_new_label();
+    ptr = tcg_const_ptr(&tb->hot_count);
+    count = tcg_temp_new_i32();
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_subi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+    tcg_gen_brcondi_i32(TCG_COND_GT, count, 0, label);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+    hot_tb = tcg_const_ptr(tb);
+    tcg_gen_st_ptr(hot_tb, cpu_env, offsetof(CPUArchState, hot_tb));
+    tcg_temp_free_ptr(hot_tb);
+    tcg_gen_exit_tb(0);
+    gen_set_label(label);
+}
+
 static void gen_icount_end(TranslationBlock *tb, int num_insns)
 {
     gen_set_label(exitreq_label);
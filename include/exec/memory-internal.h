@@ -133,6 +133,10 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *bitmap,
+                                               ram_addr_t start,
+                                               ram_addr_t length,
+                                               int dirty_flag);
 
 extern const IORangeOps memory_region_iorange_ops;
 
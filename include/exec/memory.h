@@ -469,6 +469,27 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
  */
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
+
+/**
+ * memory_region_test_and_clear_dirty_bitmap: Move the dirty state of a range
+ *                                            of pages into a bitmap.
+ *
+ * Like memory_region_test_and_clear_dirty(), for each page of the range,
+ * but works on many pages at a time.  Bit n of @bitmap stands for the page
+ * at ram_addr n * TARGET_PAGE_SIZE; bits are only ever set.  Returns the
+ * number of bits that were not set before.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ * @bitmap: the bitmap that receives the dirty pages.
+ */
+uint64_t memory_region_test_and_clear_dirty_bitmap(MemoryRegion *mr,
+                                                   hwaddr addr, hwaddr size,
+                                                   unsigned client,
+                                                   unsigned long *bitmap);
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -22,6 +22,7 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include "exec/memory.h"
 
 #define DATA_SIZE (1 << SHIFT)
@@ -65,6 +66,7 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
 {
     DATA_TYPE res;
     MemoryRegion *mr = iotlb_to_region(physaddr);
+    bool locked = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     env->mem_io_pc = retaddr;
@@ -75,6 +77,11 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
         cpu_io_recompile(env, retaddr);
     }
 
+    /* multi-threaded TCG runs translated code without the global mutex */
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
     env->mem_io_vaddr = addr;
 #if SHIFT <= 2
     res = io_mem_read(mr, physaddr, 1 << SHIFT);
@@ -87,6 +94,9 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
     res |= io_mem_read(mr, physaddr + 4, 4) << 32;
 #endif
 #endif /* SHIFT > 2 */
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
     return res;
 }
 
@@ -143,7 +153,9 @@ glue(glue(helper_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_lookup(env, addr, mmu_idx, READ_ACCESS_TYPE)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -195,7 +207,9 @@ glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_lookup(env, addr, mmu_idx, READ_ACCESS_TYPE)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -216,6 +230,7 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
                                           uintptr_t retaddr)
 {
     MemoryRegion *mr = iotlb_to_region(physaddr);
+    bool locked = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_ram && mr != &io_mem_rom
@@ -225,6 +240,11 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
         cpu_io_recompile(env, retaddr);
     }
 
+    /* multi-threaded TCG runs translated code without the global mutex */
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
     env->mem_io_vaddr = addr;
     env->mem_io_pc = retaddr;
 #if SHIFT <= 2
@@ -238,6 +258,9 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
     io_mem_write(mr, physaddr + 4, val >> 32, 4);
 #endif
 #endif /* SHIFT > 2 */
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
@@ -288,7 +311,9 @@ void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_lookup(env, addr, mmu_idx, 1)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
@@ -338,7 +363,9 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_lookup(env, addr, mmu_idx, 1)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
@@ -34,9 +34,17 @@ struct MigrationState
     int64_t bandwidth_limit;
     size_t bytes_xfer;
     size_t xfer_limit;
+    /* RAM channel and fixed-ram bytes at the start of the rate limit period */
+    uint64_t side_bytes_start;
     uint8_t *buffer;
     size_t buffer_size;
     size_t buffer_capacity;
+    /* data waiting to be sent, in stream order; entries with a NULL base
+     * are the next bytes of buffer, the others point to guest RAM */
+    struct iovec *queue;
+    int queue_cnt;
+    int queue_capacity;
+    size_t queue_size;
     QemuThread thread;
 
     QEMUFile *file;
@@ -45,15 +53,25 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    ssize_t (*writev)(MigrationState *s, struct iovec *iov, int iovcnt);
+    /* opens one more connection to the destination, for guest RAM */
+    int (*open_channel)(MigrationState *s);
+    char *channel_uri;
     void *opaque;
     MigrationParams params;
     int64_t total_time;
     int64_t downtime;
     int64_t expected_downtime;
     int64_t dirty_pages_rate;
+    int64_t dirty_sync_count;
+    int64_t dirty_sync_time;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int parameters[MIGRATION_PARAMETER_MAX];
     bool complete;
+    /* post-copy was requested, and has started */
+    bool start_postcopy;
+    bool postcopy;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -74,6 +92,8 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
 
+int tcp_accept_incoming_channels(int *fds, int nr);
+
 void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
@@ -82,6 +102,10 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *filename, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename, Error **errp);
+
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
@@ -109,6 +133,9 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -132,4 +159,30 @@ int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
+
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+void migrate_decompress_threads_join(void);
+
+int migrate_channels(void);
+int migrate_buffer_size(void);
+int migrate_block_inflight(void);
+uint64_t ram_channels_bytes_transferred(void);
+int ram_channels_connect(MigrationState *s);
+void ram_channels_disconnect(void);
+void migrate_channels_load_cleanup(void);
+
+bool migrate_postcopy(void);
+bool migrate_auto_converge(void);
+
+bool migrate_fixed_ram(void);
+bool migrate_zero_blocks(void);
+int ram_fixed_save_header(int fd);
+int ram_fixed_load(int fd);
+uint64_t ram_fixed_bytes_transferred(void);
+int ram_postcopy_iterate(QEMUFile *f, int fd);
+void ram_postcopy_incoming_listen(QEMUFile *f);
+void ram_postcopy_fault_in(void *host, size_t len);
 #endif
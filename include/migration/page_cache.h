@@ -39,12 +39,13 @@ void cache_fini(PageCache *cache);
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
- * Returns %true if page is cached
+ * Returns %true if page is cached.  A hit makes the page the most recently
+ * used one of its set.
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -58,6 +59,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the previous value will be overwritten
+ * If the set of the page is full, the least recently used page of the set is
+ * evicted.
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
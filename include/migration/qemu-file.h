@@ -31,6 +31,17 @@
 typedef int (QEMUFilePutBufferFunc)(void *opaque, const uint8_t *buf,
                                     int64_t pos, int size);
 
+/* Write the data of an iovec array to a file at the given position, which
+ * can be ignored if the file is only used for streaming.  Returns the
+ * number of bytes written, or a negative errno.  The data in the buffer of
+ * the QEMUFile (see qemu_file_owns_buffer) is only valid until the function
+ * returns, so it must be written or copied; the buffers queued with
+ * qemu_put_buffer_async() stay valid until the file is closed and can be
+ * kept by reference.
+ */
+typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
+                                           int iovcnt, int64_t pos);
+
 /* Read a chunk of data from a file at the given position.  The pos argument
  * can be ignored if the file is only be used for streaming.  The number of
  * bytes actually read should be returned.
@@ -71,6 +82,7 @@ typedef struct QEMUFileOps {
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
     QEMUFileGetRateLimit *get_rate_limit;
+    QEMUFileWritevBufferFunc *writev_buffer;
 } QEMUFileOps;
 
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
@@ -83,6 +95,11 @@ int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+/* Like qemu_put_buffer(), but the data is queued by reference instead of
+ * being copied, if the file supports it.  buf must not be freed until the
+ * file is closed; its contents are read when the data is sent.
+ */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
@@ -113,6 +130,9 @@ int qemu_file_rate_limit(QEMUFile *f);
 int64_t qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
+void qemu_file_set_error(QEMUFile *f, int ret);
+void qemu_file_set_buffer_size(QEMUFile *f, int size);
+bool qemu_file_owns_buffer(QEMUFile *f, const void *buf);
 
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
 {
@@ -36,8 +36,11 @@ typedef struct SaveVMHandlers {
     int (*save_live_iterate)(QEMUFile *f, void *opaque);
     int (*save_live_complete)(QEMUFile *f, void *opaque);
     uint64_t (*save_live_pending)(QEMUFile *f, void *opaque, uint64_t max_size);
+    /* Called instead of save_live_complete when switching to post-copy */
+    int (*save_live_postcopy)(QEMUFile *f, void *opaque);
     void (*cancel)(void *opaque);
     LoadStateHandler *load_state;
+    int (*load_postcopy)(QEMUFile *f, void *opaque);
     bool (*is_active)(void *opaque);
 } SaveVMHandlers;
 
@@ -276,6 +276,10 @@ typedef struct PCIHostDeviceAddress {
 
 void tcg_exec_init(unsigned long tb_size);
 bool tcg_enabled(void);
+extern bool mttcg_enabled;
+bool mttcg_supported(void);
+extern int tcg_superblock_threshold;
+bool tcg_superblocks_supported(void);
 
 void cpu_exec_init_all(void);
 
@@ -292,6 +296,7 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -351,6 +356,9 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
 
 bool buffer_is_zero(const void *buf, size_t len);
+#define BUFFER_FIND_NONZERO_OFFSET_CHUNK 64
+size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+bool host_has_avx2(void);
 
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
@@ -64,4 +64,11 @@
 
 #endif
 
+/* Single accesses to shared variables that are read or written
+ * without a lock.  They are not reordered or torn by the compiler, but
+ * carry no memory barrier.
+ */
+#define atomic_read(ptr)       (*(__typeof__(*ptr) volatile *) (ptr))
+#define atomic_set(ptr, i)     ((*(__typeof__(*ptr) volatile *) (ptr)) = (i))
+
 #endif
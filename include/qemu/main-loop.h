@@ -294,6 +294,15 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return whether the main loop mutex is held.
+ *
+ * Only vCPU threads of multi-threaded TCG run translated code without
+ * the main loop mutex; they use this function to take the mutex around
+ * device accesses.  Without multi-threaded TCG it always returns true.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
@@ -68,6 +68,8 @@ struct kvm_run;
  * @created: Indicates whether the CPU thread has been successfully created.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
+ * @throttle_pending: Indicates the CPU should sleep for a while to slow
+ *   the guest down, see cpu_throttle_set().
  * @kvm_fd: vCPU file descriptor for KVM.
  *
  * State of one CPU core or thread.
@@ -92,6 +94,7 @@ struct CPUState {
     bool created;
     bool stop;
     bool stopped;
+    bool throttle_pending;
 
     int kvm_fd;
     bool kvm_vcpu_dirty;
@@ -169,6 +172,17 @@ bool cpu_is_stopped(CPUState *cpu);
  */
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu, without
+ * waiting for it to complete.  Must be called with the global mutex held.
+ */
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -7,12 +7,23 @@ void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
 
+/* multi-threaded TCG: keep the other vCPUs out of translated code */
+void start_exclusive(void);
+void end_exclusive(void);
+
 void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
 void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+/* Highest percentage of time the vCPUs can be kept from running */
+#define CPU_THROTTLE_PCT_MAX 99
+
+void cpu_throttle_set(int percentage);
+void cpu_throttle_stop(void);
+int cpu_throttle_get_percentage(void);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
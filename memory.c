@@ -18,6 +18,7 @@
 #include "exec/ioport.h"
 #include "qemu/bitops.h"
 #include "sysemu/kvm.h"
+#include "sysemu/cpus.h"
 #include <assert.h>
 
 #include "exec/memory-internal.h"
@@ -744,6 +745,11 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth && memory_region_update_pending) {
         memory_region_update_pending = false;
+        /* vCPU threads read the flat views and the dispatch tables
+           without the global mutex */
+        if (mttcg_enabled) {
+            start_exclusive();
+        }
         MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
         QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
@@ -751,6 +757,9 @@ void memory_region_transaction_commit(void)
         }
 
         MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+        if (mttcg_enabled) {
+            end_exclusive();
+        }
     }
 }
 
@@ -1096,6 +1105,15 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
     return ret;
 }
 
+uint64_t memory_region_test_and_clear_dirty_bitmap(MemoryRegion *mr,
+                                                   hwaddr addr, hwaddr size,
+                                                   unsigned client,
+                                                   unsigned long *bitmap)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_sync_dirty_bitmap(bitmap, mr->ram_addr + addr,
+                                                 size, 1 << client);
+}
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
@@ -43,6 +43,11 @@ static int file_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static ssize_t file_writev(MigrationState *s, struct iovec *iov, int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+
 static int exec_close(MigrationState *s)
 {
     int ret = 0;
@@ -75,6 +80,7 @@ void exec_start_outgoing_migration(MigrationState *s, const char *command, Error
     s->close = exec_close;
     s->get_error = file_errno;
     s->write = file_write;
+    s->writev = file_writev;
 
     migrate_fd_connect(s);
 }
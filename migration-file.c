@@ -0,0 +1,186 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "block/block.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/*
+ * The migration is written to a temporary file next to the target, which
+ * replaces the target only once it is complete.  The target may be the
+ * image this VM was restored from, with guest RAM still mapped from it;
+ * truncating it in place would pull those pages out from under the guest.
+ */
+typedef struct FileMigration {
+    char *path;
+    char *tmp_path;
+} FileMigration;
+
+static void file_migration_free(MigrationState *s)
+{
+    FileMigration *fm = s->opaque;
+
+    g_free(fm->path);
+    g_free(fm->tmp_path);
+    g_free(fm);
+    s->opaque = NULL;
+}
+
+static int file_errno(MigrationState *s)
+{
+    return errno;
+}
+
+static int file_write(MigrationState *s, const void * buf, size_t size)
+{
+    return write(s->fd, buf, size);
+}
+
+static ssize_t file_writev(MigrationState *s, struct iovec *iov, int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+
+static int file_close(MigrationState *s)
+{
+    FileMigration *fm = s->opaque;
+    int ret;
+
+    DPRINTF("file_close\n");
+    if (migration_has_failed(s)) {
+        close(s->fd);
+        s->fd = -1;
+        unlink(fm->tmp_path);
+        file_migration_free(s);
+        return 0;
+    }
+
+    /* make sure the data is on disk before signaling success */
+    ret = fsync(s->fd);
+    if (ret != 0) {
+        ret = -errno;
+        perror("migration-file: fsync");
+        close(s->fd);
+        s->fd = -1;
+        goto fail;
+    }
+    ret = close(s->fd);
+    s->fd = -1;
+    if (ret != 0) {
+        ret = -errno;
+        perror("migration-file: close");
+        goto fail;
+    }
+    if (rename(fm->tmp_path, fm->path) != 0) {
+        ret = -errno;
+        perror("migration-file: rename");
+        goto fail;
+    }
+    file_migration_free(s);
+    return 0;
+
+fail:
+    unlink(fm->tmp_path);
+    file_migration_free(s);
+    return ret;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    FileMigration *fm;
+    int ret;
+
+    fm = g_new0(FileMigration, 1);
+    fm->path = g_strdup(filename);
+    fm->tmp_path = g_strdup_printf("%s.XXXXXX", filename);
+
+    s->fd = mkstemp(fm->tmp_path);
+    if (s->fd < 0) {
+        error_setg_errno(errp, errno, "failed to create a file next to '%s'",
+                         filename);
+        goto fail;
+    }
+    qemu_set_cloexec(s->fd);
+
+    if (migrate_fixed_ram()) {
+        ret = ram_fixed_save_header(s->fd);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "failed to write '%s'", filename);
+            qemu_close(s->fd);
+            s->fd = -1;
+            unlink(fm->tmp_path);
+            goto fail;
+        }
+    }
+
+    s->opaque = fm;
+    s->get_error = file_errno;
+    s->write = file_write;
+    s->writev = file_writev;
+    s->close = file_close;
+
+    migrate_fd_connect(s);
+    return;
+
+fail:
+    g_free(fm->path);
+    g_free(fm->tmp_path);
+    g_free(fm);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    int fd, ret;
+    QEMUFile *f;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", filename);
+
+    fd = qemu_open(filename, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", filename);
+        return;
+    }
+
+    /* the pages of a fixed-ram file are restored before the stream */
+    ret = ram_fixed_load(fd);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to load RAM from '%s'",
+                         filename);
+        qemu_close(fd);
+        return;
+    }
+    DPRINTF("%s file\n", ret ? "fixed-ram" : "stream");
+
+    f = qemu_fdopen(fd, "rb");
+    if (f == NULL) {
+        error_setg_errno(errp, errno, "failed to open '%s'", filename);
+        qemu_close(fd);
+        return;
+    }
+
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+}
@@ -15,6 +15,7 @@
 
 #include "qemu-common.h"
 #include "qemu/sockets.h"
+#include "qemu/iov.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "block/block.h"
@@ -39,6 +40,11 @@ static int socket_write(MigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+static ssize_t socket_writev(MigrationState *s, struct iovec *iov, int iovcnt)
+{
+    return iov_send(s->fd, iov, iovcnt, 0, iov_size(iov, iovcnt));
+}
+
 static int tcp_close(MigrationState *s)
 {
     int r = 0;
@@ -49,6 +55,19 @@ static int tcp_close(MigrationState *s)
     return r;
 }
 
+/* Blocks until connected; only called from the migration thread */
+static int tcp_open_channel(MigrationState *s)
+{
+    int fd;
+
+    fd = inet_connect(s->channel_uri, NULL);
+    if (fd < 0) {
+        DPRINTF("channel connect error\n");
+        return -EIO;
+    }
+    return fd;
+}
+
 static void tcp_wait_for_connect(int fd, void *opaque)
 {
     MigrationState *s = opaque;
@@ -69,11 +88,51 @@ void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Erro
 {
     s->get_error = socket_errno;
     s->write = socket_write;
+    s->writev = socket_writev;
     s->close = tcp_close;
+    s->open_channel = tcp_open_channel;
+    s->channel_uri = g_strdup(host_port);
 
     s->fd = inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/* Kept open after the first connection when guest RAM uses more channels */
+static int tcp_channel_listen_fd = -1;
+
+/* Accepts the extra RAM connections, which the source opens before it
+ * announces them in the stream.
+ */
+int tcp_accept_incoming_channels(int *fds, int nr)
+{
+    int i, c;
+
+    if (tcp_channel_listen_fd == -1) {
+        return -EINVAL;
+    }
+
+    qemu_set_block(tcp_channel_listen_fd);
+    for (i = 0; i < nr; i++) {
+        do {
+            c = qemu_accept(tcp_channel_listen_fd, NULL, NULL);
+        } while (c == -1 && socket_error() == EINTR);
+        if (c == -1) {
+            fprintf(stderr, "could not accept migration channel\n");
+            break;
+        }
+        fds[i] = c;
+    }
+    closesocket(tcp_channel_listen_fd);
+    tcp_channel_listen_fd = -1;
+
+    if (i < nr) {
+        while (i-- > 0) {
+            closesocket(fds[i]);
+        }
+        return -EIO;
+    }
+    return 0;
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -86,7 +145,11 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && socket_error() == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
+    if (migrate_channels() > 1) {
+        tcp_channel_listen_fd = s;
+    } else {
+        closesocket(s);
+    }
 
     DPRINTF("accepted migration\n");
 
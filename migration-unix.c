@@ -39,6 +39,11 @@ static int unix_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static ssize_t unix_writev(MigrationState *s, struct iovec *iov, int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+
 static int unix_close(MigrationState *s)
 {
     int r = 0;
@@ -69,6 +74,7 @@ void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **
 {
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->writev = unix_writev;
     s->close = unix_close;
 
     s->fd = unix_nonblocking_connect(path, unix_wait_for_connect, s, errp);
@@ -23,6 +23,7 @@
 #include "migration/block.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
+#include "sysemu/cpus.h"
 
 //#define DEBUG_MIGRATION
 
@@ -52,6 +53,25 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration compression defaults */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+#define MAX_MIGRATE_COMPRESS_THREAD_COUNT 255
+
+/* Migration RAM channels defaults */
+#define DEFAULT_MIGRATE_CHANNELS 1
+#define MAX_MIGRATE_CHANNELS 16
+
+/* Migration QEMUFile buffer size defaults, in bytes */
+#define DEFAULT_MIGRATE_BUFFER_SIZE 32768
+#define MIN_MIGRATE_BUFFER_SIZE 4096
+#define MAX_MIGRATE_BUFFER_SIZE (16 << 20)
+
+/* Block migration reads in flight defaults */
+#define DEFAULT_MIGRATE_BLOCK_INFLIGHT 16
+#define MAX_MIGRATE_BLOCK_INFLIGHT 64
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -65,6 +85,17 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] =
+                DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+                DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_CHANNELS] = DEFAULT_MIGRATE_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_BUFFER_SIZE] =
+                DEFAULT_MIGRATE_BUFFER_SIZE,
+        .parameters[MIGRATION_PARAMETER_BLOCK_INFLIGHT] =
+                DEFAULT_MIGRATE_BLOCK_INFLIGHT,
     };
 
     return &current_migration;
@@ -83,6 +114,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -95,7 +128,10 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
+    /* in post-copy, the rest of guest RAM is received in the background */
+    if (ret != 1) {
+        qemu_fclose(f);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
@@ -121,6 +157,7 @@ void process_incoming_migration(QEMUFile *f)
 
     assert(fd != -1);
     qemu_set_nonblock(fd);
+    qemu_file_set_buffer_size(f, migrate_buffer_size());
     qemu_coroutine_enter(co, f);
 }
 
@@ -168,10 +205,21 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->bytes = compress_mig_bytes_transferred();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -183,7 +231,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->postcopy ? "postcopy-active" : "active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
@@ -199,7 +247,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
+        info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
 
+        if (migrate_auto_converge()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -210,9 +264,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -228,6 +284,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->duplicate = dup_mig_pages_transferred();
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
+        info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -258,12 +316,112 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     }
 }
 
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    params->compress_threads =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    params->decompress_threads =
+            s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->channels = s->parameters[MIGRATION_PARAMETER_CHANNELS];
+    params->buffer_size = s->parameters[MIGRATION_PARAMETER_BUFFER_SIZE];
+    params->block_inflight =
+            s->parameters[MIGRATION_PARAMETER_BLOCK_INFLIGHT];
+
+    return params;
+}
+
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_channels,
+                                int64_t channels,
+                                bool has_buffer_size,
+                                int64_t buffer_size,
+                                bool has_block_inflight,
+                                int64_t block_inflight, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "is invalid, it should be in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+            (compress_threads < 1 ||
+             compress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+            (decompress_threads < 1 ||
+             decompress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_channels &&
+            (channels < 1 || channels > MAX_MIGRATE_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "channels",
+                  "is invalid, it should be in the range of 1 to 16");
+        return;
+    }
+    if (has_buffer_size &&
+            (buffer_size < MIN_MIGRATE_BUFFER_SIZE ||
+             buffer_size > MAX_MIGRATE_BUFFER_SIZE)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "buffer-size",
+                  "is invalid, it should be in the range of 4096 to 16777216");
+        return;
+    }
+    if (has_block_inflight &&
+            (block_inflight < 1 ||
+             block_inflight > MAX_MIGRATE_BLOCK_INFLIGHT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "block-inflight",
+                  "is invalid, it should be in the range of 1 to 64");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                                                    decompress_threads;
+    }
+    if (has_channels) {
+        s->parameters[MIGRATION_PARAMETER_CHANNELS] = channels;
+    }
+    if (has_buffer_size) {
+        s->parameters[MIGRATION_PARAMETER_BUFFER_SIZE] = buffer_size;
+    }
+    if (has_block_inflight) {
+        s->parameters[MIGRATION_PARAMETER_BLOCK_INFLIGHT] = block_inflight;
+    }
+}
+
 /* shared migration helpers */
 
 static int migrate_fd_cleanup(MigrationState *s)
 {
     int ret = 0;
 
+    cpu_throttle_stop();
+    /* the extra RAM channels must not reconnect to this destination when
+     * the VM state is saved again, e.g. by savevm */
+    s->open_channel = NULL;
+
     if (s->file) {
         DPRINTF("closing file\n");
         ret = qemu_fclose(s->file);
@@ -313,6 +471,29 @@ static ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
     return ret;
 }
 
+static ssize_t migrate_fd_writev(MigrationState *s, struct iovec *iov,
+                                 int iovcnt)
+{
+    ssize_t ret;
+
+    if (!s->writev) {
+        return migrate_fd_put_buffer(s, iov[0].iov_base, iov[0].iov_len);
+    }
+
+    if (s->state != MIG_STATE_ACTIVE) {
+        return -EIO;
+    }
+
+    do {
+        ret = s->writev(s, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+
+    return ret;
+}
+
 static void migrate_fd_cancel(MigrationState *s)
 {
     if (s->state != MIG_STATE_ACTIVE)
@@ -369,16 +550,20 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int parameters[MIGRATION_PARAMETER_MAX];
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(parameters, s->parameters, sizeof(parameters));
 
+    g_free(s->channel_uri);
     memset(s, 0, sizeof(*s));
     s->bandwidth_limit = bandwidth_limit;
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    memcpy(s->parameters, parameters, sizeof(parameters));
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -425,6 +610,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_fixed_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "the fixed-ram capability needs a file: migration");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -436,6 +626,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -451,7 +643,37 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
 
 void qmp_migrate_cancel(Error **errp)
 {
-    migrate_fd_cancel(migrate_get_current());
+    MigrationState *s = migrate_get_current();
+
+    /* the destination runs the guest and needs our pages */
+    if (s->state == MIG_STATE_ACTIVE && s->postcopy) {
+        error_setg(errp, "Migration is in post-copy and cannot be cancelled");
+        return;
+    }
+    migrate_fd_cancel(s);
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    struct stat st;
+
+    if (!migrate_postcopy()) {
+        error_setg(errp, "Enable the postcopy capability before starting "
+                   "the migration");
+        return;
+    }
+    if (s->state != MIG_STATE_ACTIVE) {
+        error_setg(errp, "No migration in progress");
+        return;
+    }
+    /* The destination asks for missing pages on the migration channel */
+    if (s->fd < 0 || fstat(s->fd, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        error_setg(errp, "Post-copy needs a socket as migration transport");
+        return;
+    }
+
+    s->start_postcopy = true;
 }
 
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
@@ -511,46 +733,225 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+bool migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+bool migrate_fixed_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM];
+}
+
+bool migrate_zero_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+bool migrate_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+}
+
+int migrate_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_CHANNELS];
+}
+
+int migrate_buffer_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_BUFFER_SIZE];
+}
+
+int migrate_block_inflight(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_BLOCK_INFLIGHT];
+}
+
 /* migration thread support */
 
 
+/* at most this many entries of the queue are written with one syscall */
+#define BUFFERED_FLUSH_IOV 64
+
+static uint64_t ram_side_bytes_transferred(void)
+{
+    return ram_channels_bytes_transferred() + ram_fixed_bytes_transferred();
+}
+
+/* Bytes sent in the current rate limit period, on all channels */
+static uint64_t migration_period_bytes(MigrationState *s)
+{
+    return s->bytes_xfer + ram_side_bytes_transferred() - s->side_bytes_start;
+}
+
 static ssize_t buffered_flush(MigrationState *s)
 {
-    size_t offset = 0;
+    struct iovec iov[BUFFERED_FLUSH_IOV];
+    size_t offset = 0, total = 0;
     ssize_t ret = 0;
+    int done = 0;
+
+    DPRINTF("flushing %zu byte(s) of data\n", s->queue_size);
+
+    while (migration_period_bytes(s) < s->xfer_limit &&
+           done < s->queue_cnt) {
+        size_t limit = s->xfer_limit - migration_period_bytes(s);
+        size_t pos = offset, len;
+        int i, n;
+
+        /* entries without a base are the next bytes of s->buffer */
+        for (n = 0, i = done; i < s->queue_cnt && n < BUFFERED_FLUSH_IOV &&
+             limit > 0; n++, i++) {
+            len = MIN(s->queue[i].iov_len, limit);
+            iov[n].iov_base = s->queue[i].iov_base ? s->queue[i].iov_base :
+                                                     s->buffer + pos;
+            iov[n].iov_len = len;
+            if (!s->queue[i].iov_base) {
+                pos += len;
+            }
+            limit -= len;
+        }
 
-    DPRINTF("flushing %zu byte(s) of data\n", s->buffer_size);
-
-    while (s->bytes_xfer < s->xfer_limit && offset < s->buffer_size) {
-        size_t to_send = MIN(s->buffer_size - offset, s->xfer_limit - s->bytes_xfer);
-        ret = migrate_fd_put_buffer(s, s->buffer + offset, to_send);
+        ret = migrate_fd_writev(s, iov, n);
         if (ret <= 0) {
             DPRINTF("error flushing data, %zd\n", ret);
             break;
-        } else {
-            DPRINTF("flushed %zd byte(s)\n", ret);
-            offset += ret;
-            s->bytes_xfer += ret;
+        }
+        DPRINTF("flushed %zd byte(s)\n", ret);
+        s->bytes_xfer += ret;
+        total += ret;
+
+        /* drop what was written from the queue */
+        while (ret > 0) {
+            struct iovec *e = &s->queue[done];
+
+            len = MIN(e->iov_len, ret);
+            if (e->iov_base) {
+                e->iov_base += len;
+            } else {
+                offset += len;
+            }
+            e->iov_len -= len;
+            ret -= len;
+            if (e->iov_len == 0) {
+                done++;
+            }
         }
     }
 
-    DPRINTF("flushed %zu of %zu byte(s)\n", offset, s->buffer_size);
+    DPRINTF("flushed %zu of %zu byte(s)\n", total, s->queue_size);
+    memmove(s->queue, s->queue + done,
+            (s->queue_cnt - done) * sizeof(s->queue[0]));
+    s->queue_cnt -= done;
+    s->queue_size -= total;
     memmove(s->buffer, s->buffer + offset, s->buffer_size - offset);
     s->buffer_size -= offset;
 
     if (ret < 0) {
         return ret;
     }
-    return offset;
+    return total;
+}
+
+static void buffered_queue(MigrationState *s, void *base, size_t len)
+{
+    struct iovec *last = s->queue_cnt ? &s->queue[s->queue_cnt - 1] : NULL;
+
+    if (len == 0) {
+        return;
+    }
+    s->queue_size += len;
+    if (last && !base && !last->iov_base) {
+        last->iov_len += len;
+        return;
+    }
+    if (s->queue_cnt == s->queue_capacity) {
+        s->queue_capacity = MAX(s->queue_capacity * 2, 64);
+        s->queue = g_realloc(s->queue,
+                             s->queue_capacity * sizeof(s->queue[0]));
+    }
+    s->queue[s->queue_cnt].iov_base = base;
+    s->queue[s->queue_cnt++].iov_len = len;
 }
 
-static int buffered_put_buffer(void *opaque, const uint8_t *buf,
-                               int64_t pos, int size)
+/*
+ * Data in the buffer of the QEMUFile is copied to s->buffer, while the
+ * pages of guest RAM queued with qemu_put_buffer_async() are only
+ * referenced, and sent from guest memory by buffered_flush().
+ */
+static ssize_t buffered_writev_buffer(void *opaque, struct iovec *iov,
+                                      int iovcnt, int64_t pos)
 {
     MigrationState *s = opaque;
-    ssize_t error;
+    ssize_t error, size = 0;
+    int i;
 
-    DPRINTF("putting %d bytes at %" PRId64 "\n", size, pos);
+    DPRINTF("putting %d entries at %" PRId64 "\n", iovcnt, pos);
 
     error = qemu_file_get_error(s->file);
     if (error) {
@@ -558,21 +959,28 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf,
         return error;
     }
 
-    if (size <= 0) {
-        return size;
-    }
+    for (i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len;
 
-    if (size > (s->buffer_capacity - s->buffer_size)) {
-        DPRINTF("increasing buffer capacity from %zu by %zu\n",
-                s->buffer_capacity, size + 1024);
+        size += len;
+        if (!qemu_file_owns_buffer(s->file, iov[i].iov_base)) {
+            buffered_queue(s, iov[i].iov_base, len);
+            continue;
+        }
 
-        s->buffer_capacity += size + 1024;
+        if (len > (s->buffer_capacity - s->buffer_size)) {
+            DPRINTF("increasing buffer capacity from %zu by %zu\n",
+                    s->buffer_capacity, len + 1024);
 
-        s->buffer = g_realloc(s->buffer, s->buffer_capacity);
-    }
+            s->buffer_capacity += len + 1024;
+
+            s->buffer = g_realloc(s->buffer, s->buffer_capacity);
+        }
 
-    memcpy(s->buffer + s->buffer_size, buf, size);
-    s->buffer_size += size;
+        memcpy(s->buffer + s->buffer_size, iov[i].iov_base, len);
+        s->buffer_size += len;
+        buffered_queue(s, NULL, len);
+    }
 
     return size;
 }
@@ -586,7 +994,7 @@ static int buffered_close(void *opaque)
     DPRINTF("closing\n");
 
     s->xfer_limit = INT_MAX;
-    while (!qemu_file_get_error(s->file) && s->buffer_size) {
+    while (!qemu_file_get_error(s->file) && s->queue_cnt) {
         ret = buffered_flush(s);
         if (ret < 0) {
             break;
@@ -624,7 +1032,7 @@ static int buffered_rate_limit(void *opaque)
         return ret;
     }
 
-    if (s->bytes_xfer >= s->xfer_limit) {
+    if (migration_period_bytes(s) >= s->xfer_limit) {
         return 1;
     }
 
@@ -657,11 +1065,19 @@ static int64_t buffered_get_rate_limit(void *opaque)
 static void *buffered_file_thread(void *opaque)
 {
     MigrationState *s = opaque;
-    int64_t initial_time = qemu_get_clock_ms(rt_clock);
+    int64_t initial_time;
     int64_t max_size = 0;
     bool last_round = false;
     int ret;
 
+    ret = ram_channels_connect(s);
+    if (ret < 0) {
+        goto out;
+    }
+
+    initial_time = qemu_get_clock_ms(rt_clock);
+    s->side_bytes_start = ram_side_bytes_transferred();
+
     qemu_mutex_lock_iothread();
     DPRINTF("beginning savevm\n");
     ret = qemu_savevm_state_begin(s->file, &s->params);
@@ -686,11 +1102,37 @@ static void *buffered_file_thread(void *opaque)
             qemu_mutex_unlock_iothread();
             break;
         }
-        if (s->bytes_xfer < s->xfer_limit) {
+        if (migration_period_bytes(s) < s->xfer_limit && s->postcopy) {
+            DPRINTF("postcopy iterate\n");
+            ret = ram_postcopy_iterate(s->file, s->fd);
+            if (ret < 0) {
+                qemu_mutex_unlock_iothread();
+                break;
+            } else if (ret > 0) {
+                migrate_fd_completed(s);
+                s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
+                last_round = true;
+            }
+        } else if (migration_period_bytes(s) < s->xfer_limit) {
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             DPRINTF("pending size %lu max %lu\n", pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (pending_size && pending_size >= max_size &&
+                s->start_postcopy) {
+                int64_t start_time = qemu_get_clock_ms(rt_clock);
+
+                DPRINTF("switching to postcopy\n");
+                qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+                vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+                ret = qemu_savevm_state_postcopy(s->file);
+                if (ret < 0) {
+                    qemu_mutex_unlock_iothread();
+                    break;
+                }
+                /* the guest now runs on the destination */
+                s->postcopy = true;
+                s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+            } else if (pending_size && pending_size >= max_size) {
                 ret = qemu_savevm_state_iterate(s->file);
                 if (ret < 0) {
                     qemu_mutex_unlock_iothread();
@@ -728,7 +1170,9 @@ static void *buffered_file_thread(void *opaque)
         }
         qemu_mutex_unlock_iothread();
         if (current_time >= initial_time + BUFFER_DELAY) {
-            uint64_t transferred_bytes = s->bytes_xfer;
+            /* pages sent on the extra RAM channels or written in place
+             * to a fixed-ram file count too */
+            uint64_t transferred_bytes = migration_period_bytes(s);
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = transferred_bytes / time_spent;
             max_size = bandwidth * migrate_max_downtime() / 1000000;
@@ -738,9 +1182,10 @@ static void *buffered_file_thread(void *opaque)
                     transferred_bytes, time_spent, bandwidth, max_size);
 
             s->bytes_xfer = 0;
+            s->side_bytes_start = ram_side_bytes_transferred();
             initial_time = current_time;
         }
-        if (!last_round && (s->bytes_xfer >= s->xfer_limit)) {
+        if (!last_round && migration_period_bytes(s) >= s->xfer_limit) {
             /* usleep expects microseconds */
             g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
         }
@@ -751,16 +1196,18 @@ static void *buffered_file_thread(void *opaque)
     }
 
 out:
+    ram_channels_disconnect();
     if (ret < 0) {
         migrate_fd_error(s);
     }
     g_free(s->buffer);
+    g_free(s->queue);
     return NULL;
 }
 
 static const QEMUFileOps buffered_file_ops = {
     .get_fd =         buffered_get_fd,
-    .put_buffer =     buffered_put_buffer,
+    .writev_buffer =  buffered_writev_buffer,
     .close =          buffered_close,
     .rate_limit =     buffered_rate_limit,
     .get_rate_limit = buffered_get_rate_limit,
@@ -774,11 +1221,16 @@ void migrate_fd_connect(MigrationState *s)
     s->buffer = NULL;
     s->buffer_size = 0;
     s->buffer_capacity = 0;
+    s->queue = NULL;
+    s->queue_cnt = 0;
+    s->queue_capacity = 0;
+    s->queue_size = 0;
 
     s->xfer_limit = s->bandwidth_limit / XFER_LIMIT_RATIO;
     s->complete = false;
 
     s->file = qemu_fopen_ops(s, &buffered_file_ops);
+    qemu_file_set_buffer_size(s->file, migrate_buffer_size());
 
     qemu_thread_create(&s->thread, buffered_file_thread, s,
                        QEMU_THREAD_DETACHED);
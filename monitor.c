@@ -2679,6 +2679,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration capabilities",
         .mhandler.cmd = hmp_info_migrate_capabilities,
     },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.cmd = hmp_info_migrate_parameters,
+    },
     {
         .name       = "migrate_cache_size",
         .args_type  = "",
@@ -2693,6 +2700,15 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show balloon information",
         .mhandler.cmd = hmp_info_balloon,
     },
+#if defined(CONFIG_HAVE_CORE_DUMP)
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the progress of the last guest memory dump",
+        .mhandler.cmd = hmp_info_dump,
+    },
+#endif
     {
         .name       = "qtree",
         .args_type  = "",
@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is base on a hash of the page address, each page can be
+ * stored in any of the CACHE_WAYS entries of its set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -34,6 +35,10 @@
     do { } while (0)
 #endif
 
+/* Number of entries a page can be stored in.  A page that maps to a set
+ * whose entries are all taken replaces the least recently used one. */
+#define CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -48,6 +53,8 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    int64_t num_sets;
+    int ways;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -72,8 +79,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " (%d ways)\n",
+            cache->max_num_items, cache->ways);
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
@@ -102,43 +112,69 @@ void cache_fini(PageCache *cache)
     cache->page_cache = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first entry of the set @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Returns the entry to store @addr in: the one already holding it, an
+ * empty one, or else the least recently used one of the set. */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    CacheItem *set, *victim;
+    int i;
+
+    set = cache_get_set(cache, addr);
+    victim = &set[0];
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr || !set[i].it_data) {
+            return &set[i];
+        }
+        if (set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
+    return victim;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    return &cache->page_cache[pos];
+    if (!it) {
+        return false;
+    }
+    it->it_age = ++cache->max_item_age;
+    return true;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
@@ -150,14 +186,13 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
     g_assert(cache->page_cache);
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    it = cache_get_victim(cache, addr);
 
     /* free old cached data if any */
-    g_free(it->it_data);
-
     if (!it->it_data) {
         cache->num_items++;
     }
+    g_free(it->it_data);
 
     it->it_data = pdata;
     it->it_age = ++cache->max_item_age;
@@ -194,20 +229,20 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
             if (new_it->it_data) {
                 /* keep the MRU page */
                 if (new_it->it_age >= old_it->it_age) {
                     g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
+                    continue;
                 }
+                g_free(new_it->it_data);
             } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
+                new_cache->num_items++;
             }
+            new_it->it_data = old_it->it_data;
+            new_it->it_age = old_it->it_age;
+            new_it->it_addr = old_it->it_addr;
         }
     }
 
@@ -215,6 +250,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->ways = new_cache->ways;
 
     g_free(new_cache);
 
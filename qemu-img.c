@@ -88,6 +88,11 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' specifies the number of coroutines that convert uses to keep\n"
+           "       several read and write requests in flight (default 8)\n"
+           "  '-W' allows convert to write out of order to the destination; this can\n"
+           "       improve performance, but the output is less likely to be laid out\n"
+           "       sequentially\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -662,25 +667,367 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 }
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
+#define MAX_COROUTINES 16
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_SKIP,
+};
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool compressed;
+    bool has_zero_init;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int chunk_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    int ret;
+
+    /* Next sector to hand out to a worker; protected by lock because
+     * finding the allocation status of a chunk may yield */
+    CoMutex lock;
+    int64_t sector_num;
+
+    /* With wr_in_order, a chunk may only be written once every chunk before
+     * it has been written; wr_offs is the first sector not written yet */
+    int64_t wr_offs;
+    QEMUBH *wr_bh;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the number of sectors of the next chunk starting at sector_num and
+ * stores its status in *status, or returns a negative errno value.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num,
+                                                  int *status)
+{
+    BlockDriverState *src;
+    int64_t src_cur_offset;
+    int src_cur, n, n1, ret;
+
+    n = MIN(s->total_sectors - sector_num, s->chunk_sectors);
+    *status = BLK_DATA;
+
+    if (s->compressed) {
+        /* Compressed clusters may span several source images */
+        return n;
+    }
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    src = s->src[src_cur];
+    n = MIN(n, src_cur_offset + s->src_sectors[src_cur] - sector_num);
+
+    /* Sectors that are unallocated in the input image need not be copied if
+     * the output starts out zeroed: they are either present in the output's
+     * base image as well, or they read as zeroes. */
+    if (s->has_zero_init && (s->target_has_backing || !src->backing_hd)) {
+        ret = bdrv_co_is_allocated(src, sector_num - src_cur_offset, n, &n1);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!ret) {
+            *status = BLK_SKIP;
+        }
+        n = n1;
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t src_cur_offset;
+    int src_cur, n, ret;
+
+    while (nb_sectors > 0) {
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                src_cur_offset + s->src_sectors[src_cur] - sector_num);
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         sector_num - src_cur_offset, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    bool allocated;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        if (!s->has_zero_init || s->target_has_backing) {
+            n = nb_sectors;
+            allocated = true;
+        } else {
+            allocated = is_allocated_sectors_min(buf, nb_sectors, &n,
+                                                 s->min_sparse);
+        }
+
+        if (allocated) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int coroutine_fn convert_co_write_compressed(ImgConvertState *s,
+                                                    int64_t sector_num,
+                                                    int nb_sectors,
+                                                    uint8_t *buf)
+{
+    int cluster_size = s->chunk_sectors * BDRV_SECTOR_SIZE;
+    int ret;
+
+    if (nb_sectors < s->chunk_sectors) {
+        memset(buf + nb_sectors * BDRV_SECTOR_SIZE, 0,
+               cluster_size - nb_sectors * BDRV_SECTOR_SIZE);
+    }
+    if (buffer_is_zero(buf, cluster_size)) {
+        return 0;
+    }
+
+    ret = bdrv_co_write_compressed(s->target, sector_num, buf,
+                                   s->chunk_sectors);
+    if (ret < 0) {
+        error_report("error while compressing sector %" PRId64
+                     ": %s", sector_num, strerror(-ret));
+        return ret;
+    }
+    return 0;
+}
+
+/* Wakes up the worker whose chunk may be written next, or all of them if the
+ * conversion has failed so that they can exit. */
+static void convert_wr_bh(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1 &&
+            (s->ret != -EINPROGRESS || s->wait_sector_num[i] == s->wr_offs)) {
+            s->wait_sector_num[i] = -1;
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static void convert_end_turn(ImgConvertState *s, int64_t next_sector_num)
+{
+    if (s->wr_in_order) {
+        s->wr_offs = next_sector_num;
+        qemu_bh_schedule(s->wr_bh);
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int i, index = -1;
+    int ret = 0;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    buf = qemu_blockalign(s->target, s->chunk_sectors * BDRV_SECTOR_SIZE);
+
+    while (s->ret == -EINPROGRESS) {
+        int64_t sector_num;
+        int n, status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        sector_num = s->sector_num;
+        n = convert_iteration_sectors(s, sector_num, &status);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num, strerror(-n));
+            ret = n;
+            break;
+        }
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in sector order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+
+        if (status == BLK_SKIP) {
+            convert_end_turn(s, sector_num + n);
+        } else if (s->compressed) {
+            /* The driver allocates compressed clusters in the order in which
+             * the writes are submitted, so the next chunk can go ahead as soon
+             * as this one has been handed to the driver. */
+            convert_end_turn(s, sector_num + n);
+            ret = convert_co_write_compressed(s, sector_num, n, buf);
+        } else {
+            ret = convert_co_write(s, sector_num, n, buf);
+            convert_end_turn(s, sector_num + n);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        qemu_progress_print((float)n * 100 / s->total_sectors, 100);
+    }
+
+    if (ret < 0 && s->ret == -EINPROGRESS) {
+        s->ret = ret;
+        /* let the workers that wait for their turn exit */
+        qemu_bh_schedule(s->wr_bh);
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i, ret;
+
+    s->ret = -EINPROGRESS;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    qemu_co_mutex_init(&s->lock);
+    s->wr_bh = qemu_bh_new(convert_wr_bh, s);
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->wait_sector_num[i] = -1;
+    }
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->running_coroutines++;
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    qemu_bh_delete(s->wr_bh);
+
+    if (s->ret != -EINPROGRESS) {
+        return s->ret;
+    }
+
+    if (s->compressed) {
+        /* signal EOF to align */
+        ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
 
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
+    uint64_t sectors;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -688,7 +1035,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -742,6 +1089,21 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -770,6 +1132,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -779,8 +1142,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &sectors);
+        bs_sectors[bs_i] = sectors;
+        total_sectors += sectors;
     }
 
     if (snapshot_name != NULL) {
@@ -846,7 +1210,7 @@ static int img_convert(int argc, char **argv)
         QEMUOptionParameter *preallocation =
             get_option_parameter(param, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -898,10 +1262,20 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .has_zero_init      = bdrv_has_zero_init(out_bs),
+        .target_has_backing = out_baseimg != NULL,
+        .wr_in_order        = wr_in_order,
+        .min_sparse         = min_sparse,
+        .chunk_sectors      = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+        .num_coroutines     = num_coroutines,
+    };
 
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -916,171 +1290,21 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
+        state.chunk_sectors = cluster_sectors;
 
-        nb_sectors = total_sectors;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
+        /* Synchronous compressed writes are not safe to run concurrently */
+        if (!drv->bdrv_co_write_compressed) {
+            state.num_coroutines = 1;
         }
+    }
 
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (!buffer_is_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
+    ret = convert_do_copy(&state);
 
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
-    }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
+    g_free(bs_sectors);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
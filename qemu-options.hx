@@ -34,6 +34,10 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                tcg_threads=single|multi runs all TCG vCPUs in one thread\n"
+    "                or each in its own thread (default: single)\n"
+    "                tcg_superblocks=n retranslates TBs run n times as\n"
+    "                superblocks (default: 0, disabled)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n",
     QEMU_ARCH_ALL)
@@ -52,6 +56,23 @@ to initialize.
 Enables in-kernel irqchip support for the chosen accelerator when available.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item tcg_threads=single|multi
+With @code{multi}, each TCG vCPU runs in its own host thread instead of
+all vCPUs sharing a single one.  This is only supported for x86 and ARM
+guests on Linux x86 hosts and cannot be combined with @option{-icount}.
+Guest atomic operations on RAM (x86 @code{XCHG} and locked
+@code{CMPXCHG}, @code{XADD}, @code{INC} and @code{DEC}, ARM @code{STREX})
+use host atomic instructions.  Other locked instructions, @code{STREXD},
+and atomic operations on MMIO or misaligned operands run while the other
+vCPUs are stopped, which makes them expensive in guests that use them
+heavily.  The default is @code{single}.
+@item tcg_superblocks=@var{n}
+Retranslate translated blocks that end in a direct jump forward within
+their page, once they have taken it @var{n} times, into larger
+superblocks that follow the jump, so that the optimizer can work across
+it.  Counting adds a small cost to such jumps until the block is
+promoted; other blocks are not counted.  This is only supported for x86
+guests.  The default is 0, which disables it.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -149,7 +170,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,readonly=on|off][,copy-on-read=on|off][,l2-cache-size=size]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
@@ -204,6 +225,10 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size}
+Maximum size of the L2 table cache of a qcow2 image.  Each L2 table maps
+one cluster's worth of entries; for the default 64k clusters, 1M of cache
+covers 8G of guest disk.  The default is 16 tables.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
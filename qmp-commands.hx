@@ -613,6 +613,10 @@ Notes:
 (2) All boolean arguments default to false
 (3) The user Monitor's "detach" argument is invalid in QMP and should not
     be used
+(4) A "file:<path>" URI saves the VM state to a file, which is restored
+    with -incoming "file:<path>".  With the "fixed-ram" capability the
+    RAM pages are stored at page aligned offsets of the file, and the
+    destination maps them into guest RAM instead of reading them
 
 EQMP
 
@@ -626,7 +630,9 @@ SQMP
 migrate_cancel
 --------------
 
-Cancel the current migration.
+Cancel the current migration.  A migration that has switched to
+post-copy cannot be cancelled, because the guest already runs on the
+destination and still needs RAM pages from the source.
 
 Arguments: None.
 
@@ -635,6 +641,27 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+{
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the current migration to post-copy.  Requires the "postcopy"
+capability.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 {
         .name       = "migrate-set-cache-size",
@@ -765,8 +792,8 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
-        .params     = "-p protocol [begin] [length]",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?,live:b?",
+        .params     = "-p protocol [begin] [length] [format] [live]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
         .mhandler.cmd_new = qmp_marshal_input_dump_guest_memory,
@@ -787,12 +814,24 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "format": "elf" (default), or "kdump-zlib", "kdump-lzo" or "kdump-snappy"
+            for the kdump-compressed format, which only crash can process.
+            The kdump formats need a seekable file and cannot be used with
+            paging, begin or length (json-string, optional)
+- "live": return at once and dump while the guest keeps running; the
+          progress is reported by query-dump. Needs a kdump format
+          (json-bool, optional)
 
 Example:
 
 -> { "execute": "dump-guest-memory", "arguments": { "protocol": "fd:dump" } }
 <- { "return": {} }
 
+-> { "execute": "dump-guest-memory",
+     "arguments": { "paging": false, "protocol": "file:/tmp/vmcore",
+                    "format": "kdump-lzo", "live": true } }
+<- { "return": {} }
+
 Notes:
 
 (1) All boolean arguments default to false
@@ -1765,6 +1804,10 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2_cache_hits": lookups served from the L2 table cache
+                       (json-int, optional)
+    - "l2_cache_misses": lookups that loaded an L2 table from the image file
+                         (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2428,7 +2471,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+                        "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
 		 time (json-int)
@@ -2437,6 +2481,9 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
 		the last bitmap round (json-int)
+- "cpu-throttle-percentage": only present while migration is active and the
+                auto-converge capability is on; percentage of time the
+                vCPUs are kept from running (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -2445,6 +2492,9 @@ The main json-object contains the following:
          - "duplicate": number of duplicated pages (json-int)
          - "normal" : number of normal pages transferred (json-int)
          - "normal-bytes" : number of normal bytes transferred (json-int)
+         - "dirty-sync-count": number of dirty bitmap syncs (json-int)
+         - "dirty-sync-time": duration of the last dirty bitmap sync, in
+                              microseconds (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -2456,7 +2506,12 @@ The main json-object contains the following:
          - "bytes": total XBZRLE bytes transferred
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of cache misses
+         - "cache-hit": number of cache hits
          - "overflow": number of XBZRLE overflows
+- "compression": only present if the compress capability is active.
+  It is a json-object with the following compression information:
+         - "pages": number of compressed pages transferred
+         - "bytes": total compressed bytes transferred
 Examples:
 
 1. Before the first migration
@@ -2552,6 +2607,7 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
+            "cache-hit":2442099,
             "overflow":34434
          }
       }
@@ -2572,6 +2628,14 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "compress": multi-threaded zlib compression of RAM pages
+- "postcopy": allow switching to post-copy with migrate-start-postcopy
+- "auto-converge": throttle the vCPUs if the guest dirties memory faster
+                   than it is sent
+- "fixed-ram": write RAM pages in place at fixed offsets of the file of a
+               "file:" migration
+- "zero-blocks": send zero and unallocated disk ranges of block migration
+                 as markers
 
 Arguments:
 
@@ -2612,6 +2676,102 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": set compression level during migration (json-int)
+- "compress-threads": set compression thread count for migration (json-int)
+- "decompress-threads": set decompression thread count for migration (json-int)
+- "channels": set the number of RAM connections for TCP migration (json-int)
+- "buffer-size": set the size of the migration stream buffer in bytes
+                 (json-int)
+- "block-inflight": set the number of disk reads in flight during block
+                    migration (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "compress-level": 1 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  =
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "channels:i?,buffer-size:i?,block-inflight:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "compress-level" : compression level value (json-int)
+         - "compress-threads" : compression thread count value (json-int)
+         - "decompress-threads" : decompression thread count value (json-int)
+         - "channels" : number of RAM connections (json-int)
+         - "buffer-size" : size of the migration stream buffer (json-int)
+         - "block-inflight" : number of disk reads in flight during block
+                              migration (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "decompress-threads": 2,
+         "compress-threads": 8,
+         "compress-level": 1,
+         "channels": 1,
+         "buffer-size": 32768,
+         "block-inflight": 16
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
+SQMP
+query-dump
+----------
+
+Show the progress of the last guest memory dump.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "completed": bytes of guest memory processed so far (json-int)
+- "total": bytes of guest memory to process (json-int)
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 536870912,
+                 "total": 1073741824 } }
+
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dump,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -39,6 +39,7 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qemu/bitops.h"
+#include "qemu/iov.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -113,6 +114,7 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -123,7 +125,13 @@ struct QEMUFile {
                            when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    int buf_capacity;
+    uint8_t *buf;
+
+    /* Data to write, in stream order: pieces of buf, and the buffers
+     * queued by reference with qemu_put_buffer_async() */
+    struct iovec iov[MAX_IOV_SIZE];
+    unsigned int iovcnt;
 
     int last_error;
 };
@@ -140,6 +148,13 @@ typedef struct QEMUFileSocket
     QEMUFile *file;
 } QEMUFileSocket;
 
+typedef struct QEMUFileBuffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+} QEMUFileBuffer;
+
 typedef struct {
     Coroutine *co;
     int fd;
@@ -391,6 +406,43 @@ fail:
     return NULL;
 }
 
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    s->data = g_realloc(s->data, s->size + size);
+    memcpy(s->data + s->size, buf, size);
+    s->size += size;
+    return size;
+}
+
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    size = MIN(size, s->size - s->pos);
+    memcpy(buf, s->data + s->pos, size);
+    s->pos += size;
+    return size;
+}
+
+static int buffer_close(void *opaque)
+{
+    return 0;
+}
+
+/* The data belongs to the QEMUFileBuffer, and outlives the QEMUFile */
+static const QEMUFileOps buffer_read_ops = {
+    .get_buffer = buffer_get_buffer,
+    .close =      buffer_close
+};
+
+static const QEMUFileOps buffer_write_ops = {
+    .put_buffer = buffer_put_buffer,
+    .close =      buffer_close
+};
+
 static int block_put_buffer(void *opaque, const uint8_t *buf,
                            int64_t pos, int size)
 {
@@ -434,6 +486,8 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
     f->opaque = opaque;
     f->ops = ops;
     f->is_write = 0;
+    f->buf_capacity = IO_BUF_SIZE;
+    f->buf = g_malloc(f->buf_capacity);
 
     return f;
 }
@@ -443,31 +497,97 @@ int qemu_file_get_error(QEMUFile *f)
     return f->last_error;
 }
 
-static void qemu_file_set_error(QEMUFile *f, int ret)
+void qemu_file_set_error(QEMUFile *f, int ret)
 {
     if (f->last_error == 0) {
         f->last_error = ret;
     }
 }
 
+bool qemu_file_owns_buffer(QEMUFile *f, const void *buf)
+{
+    const uint8_t *p = buf;
+
+    return p >= f->buf && p < f->buf + f->buf_capacity;
+}
+
 /** Flushes QEMUFile buffer
  *
  */
 static int qemu_fflush(QEMUFile *f)
 {
-    int ret = 0;
+    ssize_t ret = 0;
 
-    if (!f->ops->put_buffer)
+    if (!f->ops->put_buffer && !f->ops->writev_buffer)
         return 0;
 
-    if (f->is_write && f->buf_index > 0) {
-        ret = f->ops->put_buffer(f->opaque, f->buf, f->buf_offset, f->buf_index);
-        if (ret >= 0) {
-            f->buf_offset += f->buf_index;
+    if (f->is_write && f->iovcnt > 0) {
+        if (f->ops->writev_buffer) {
+            ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                        f->buf_offset);
+            if (ret >= 0) {
+                f->buf_offset += ret;
+            }
+        } else {
+            /* without writev_buffer, all the data was copied to buf */
+            ret = f->ops->put_buffer(f->opaque, f->buf, f->buf_offset,
+                                     f->buf_index);
+            if (ret >= 0) {
+                f->buf_offset += f->buf_index;
+            }
         }
         f->buf_index = 0;
+        f->iovcnt = 0;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt ? &f->iov[f->iovcnt - 1] : NULL;
+
+    /* merge with the previous entry if it is adjacent, unless only one of
+     * them lives in the buffer of f */
+    if (last && buf == (uint8_t *)last->iov_base + last->iov_len &&
+        qemu_file_owns_buffer(f, last->iov_base) ==
+        qemu_file_owns_buffer(f, buf)) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt++].iov_len = size;
     }
-    return ret;
+}
+
+static void qemu_file_check_flush(QEMUFile *f)
+{
+    if (f->buf_index >= f->buf_capacity || f->iovcnt >= MAX_IOV_SIZE) {
+        int ret = qemu_fflush(f);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+}
+
+void qemu_file_set_buffer_size(QEMUFile *f, int size)
+{
+    int pending;
+
+    assert(size > 0);
+    if (f->is_write) {
+        int ret = qemu_fflush(f);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    } else {
+        /* keep the data that was read but not consumed yet */
+        pending = f->buf_size - f->buf_index;
+        memmove(f->buf, f->buf + f->buf_index, pending);
+        f->buf_index = 0;
+        f->buf_size = pending;
+        size = MAX(size, pending);
+    }
+    f->buf_capacity = size;
+    f->buf = g_realloc(f->buf, f->buf_capacity);
 }
 
 static void qemu_fill_buffer(QEMUFile *f)
@@ -489,7 +609,7 @@ static void qemu_fill_buffer(QEMUFile *f)
     f->buf_size = pending;
 
     len = f->ops->get_buffer(f->opaque, f->buf + pending, f->buf_offset,
-                        IO_BUF_SIZE - pending);
+                        f->buf_capacity - pending);
     if (len > 0) {
         f->buf_size += len;
         f->buf_offset += len;
@@ -532,6 +652,7 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    g_free(f->buf);
     g_free(f);
     return ret;
 }
@@ -551,26 +672,29 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 
     while (size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
+        l = f->buf_capacity - f->buf_index;
         if (l > size)
             l = size;
         memcpy(f->buf + f->buf_index, buf, l);
         f->is_write = 1;
+        add_to_iovec(f, f->buf + f->buf_index, l);
         f->buf_index += l;
         buf += l;
         size -= l;
-        if (f->buf_index >= IO_BUF_SIZE) {
-            int ret = qemu_fflush(f);
-            if (ret < 0) {
-                qemu_file_set_error(f, ret);
-                break;
-            }
+        qemu_file_check_flush(f);
+        if (f->last_error) {
+            break;
         }
     }
 }
 
-void qemu_put_byte(QEMUFile *f, int v)
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
 {
+    if (!f->ops->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
     if (f->last_error) {
         return;
     }
@@ -581,14 +705,28 @@ void qemu_put_byte(QEMUFile *f, int v)
         abort();
     }
 
-    f->buf[f->buf_index++] = v;
     f->is_write = 1;
-    if (f->buf_index >= IO_BUF_SIZE) {
-        int ret = qemu_fflush(f);
-        if (ret < 0) {
-            qemu_file_set_error(f, ret);
-        }
+    add_to_iovec(f, buf, size);
+    qemu_file_check_flush(f);
+}
+
+void qemu_put_byte(QEMUFile *f, int v)
+{
+    if (f->last_error) {
+        return;
+    }
+
+    if (f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
     }
+
+    f->buf[f->buf_index] = v;
+    f->is_write = 1;
+    add_to_iovec(f, f->buf + f->buf_index, 1);
+    f->buf_index++;
+    qemu_file_check_flush(f);
 }
 
 static void qemu_file_skip(QEMUFile *f, int size)
@@ -677,7 +815,7 @@ int64_t qemu_ftell(QEMUFile *f)
 {
     /* buf_offset excludes buffer for writing but includes it for reading */
     if (f->is_write) {
-        return f->buf_offset + f->buf_index;
+        return f->buf_offset + iov_size(f->iov, f->iovcnt);
     } else {
         return f->buf_offset - f->buf_size + f->buf_index;
     }
@@ -1566,6 +1704,8 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_SECTION_POSTCOPY     0x06
+#define QEMU_VM_POSTCOPY_DEVICES     0x07
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1683,6 +1823,36 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
+static void qemu_savevm_state_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int len;
+
+        if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
+	    continue;
+        }
+        trace_savevm_section_start();
+        /* Section type */
+        qemu_put_byte(f, QEMU_VM_SECTION_FULL);
+        qemu_put_be32(f, se->section_id);
+
+        /* ID string */
+        len = strlen(se->idstr);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)se->idstr, len);
+
+        qemu_put_be32(f, se->instance_id);
+        qemu_put_be32(f, se->version_id);
+
+        vmstate_save(f, se);
+        trace_savevm_section_end(se->section_id);
+    }
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+}
+
 int qemu_savevm_state_complete(QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -1711,32 +1881,64 @@ int qemu_savevm_state_complete(QEMUFile *f)
         }
     }
 
-    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
-        int len;
+    qemu_savevm_state_devices(f);
 
-        if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
-	    continue;
-        }
-        trace_savevm_section_start();
-        /* Section type */
-        qemu_put_byte(f, QEMU_VM_SECTION_FULL);
-        qemu_put_be32(f, se->section_id);
+    return qemu_file_get_error(f);
+}
 
-        /* ID string */
-        len = strlen(se->idstr);
-        qemu_put_byte(f, len);
-        qemu_put_buffer(f, (uint8_t *)se->idstr, len);
+/*
+ * Switches to post-copy.  Live sections that support it send what the
+ * destination needs to run without the rest of their data, the others are
+ * completed.  The device state follows as a single blob, so that the
+ * destination can load it while the post-copy sections keep reading the
+ * stream.
+ */
+int qemu_savevm_state_postcopy(QEMUFile *f)
+{
+    QEMUFileBuffer devices = {};
+    QEMUFile *df;
+    SaveStateEntry *se;
+    int ret;
 
-        qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
+    cpu_synchronize_all_states();
 
-        vmstate_save(f, se);
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_live_complete) {
+            continue;
+        }
+        if (se->ops && se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+        trace_savevm_section_start();
+        if (se->ops->save_live_postcopy) {
+            qemu_put_byte(f, QEMU_VM_SECTION_POSTCOPY);
+            qemu_put_be32(f, se->section_id);
+            ret = se->ops->save_live_postcopy(f, se->opaque);
+        } else {
+            qemu_put_byte(f, QEMU_VM_SECTION_END);
+            qemu_put_be32(f, se->section_id);
+            ret = se->ops->save_live_complete(f, se->opaque);
+        }
         trace_savevm_section_end(se->section_id);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
-    qemu_put_byte(f, QEMU_VM_EOF);
+    df = qemu_fopen_ops(&devices, &buffer_write_ops);
+    qemu_savevm_state_devices(df);
+    ret = qemu_fclose(df);
+    if (ret == 0) {
+        qemu_put_byte(f, QEMU_VM_POSTCOPY_DEVICES);
+        qemu_put_be32(f, devices.size);
+        qemu_put_buffer(f, devices.data, devices.size);
+        ret = qemu_file_get_error(f);
+    }
+    g_free(devices.data);
 
-    return qemu_file_get_error(f);
+    return ret;
 }
 
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
@@ -1941,30 +2143,51 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntry_Head *loadvm_handlers);
+
+/*
+ * The device state arrives as a single blob.  Once it has been read, the
+ * rest of the stream belongs to the post-copy receiver, and the devices are
+ * loaded from the blob while guest RAM keeps arriving.
+ */
+static int qemu_loadvm_postcopy_devices(QEMUFile *f,
+                                        LoadStateEntry_Head *loadvm_handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+    QEMUFileBuffer devices = {};
+    QEMUFile *df;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
-        return -EINVAL;
+    devices.size = qemu_get_be32(f);
+    devices.data = g_malloc(devices.size);
+    qemu_get_buffer(f, devices.data, devices.size);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        g_free(devices.data);
+        return ret;
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
+    ram_postcopy_incoming_listen(f);
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    df = qemu_fopen_ops(&devices, &buffer_read_ops);
+    ret = qemu_loadvm_state_main(df, loadvm_handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(df);
     }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+    qemu_fclose(df);
+    g_free(devices.data);
+
+    return ret < 0 ? ret : 1;
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntry_Head *loadvm_handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -1987,16 +2210,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -2005,54 +2226,98 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(loadvm_handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
+        case QEMU_VM_SECTION_POSTCOPY:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            if (section_type == QEMU_VM_SECTION_POSTCOPY) {
+                if (!le->se->ops || !le->se->ops->load_postcopy) {
+                    fprintf(stderr, "savevm: section %d does not support "
+                            "post-copy\n", section_id);
+                    return -EINVAL;
+                }
+                ret = le->se->ops->load_postcopy(f, le->se->opaque);
+            } else {
+                ret = vmstate_load(f, le->se, le->version_id);
+            }
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_DEVICES:
+            return qemu_loadvm_postcopy_devices(f, loadvm_handlers);
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+/*
+ * Returns 1 if the migration switched to post-copy: the guest can run, and
+ * f now belongs to the thread that receives the rest of its RAM.
+ */
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateEntry_Head loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    LoadStateEntry *le, *new_le;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret >= 0) {
+        cpu_synchronize_all_post_init();
+    }
 
-out:
     QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
         QLIST_REMOVE(le, entry);
         g_free(le);
     }
 
+    migrate_decompress_threads_join();
+    migrate_channels_load_cleanup();
+
     if (ret == 0) {
         ret = qemu_file_get_error(f);
     }
@@ -2085,7 +2350,7 @@ static int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
 /*
  * Deletes snapshots of a given name in all opened images.
  */
-static int del_existing_snapshots(Monitor *mon, const char *name)
+static int del_existing_snapshots(const char *name)
 {
     BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *snapshot = &sn1;
@@ -2098,9 +2363,8 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
         {
             ret = bdrv_snapshot_delete(bs, name);
             if (ret < 0) {
-                monitor_printf(mon,
-                               "Error while deleting snapshot on '%s'\n",
-                               bdrv_get_device_name(bs));
+                error_report("Error while deleting snapshot on '%s'",
+                             bdrv_get_device_name(bs));
                 return -1;
             }
         }
@@ -2109,17 +2373,268 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+static void savevm_set_snapshot_time(QEMUSnapshotInfo *sn)
+{
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    sn->date_sec = tv.tv_sec;
+    sn->date_nsec = tv.tv_usec * 1000;
+    sn->vm_clock_nsec = qemu_get_clock_ns(vm_clock);
+}
+
+/*
+ * Creates the snapshots of all images; bs holds the VM state.
+ */
+static void savevm_create_snapshots(BlockDriverState *bs,
+                                    QEMUSnapshotInfo *sn,
+                                    uint64_t vm_state_size)
+{
+    BlockDriverState *bs1;
+    int ret;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                error_report("Error while creating snapshot on '%s'",
+                             bdrv_get_device_name(bs1));
+            }
+        }
+    }
+}
+
+/*
+ * Live snapshots
+ *
+ * The VM state is written with the same iterative steps as a migration,
+ * from a bottom half so that the guest and the main loop keep running
+ * in between.  The guest is only stopped once the remaining dirty state
+ * can be written within the maximum migration downtime, or after
+ * SAVEVM_LIVE_MAX_SYNCS passes over the dirty bitmap if the guest dirties
+ * memory faster than it can be written; the snapshots of the images are
+ * created at that point, so that they match the VM state.  Old snapshots
+ * of the same name are only replaced then, so a live snapshot that fails
+ * or is cancelled leaves them alone.
+ */
+#define SAVEVM_LIVE_MAX_SYNCS 30
+
+typedef struct SaveVMLiveState {
+    QEMUBH *bh;
+    QEMUFile *f;
+    /* image holding the VM state, NULL when writing to a file */
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    /* name of the snapshots to replace, or NULL */
+    char *name;
+    uint64_t max_size;
+    int64_t dirty_sync_start;
+    Error *blocker;
+} SaveVMLiveState;
+
+static SaveVMLiveState *savevm_live;
+
+static void savevm_live_finish(SaveVMLiveState *s, int ret)
+{
+    uint64_t vm_state_size;
+
+    if (ret == 0) {
+        ret = qemu_file_get_error(s->f);
+    }
+    if (ret < 0) {
+        qemu_savevm_state_cancel();
+    }
+    vm_state_size = qemu_ftell(s->f);
+    if (qemu_fclose(s->f) < 0 && ret == 0) {
+        ret = -EIO;
+    }
+
+    if (ret == -ECANCELED) {
+        error_report("Live snapshot cancelled");
+    } else if (ret < 0) {
+        error_report("Error %d while writing VM", ret);
+    } else if (s->bs && (!s->name || del_existing_snapshots(s->name) == 0)) {
+        savevm_set_snapshot_time(&s->sn);
+        savevm_create_snapshots(s->bs, &s->sn, vm_state_size);
+    }
+
+    /* auto-converge may have slowed down the vCPUs while writing RAM */
+    cpu_throttle_stop();
+    if (s->bs) {
+        bdrv_set_in_use(s->bs, 0);
+    }
+    migrate_del_blocker(s->blocker);
+    error_free(s->blocker);
+    qemu_bh_delete(s->bh);
+    savevm_live = NULL;
+    g_free(s->name);
+    g_free(s);
+}
+
+static void savevm_live_iterate(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    int64_t start_time = qemu_get_clock_ms(rt_clock);
+    int64_t start_pos = qemu_ftell(s->f);
+    uint64_t pending_size;
+    int saved_vm_running;
+    int ret;
+
+    pending_size = qemu_savevm_state_pending(s->f, s->max_size);
+    if (pending_size && pending_size >= s->max_size &&
+        migrate_get_current()->dirty_sync_count - s->dirty_sync_start <
+        SAVEVM_LIVE_MAX_SYNCS) {
+        int64_t time_spent;
+
+        ret = qemu_savevm_state_iterate(s->f);
+        if (ret < 0) {
+            savevm_live_finish(s, ret);
+            return;
+        }
+
+        /* bandwidth in bytes/ms, migrate_max_downtime() is in ns */
+        time_spent = MAX(qemu_get_clock_ms(rt_clock) - start_time, 1);
+        s->max_size = (qemu_ftell(s->f) - start_pos) / time_spent *
+                      migrate_max_downtime() / 1000000;
+        qemu_bh_schedule(s->bh);
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    if (saved_vm_running) {
+        vm_stop(RUN_STATE_SAVE_VM);
+    }
+    ret = qemu_savevm_state_complete(s->f);
+    savevm_live_finish(s, ret);
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+/*
+ * Starts writing the VM state to f in the background; takes ownership
+ * of f.  If bs is not NULL, the snapshots described by sn are created
+ * once the VM state is complete, replacing those called name if name
+ * is not NULL.
+ */
+static int savevm_live_start(QEMUFile *f, BlockDriverState *bs,
+                             QEMUSnapshotInfo *sn, const char *name)
+{
+    SaveVMLiveState *s;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    int ret;
+
+    if (qemu_savevm_state_blocked(NULL) ||
+        migration_is_active(migrate_get_current()) ||
+        (bs && bdrv_in_use(bs))) {
+        qemu_fclose(f);
+        return -EBUSY;
+    }
+
+    ret = qemu_savevm_state_begin(f, &params);
+    if (ret < 0) {
+        qemu_fclose(f);
+        return ret;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->f = f;
+    s->bs = bs;
+    if (sn) {
+        s->sn = *sn;
+    }
+    s->name = g_strdup(name);
+    s->dirty_sync_start = migrate_get_current()->dirty_sync_count;
+    /* the VM state is written to bs until the end, keep drive_del away */
+    if (bs) {
+        bdrv_set_in_use(bs, 1);
+    }
+    error_setg(&s->blocker, "A live snapshot is in progress");
+    migrate_add_blocker(s->blocker);
+    s->bh = qemu_bh_new(savevm_live_iterate, s);
+    savevm_live = s;
+    qemu_bh_schedule(s->bh);
+    return 0;
+}
+
+void do_savevm_cancel(Monitor *mon, const QDict *qdict)
+{
+    if (!savevm_live) {
+        monitor_printf(mon, "No live snapshot in progress\n");
+        return;
+    }
+    savevm_live_finish(savevm_live, -ECANCELED);
+}
+
+/*
+ * Writes the VM state, without snapshots of the images, to a file.
+ */
+static void do_savevm_file(Monitor *mon, const char *filename, bool live)
+{
+    QEMUFile *f;
+    int saved_vm_running;
+    int ret;
+
+    f = qemu_fopen(filename, "wb");
+    if (!f) {
+        monitor_printf(mon, "Could not open VM state file '%s'\n", filename);
+        return;
+    }
+
+    if (live) {
+        ret = savevm_live_start(f, NULL, NULL, NULL);
+        if (ret < 0) {
+            monitor_printf(mon, "Error %d while starting live snapshot\n", ret);
+        }
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+    ret = qemu_savevm_state(f);
+    if (qemu_fclose(f) < 0 && ret == 0) {
+        ret = -EIO;
+    }
+    if (ret < 0) {
+        monitor_printf(mon, "Error %d while writing VM\n", ret);
+    }
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
-    BlockDriverState *bs, *bs1;
+    BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
     int ret;
     QEMUFile *f;
     int saved_vm_running;
     uint64_t vm_state_size;
-    qemu_timeval tv;
     struct tm tm;
     const char *name = qdict_get_try_str(qdict, "name");
+    bool live = qdict_get_try_bool(qdict, "live", 0);
+    bool to_file = qdict_get_try_bool(qdict, "file", 0);
+
+    if (savevm_live) {
+        monitor_printf(mon, "A live snapshot is already in progress\n");
+        return;
+    }
+
+    if (to_file) {
+        if (!name) {
+            monitor_printf(mon, "A file name is required with -f\n");
+            return;
+        }
+        do_savevm_file(mon, name, live);
+        return;
+    }
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -2143,15 +2658,14 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
     saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+    if (!live) {
+        vm_stop(RUN_STATE_SAVE_VM);
+    }
 
     memset(sn, 0, sizeof(*sn));
 
     /* fill auxiliary fields */
-    qemu_gettimeofday(&tv);
-    sn->date_sec = tv.tv_sec;
-    sn->date_nsec = tv.tv_usec * 1000;
-    sn->vm_clock_nsec = qemu_get_clock_ns(vm_clock);
+    savevm_set_snapshot_time(sn);
 
     if (name) {
         ret = bdrv_snapshot_find(bs, old_sn, name);
@@ -2162,13 +2676,15 @@ void do_savevm(Monitor *mon, const QDict *qdict)
             pstrcpy(sn->name, sizeof(sn->name), name);
         }
     } else {
-        /* cast below needed for OpenBSD where tv_sec is still 'long' */
-        localtime_r((const time_t *)&tv.tv_sec, &tm);
+        time_t date = sn->date_sec;
+
+        localtime_r(&date, &tm);
         strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
     }
 
-    /* Delete old snapshots of the same name */
-    if (name && del_existing_snapshots(mon, name) < 0) {
+    /* Delete old snapshots of the same name; a live snapshot does so
+     * once its VM state is complete */
+    if (!live && name && del_existing_snapshots(name) < 0) {
         goto the_end;
     }
 
@@ -2178,6 +2694,13 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "Could not open VM state file\n");
         goto the_end;
     }
+    if (live) {
+        ret = savevm_live_start(f, bs, sn, name);
+        if (ret < 0) {
+            monitor_printf(mon, "Error %d while starting live snapshot\n", ret);
+        }
+        return;
+    }
     ret = qemu_savevm_state(f);
     vm_state_size = qemu_ftell(f);
     qemu_fclose(f);
@@ -2187,19 +2710,7 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running)
@@ -2238,6 +2749,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (savevm_live) {
+        error_report("A live snapshot is in progress");
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2349,6 +2865,12 @@ void do_info_snapshots(Monitor *mon, const QDict *qdict)
     int *available_snapshots;
     char buf[256];
 
+    if (savevm_live) {
+        monitor_printf(mon, "Live snapshot in progress, %" PRId64
+                       " bytes of VM state written\n",
+                       qemu_ftell(savevm_live->f));
+    }
+
     bs = bdrv_snapshots();
     if (!bs) {
         monitor_printf(mon, "No available block device supports snapshots\n");
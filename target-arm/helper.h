@@ -463,4 +463,6 @@ DEF_HELPER_3(neon_qzip8, void, env, i32, i32)
 DEF_HELPER_3(neon_qzip16, void, env, i32, i32)
 DEF_HELPER_3(neon_qzip32, void, env, i32, i32)
 
+DEF_HELPER_5(atomic_cmpxchg, i32, env, i32, i32, i32, i32)
+
 #include "exec/def-helper.h"
@@ -87,6 +87,35 @@ void tlb_fill(CPUARMState *env, target_ulong addr, int is_write, int mmu_idx,
 }
 #endif
 
+/* Store exclusive with one thread per vCPU: a host compare and swap of
+   the byte, halfword or word at addr, idx being size | (mmu_idx << 2).
+   If addr is not plain RAM, the instruction is run again while the other
+   vCPUs are stopped; the translator has synced the PC for that.  */
+uint32_t HELPER(atomic_cmpxchg)(CPUARMState *env, uint32_t addr,
+                                uint32_t cmpv, uint32_t newv, uint32_t idx)
+{
+    void *host;
+
+#ifdef CONFIG_USER_ONLY
+    host = g2h(addr);
+#else
+    host = tlb_vaddr_to_host_rw(env, addr, 1 << (idx & 3), idx >> 2);
+#endif
+    if (!host) {
+        raise_exception(env, EXCP_ATOMIC);
+    }
+    /* the guest is little endian, and so are the hosts multi-threaded
+       TCG supports */
+    switch (idx & 3) {
+    case 0:
+        return __sync_val_compare_and_swap((uint8_t *)host, cmpv, newv);
+    case 1:
+        return __sync_val_compare_and_swap((uint16_t *)host, cmpv, newv);
+    default:
+        return __sync_val_compare_and_swap((uint32_t *)host, cmpv, newv);
+    }
+}
+
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
 {
     uint32_t res = a + b;
@@ -6443,8 +6443,10 @@ static void gen_logicq_cc(TCGv_i64 val)
    regular stores.
 
    In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   this sequence is effectively atomic.  If each vCPU has its own thread,
+   the store is executed again on its own while the other vCPUs are
+   stopped (see CF_EXCLUSIVE).  In user emulation mode we throw an
+   exception and handle the atomic operation elsewhere.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv addr, int size)
 {
@@ -6492,6 +6494,40 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     gen_exception_insn(s, 4, EXCP_STREX);
 }
 #else
+/* With one thread per vCPU, the store is a host compare and swap against
+   the value seen by the load exclusive.  The helper leaves for the
+   exclusive step if [addr] is not plain RAM, and so does a doubleword
+   store, so the PC is synced first.  */
+static void gen_store_exclusive_atomic(DisasContext *s, int rd, int rt,
+                                       TCGv addr, int size)
+{
+    TCGv tmp;
+    TCGv_i32 idx;
+    int done_label;
+    int fail_label;
+
+    if (size == 3) {
+        gen_exception_insn(s, 4, EXCP_ATOMIC);
+        return;
+    }
+    fail_label = gen_new_label();
+    done_label = gen_new_label();
+    tcg_gen_brcond_i32(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
+    gen_set_condexec(s);
+    gen_set_pc_im(s->pc - 4);
+    tmp = load_reg(s, rt);
+    idx = tcg_const_i32(size | (IS_USER(s) << 2));
+    gen_helper_atomic_cmpxchg(tmp, cpu_env, addr, cpu_exclusive_val, tmp, idx);
+    tcg_temp_free_i32(idx);
+    tcg_gen_setcond_i32(TCG_COND_NE, cpu_R[rd], tmp, cpu_exclusive_val);
+    tcg_temp_free_i32(tmp);
+    tcg_gen_br(done_label);
+    gen_set_label(fail_label);
+    tcg_gen_movi_i32(cpu_R[rd], 1);
+    gen_set_label(done_label);
+    tcg_gen_movi_i32(cpu_exclusive_addr, -1);
+}
+
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv addr, int size)
 {
@@ -6505,6 +6541,10 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
        } else {
          {Rd} = 1;
        } */
+    if (mttcg_enabled && !(s->tb->cflags & CF_EXCLUSIVE)) {
+        gen_store_exclusive_atomic(s, rd, rt, addr, size);
+        return;
+    }
     fail_label = gen_new_label();
     done_label = gen_new_label();
     tcg_gen_brcond_i32(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
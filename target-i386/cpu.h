@@ -36,10 +36,18 @@
 
 #define TARGET_HAS_ICE 1
 
+/* LOCK-prefixed instructions run while the other vCPU threads are stopped */
+#define TARGET_SUPPORTS_MTTCG 1
+
+/* hot TBs can be retranslated as superblocks */
+#define TARGET_SUPPORTS_SUPERBLOCKS 1
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE	EM_X86_64
+#define ELF_MACHINE_UNAME "X86_64"
 #else
 #define ELF_MACHINE	EM_386
+#define ELF_MACHINE_UNAME "i686"
 #endif
 
 #define CPUArchState struct CPUX86State
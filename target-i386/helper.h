@@ -5,6 +5,9 @@ DEF_HELPER_FLAGS_2(cc_compute_c, TCG_CALL_NO_SE, i32, env, int)
 
 DEF_HELPER_0(lock, void)
 DEF_HELPER_0(unlock, void)
+DEF_HELPER_4(atomic_xchg, tl, env, tl, tl, int)
+DEF_HELPER_4(atomic_xadd, tl, env, tl, tl, int)
+DEF_HELPER_5(atomic_cmpxchg, tl, env, tl, tl, tl, int)
 DEF_HELPER_3(write_eflags, void, env, tl, i32)
 DEF_HELPER_1(read_eflags, tl, env)
 DEF_HELPER_2(divb_AL, void, env, tl)
@@ -62,6 +65,7 @@ DEF_HELPER_2(hlt, void, env, int)
 DEF_HELPER_2(monitor, void, env, tl)
 DEF_HELPER_2(mwait, void, env, int)
 DEF_HELPER_1(debug, void, env)
+DEF_HELPER_1(exit_atomic, void, env)
 DEF_HELPER_1(reset_rf, void, env)
 DEF_HELPER_3(raise_interrupt, void, env, int, int)
 DEF_HELPER_2(raise_exception, void, env, int)
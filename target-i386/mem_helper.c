@@ -38,6 +38,82 @@ void helper_unlock(void)
     spin_unlock(&global_cpu_lock);
 }
 
+/* With one thread per vCPU, locked read-modify-write instructions on RAM
+   use host atomic instructions.  idx is the operand size plus mem_index,
+   as in translate.c.  Operands that are not plain RAM leave for the
+   exclusive step, which runs the instruction again while the other vCPUs
+   are stopped; the translator has saved eip and cc_op for that.  The
+   guest is little endian, and so are the hosts multi-threaded TCG
+   supports.  */
+static void *atomic_host_addr(CPUX86State *env, target_ulong addr, int idx)
+{
+    void *host;
+
+#ifdef CONFIG_USER_ONLY
+    host = g2h(addr);
+#else
+    host = tlb_vaddr_to_host_rw(env, addr, 1 << (idx & 3), (idx >> 2) - 1);
+#endif
+    if (!host) {
+        env->exception_index = EXCP_ATOMIC;
+        cpu_loop_exit(env);
+    }
+    return host;
+}
+
+target_ulong helper_atomic_xchg(CPUX86State *env, target_ulong addr,
+                                target_ulong val, int idx)
+{
+    void *host = atomic_host_addr(env, addr, idx);
+
+    /* a full barrier on x86 hosts */
+    switch (idx & 3) {
+    case 0:
+        return __sync_lock_test_and_set((uint8_t *)host, val);
+    case 1:
+        return __sync_lock_test_and_set((uint16_t *)host, val);
+    case 2:
+        return __sync_lock_test_and_set((uint32_t *)host, val);
+    default:
+        return __sync_lock_test_and_set((uint64_t *)host, val);
+    }
+}
+
+target_ulong helper_atomic_xadd(CPUX86State *env, target_ulong addr,
+                                target_ulong val, int idx)
+{
+    void *host = atomic_host_addr(env, addr, idx);
+
+    switch (idx & 3) {
+    case 0:
+        return __sync_fetch_and_add((uint8_t *)host, val);
+    case 1:
+        return __sync_fetch_and_add((uint16_t *)host, val);
+    case 2:
+        return __sync_fetch_and_add((uint32_t *)host, val);
+    default:
+        return __sync_fetch_and_add((uint64_t *)host, val);
+    }
+}
+
+target_ulong helper_atomic_cmpxchg(CPUX86State *env, target_ulong addr,
+                                   target_ulong cmpv, target_ulong newv,
+                                   int idx)
+{
+    void *host = atomic_host_addr(env, addr, idx);
+
+    switch (idx & 3) {
+    case 0:
+        return __sync_val_compare_and_swap((uint8_t *)host, cmpv, newv);
+    case 1:
+        return __sync_val_compare_and_swap((uint16_t *)host, cmpv, newv);
+    case 2:
+        return __sync_val_compare_and_swap((uint32_t *)host, cmpv, newv);
+    default:
+        return __sync_val_compare_and_swap((uint64_t *)host, cmpv, newv);
+    }
+}
+
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
     uint64_t d;
@@ -23,8 +23,31 @@
 
 #if !defined(CONFIG_USER_ONLY)
 #include "exec/softmmu_exec.h"
+#include "qemu/main-loop.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
 
+/* Devices reached from helpers need the global mutex, which multi-threaded
+   TCG does not hold while running translated code.  */
+static inline bool device_access_begin(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+#endif
+    return false;
+}
+
+static inline void device_access_end(bool locked)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+}
+
 /* check if Port I/O is allowed in TSS */
 static inline void check_io(CPUX86State *env, int addr, int size)
 {
@@ -69,32 +92,56 @@ void helper_check_iol(CPUX86State *env, uint32_t t0)
 
 void helper_outb(uint32_t port, uint32_t data)
 {
+    bool locked = device_access_begin();
+
     cpu_outb(port, data & 0xff);
+    device_access_end(locked);
 }
 
 target_ulong helper_inb(uint32_t port)
 {
-    return cpu_inb(port);
+    bool locked = device_access_begin();
+    target_ulong val;
+
+    val = cpu_inb(port);
+    device_access_end(locked);
+    return val;
 }
 
 void helper_outw(uint32_t port, uint32_t data)
 {
+    bool locked = device_access_begin();
+
     cpu_outw(port, data & 0xffff);
+    device_access_end(locked);
 }
 
 target_ulong helper_inw(uint32_t port)
 {
-    return cpu_inw(port);
+    bool locked = device_access_begin();
+    target_ulong val;
+
+    val = cpu_inw(port);
+    device_access_end(locked);
+    return val;
 }
 
 void helper_outl(uint32_t port, uint32_t data)
 {
+    bool locked = device_access_begin();
+
     cpu_outl(port, data);
+    device_access_end(locked);
 }
 
 target_ulong helper_inl(uint32_t port)
 {
-    return cpu_inl(port);
+    bool locked = device_access_begin();
+    target_ulong val;
+
+    val = cpu_inl(port);
+    device_access_end(locked);
+    return val;
 }
 
 void helper_into(CPUX86State *env, int next_eip_addend)
@@ -154,7 +201,10 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = device_access_begin();
+
             val = cpu_get_apic_tpr(env->apic_state);
+            device_access_end(locked);
         } else {
             val = env->v_tpr;
         }
@@ -178,7 +228,10 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = device_access_begin();
+
             cpu_set_apic_tpr(env->apic_state, t0);
+            device_access_end(locked);
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -284,7 +337,12 @@ void helper_wrmsr(CPUX86State *env)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
-        cpu_set_apic_base(env->apic_state, val);
+        {
+            bool locked = device_access_begin();
+
+            cpu_set_apic_base(env->apic_state, val);
+            device_access_end(locked);
+        }
         break;
     case MSR_EFER:
         {
@@ -429,7 +487,12 @@ void helper_rdmsr(CPUX86State *env)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
-        val = cpu_get_apic_base(env->apic_state);
+        {
+            bool locked = device_access_begin();
+
+            val = cpu_get_apic_base(env->apic_state);
+            device_access_end(locked);
+        }
         break;
     case MSR_EFER:
         val = env->efer;
@@ -603,3 +666,9 @@ void helper_debug(CPUX86State *env)
     env->exception_index = EXCP_DEBUG;
     cpu_loop_exit(env);
 }
+
+void helper_exit_atomic(CPUX86State *env)
+{
+    env->exception_index = EXCP_ATOMIC;
+    cpu_loop_exit(env);
+}
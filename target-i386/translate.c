@@ -98,6 +98,7 @@ typedef struct DisasContext {
     int tf;     /* TF cpu flag */
     int singlestep_enabled; /* "hardware" single step enabled */
     int jmp_opt; /* use direct block chaining for direct jumps */
+    int atomic_rmw; /* locked memory operands use host atomics */
     int mem_index; /* select memory access functions */
     uint64_t flags; /* all execution flags */
     struct TranslationBlock *tb;
@@ -1423,13 +1424,39 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
     }
 }
 
+/* T1 = [A0]; [A0] = T0 */
+static void gen_atomic_xchg_T1_A0(DisasContext *s, int ot)
+{
+    TCGv_i32 idx = tcg_const_i32(ot + s->mem_index);
+
+    gen_helper_atomic_xchg(cpu_T[1], cpu_env, cpu_A0, cpu_T[0], idx);
+    tcg_temp_free_i32(idx);
+}
+
+/* ret = [A0]; [A0] += val */
+static void gen_atomic_xadd_A0(DisasContext *s, int ot, TCGv ret, TCGv val)
+{
+    TCGv_i32 idx = tcg_const_i32(ot + s->mem_index);
+
+    gen_helper_atomic_xadd(ret, cpu_env, cpu_A0, val, idx);
+    tcg_temp_free_i32(idx);
+}
+
 /* if d == OR_TMP0, it means memory operand (address in A0) */
 static void gen_inc(DisasContext *s1, int ot, int d, int c)
 {
-    if (d != OR_TMP0)
+    bool atomic = d == OR_TMP0 && s1->atomic_rmw &&
+                  (s1->prefix & PREFIX_LOCK);
+
+    if (d != OR_TMP0) {
         gen_op_mov_TN_reg(ot, 0, d);
-    else
+    } else if (atomic) {
+        /* T0 = old value, the memory operand is updated here already */
+        tcg_gen_movi_tl(cpu_T[0], c > 0 ? 1 : -1);
+        gen_atomic_xadd_A0(s1, ot, cpu_T[0], cpu_T[0]);
+    } else {
         gen_op_ld_T0_A0(ot + s1->mem_index);
+    }
     if (s1->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s1->cc_op);
     if (c > 0) {
@@ -1441,7 +1468,7 @@ static void gen_inc(DisasContext *s1, int ot, int d, int c)
     }
     if (d != OR_TMP0)
         gen_op_mov_reg_T0(ot, d);
-    else
+    else if (!atomic)
         gen_op_st_T0_A0(ot + s1->mem_index);
     gen_compute_eflags_c(cpu_cc_src);
     tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
@@ -2749,6 +2776,52 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+/* With one thread per vCPU, atomic instructions without a host atomic
+   helper are run again on their own while the other vCPUs are stopped;
+   see CF_EXCLUSIVE.  */
+static void gen_exit_atomic(DisasContext *s, target_ulong cur_eip)
+{
+    if (s->cc_op != CC_OP_DYNAMIC)
+        gen_op_set_cc_op(s->cc_op);
+    gen_jmp_im(cur_eip);
+    gen_helper_exit_atomic(cpu_env);
+    s->is_jmp = DISAS_TB_JUMP;
+}
+
+/* Locked instructions with a host atomic helper: xchg, and xadd,
+   cmpxchg, inc and dec with a memory operand.  b is the first opcode
+   byte, s->pc points after it.  */
+static bool lock_has_atomic_helper(CPUX86State *env, DisasContext *s, int b)
+{
+    int modrm;
+
+    switch (b) {
+    case 0x86:
+    case 0x87:
+        return true;
+    case 0xfe:
+    case 0xff:
+        modrm = cpu_ldub_code(env, s->pc);
+        return ((modrm >> 6) & 3) != 3 && ((modrm >> 3) & 7) <= 1;
+    case 0x0f:
+        b = cpu_ldub_code(env, s->pc);
+        return b == 0xb0 || b == 0xb1 || b == 0xc0 || b == 0xc1;
+    default:
+        return false;
+    }
+}
+
+/* The atomic helpers leave for the exclusive step if the operand is not
+   plain RAM, so eip and cc_op must be those of the start of the insn.  */
+static void gen_atomic_start(DisasContext *s, target_ulong cur_eip)
+{
+    if (s->cc_op != CC_OP_DYNAMIC) {
+        gen_op_set_cc_op(s->cc_op);
+        s->cc_op = CC_OP_DYNAMIC;
+    }
+    gen_jmp_im(cur_eip);
+}
+
 /* generate a generic end of block. Trace exception is also generated
    if needed */
 static void gen_eob(DisasContext *s)
@@ -2790,6 +2863,28 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* generate a direct jump to eip.  In a superblock, a jump forward in the
+   page of the TB does not end the block: translation continues at the
+   target, so that the optimizer and the register allocator see the code
+   on both sides of the jump.  Only first tier TBs that end in such a jump
+   count their executions, the others would not change when promoted.  */
+static void gen_jmp_direct(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    if (s->jmp_opt && pc >= s->pc &&
+        (pc & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK)) {
+        if (s->tb->cflags & CF_SUPERBLOCK) {
+            s->pc = pc;
+            return;
+        }
+        gen_update_cc_op(s);
+        gen_jmp_im(eip);
+        gen_tb_hot_count(s->tb);
+    }
+    gen_jmp(s, eip);
+}
+
 static inline void gen_ldq_env_A0(int idx, int offset)
 {
     int mem_index = (idx >> 2) - 1;
@@ -4330,8 +4425,16 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     s->dflag = dflag;
 
     /* lock generation */
-    if (prefixes & PREFIX_LOCK)
-        gen_helper_lock();
+    if (prefixes & PREFIX_LOCK) {
+        if (!s->atomic_rmw) {
+            gen_helper_lock();
+        } else if (lock_has_atomic_helper(env, s, b)) {
+            gen_atomic_start(s, pc_start - s->cs_base);
+        } else {
+            gen_exit_atomic(s, pc_start - s->cs_base);
+            return s->pc;
+        }
+    }
 
     /* now check op code */
  reswitch:
@@ -4958,9 +5061,14 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else {
             gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
             gen_op_mov_TN_reg(ot, 0, reg);
-            gen_op_ld_T1_A0(ot + s->mem_index);
-            gen_op_addl_T0_T1();
-            gen_op_st_T0_A0(ot + s->mem_index);
+            if (s->atomic_rmw && (prefixes & PREFIX_LOCK)) {
+                gen_atomic_xadd_A0(s, ot, cpu_T[1], cpu_T[0]);
+                gen_op_addl_T0_T1();
+            } else {
+                gen_op_ld_T1_A0(ot + s->mem_index);
+                gen_op_addl_T0_T1();
+                gen_op_st_T0_A0(ot + s->mem_index);
+            }
             gen_op_mov_reg_T1(ot, reg);
         }
         gen_op_update2_cc();
@@ -4990,7 +5098,17 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             } else {
                 gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
                 tcg_gen_mov_tl(a0, cpu_A0);
-                gen_op_ld_v(ot + s->mem_index, t0, a0);
+                if (s->atomic_rmw && (prefixes & PREFIX_LOCK)) {
+                    /* t0 = [a0]; [a0] = t1 if t0 == accumulator */
+                    TCGv_i32 idx = tcg_const_i32(ot + s->mem_index);
+
+                    tcg_gen_mov_tl(t2, cpu_regs[R_EAX]);
+                    gen_extu(ot, t2);
+                    gen_helper_atomic_cmpxchg(t0, cpu_env, a0, t2, t1, idx);
+                    tcg_temp_free_i32(idx);
+                } else {
+                    gen_op_ld_v(ot + s->mem_index, t0, a0);
+                }
                 rm = 0; /* avoid warning */
             }
             label1 = gen_new_label();
@@ -5003,6 +5121,11 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 tcg_gen_br(label2);
                 gen_set_label(label1);
                 gen_op_mov_reg_v(ot, rm, t1);
+            } else if (s->atomic_rmw && (prefixes & PREFIX_LOCK)) {
+                /* the helper has stored t1 already if it matched */
+                gen_op_mov_reg_v(ot, R_EAX, t0);
+                tcg_gen_br(label2);
+                gen_set_label(label1);
             } else {
                 /* perform no-op store cycle like physical cpu; must be
                    before changing accumulator to ensure idempotency if
@@ -5441,13 +5564,21 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else {
             gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
             gen_op_mov_TN_reg(ot, 0, reg);
-            /* for xchg, lock is implicit */
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_lock();
-            gen_op_ld_T1_A0(ot + s->mem_index);
-            gen_op_st_T0_A0(ot + s->mem_index);
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_unlock();
+            if (s->atomic_rmw) {
+                /* for xchg, lock is implicit */
+                if (!(prefixes & PREFIX_LOCK)) {
+                    gen_atomic_start(s, pc_start - s->cs_base);
+                }
+                gen_atomic_xchg_T1_A0(s, ot);
+            } else {
+                /* for xchg, lock is implicit */
+                if (!(prefixes & PREFIX_LOCK))
+                    gen_helper_lock();
+                gen_op_ld_T1_A0(ot + s->mem_index);
+                gen_op_st_T0_A0(ot + s->mem_index);
+                if (!(prefixes & PREFIX_LOCK))
+                    gen_helper_unlock();
+            }
             gen_op_mov_reg_T1(ot, reg);
         }
         break;
@@ -6386,7 +6517,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 tval &= 0xffffffff;
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
-            gen_jmp(s, tval);
+            gen_jmp_direct(s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6413,7 +6544,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffff;
         else if(!CODE64(s))
             tval &= 0xffffffff;
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6434,7 +6565,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         tval += s->pc - s->cs_base;
         if (s->dflag == 0)
             tval &= 0xffff;
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, OT_BYTE);
@@ -7804,11 +7935,11 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         goto illegal_op;
     }
     /* lock generation */
-    if (s->prefix & PREFIX_LOCK)
+    if ((s->prefix & PREFIX_LOCK) && !s->atomic_rmw)
         gen_helper_unlock();
     return s->pc;
  illegal_op:
-    if (s->prefix & PREFIX_LOCK)
+    if ((s->prefix & PREFIX_LOCK) && !s->atomic_rmw)
         gen_helper_unlock();
     /* XXX: ensure that no lock was generated */
     gen_exception(s, EXCP06_ILLOP, pc_start - s->cs_base);
@@ -7920,6 +8051,7 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
     dc->cc_op = CC_OP_DYNAMIC;
     dc->cs_base = cs_base;
     dc->tb = tb;
+    dc->atomic_rmw = mttcg_enabled && !(tb->cflags & CF_EXCLUSIVE);
     dc->popl_esp_hack = 0;
     /* select memory access functions */
     dc->mem_index = 0;
@@ -28,6 +28,7 @@
 
 #include "qemu/compiler.h"
 #include "qemu/osdep.h"
+#include "qapi/qmp/qjson.h"
 
 #define MAX_IRQ 256
 
@@ -102,8 +103,14 @@ static pid_t qtest_qemu_pid(QTestState *s)
     return pid;
 }
 
+pid_t qtest_get_pid(QTestState *s)
+{
+    return qtest_qemu_pid(s);
+}
+
 QTestState *qtest_init(const char *extra_args)
 {
+    static int instance;
     QTestState *s;
     int sock, qmpsock, ret, i;
     gchar *pid_file;
@@ -116,9 +123,13 @@ QTestState *qtest_init(const char *extra_args)
 
     s = g_malloc(sizeof(*s));
 
-    s->socket_path = g_strdup_printf("/tmp/qtest-%d.sock", getpid());
-    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d.qmp", getpid());
-    pid_file = g_strdup_printf("/tmp/qtest-%d.pid", getpid());
+    /* a test may run more than one QEMU, e.g. to migrate between them */
+    s->socket_path = g_strdup_printf("/tmp/qtest-%d-%d.sock", getpid(),
+                                     instance);
+    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d-%d.qmp", getpid(),
+                                         instance);
+    pid_file = g_strdup_printf("/tmp/qtest-%d-%d.pid", getpid(), instance);
+    instance++;
 
     sock = init_socket(s->socket_path);
     qmpsock = init_socket(s->qmp_socket_path);
@@ -288,18 +299,13 @@ redo:
     return words;
 }
 
-void qtest_qmp(QTestState *s, const char *fmt, ...)
+/* read the text of the next QMP message */
+static GString *qtest_qmp_recv(QTestState *s)
 {
-    va_list ap;
+    GString *msg = g_string_new("");
     bool has_reply = false;
     int nesting = 0;
 
-    /* Send QMP request */
-    va_start(ap, fmt);
-    socket_sendf(s->qmp_fd, fmt, ap);
-    va_end(ap);
-
-    /* Receive reply */
     while (!has_reply || nesting > 0) {
         ssize_t len;
         char c;
@@ -323,6 +329,47 @@ void qtest_qmp(QTestState *s, const char *fmt, ...)
             nesting--;
             break;
         }
+        if (has_reply) {
+            g_string_append_c(msg, c);
+        }
+    }
+
+    return msg;
+}
+
+void qtest_qmp(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+
+    /* Send QMP request */
+    va_start(ap, fmt);
+    socket_sendf(s->qmp_fd, fmt, ap);
+    va_end(ap);
+
+    /* Receive reply */
+    g_string_free(qtest_qmp_recv(s), true);
+}
+
+QDict *qtest_qmp_dict(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+    QObject *obj;
+    GString *msg;
+
+    va_start(ap, fmt);
+    socket_sendf(s->qmp_fd, fmt, ap);
+    va_end(ap);
+
+    /* skip the asynchronous events that arrive before the reply */
+    for (;;) {
+        msg = qtest_qmp_recv(s);
+        obj = qobject_from_json(msg->str);
+        g_string_free(msg, true);
+        g_assert(obj && qobject_type(obj) == QTYPE_QDICT);
+        if (!qdict_haskey(qobject_to_qdict(obj), "event")) {
+            return qobject_to_qdict(obj);
+        }
+        qobject_decref(obj);
     }
 }
 
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/types.h>
+#include "qapi/qmp/qdict.h"
 
 typedef struct QTestState QTestState;
 
@@ -46,6 +47,25 @@ void qtest_quit(QTestState *s);
  */
 void qtest_qmp(QTestState *s, const char *fmt, ...);
 
+/**
+ * qtest_qmp_dict:
+ * @s: QTestState instance to operate on.
+ * @fmt...: QMP message to send to qemu
+ *
+ * Sends a QMP message to QEMU and returns the reply, skipping the
+ * asynchronous events that come before it.  The caller must release
+ * the reply with QDECREF().
+ */
+QDict *qtest_qmp_dict(QTestState *s, const char *fmt, ...);
+
+/**
+ * qtest_get_pid:
+ * @s: QTestState instance to operate on.
+ *
+ * Return the process id of QEMU, or -1 if it is not known.
+ */
+pid_t qtest_get_pid(QTestState *s);
+
 /**
  * qtest_get_irq:
  * @s: QTestState instance to operate on.
@@ -0,0 +1,336 @@
+/*
+ * Live migration benchmark
+ *
+ * Migrates a qtest-driven guest between two local QEMU processes over a
+ * unix socket, while memory of the source is dirtied through qtest at a
+ * given rate and with a given pattern.  The results are printed as one
+ * JSON object on stdout.
+ *
+ *   QTEST_QEMU_BINARY=x86_64-softmmu/qemu-system-x86_64 \
+ *       tests/migration-bench --ram 1024 --dirty-rate 20000 --pattern hot
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "libqtest.h"
+#include "qemu/osdep.h"
+
+#include <glib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#define PAGE_SIZE   4096
+/* guest RAM of the pc machine is contiguous from 1 MB up to here */
+#define RAM_START   0x100000
+#define RAM_END_MAX 0xe0000000ULL
+/* prefill granularity */
+#define FILL_SIZE   65536
+/* the writer catches up on the dirty rate this often */
+#define TICK_US     10000
+#define POLL_US     50000
+
+static gint ram_mb = 256;
+static gint dirty_rate;
+static gchar *pattern = (gchar *)"seq";
+static gint hot_percent = 10;
+static gint bandwidth = 10240;
+static gint downtime_ms = 30;
+static gint timeout_s = 300;
+static gboolean no_prefill;
+static gchar **capabilities;
+
+static GOptionEntry entries[] = {
+    { "ram", 'm', 0, G_OPTION_ARG_INT, &ram_mb,
+      "guest RAM in MB (default 256)", "MB" },
+    { "dirty-rate", 'r', 0, G_OPTION_ARG_INT, &dirty_rate,
+      "pages dirtied per second during migration (default 0)", "PAGES" },
+    { "pattern", 'p', 0, G_OPTION_ARG_STRING, &pattern,
+      "seq, random or hot (default seq)", "PATTERN" },
+    { "hot-percent", 0, 0, G_OPTION_ARG_INT, &hot_percent,
+      "percentage of RAM written by the hot pattern (default 10)", "N" },
+    { "bandwidth", 'b', 0, G_OPTION_ARG_INT, &bandwidth,
+      "migration bandwidth limit in MB/s (default 10240)", "MB" },
+    { "downtime", 'd', 0, G_OPTION_ARG_INT, &downtime_ms,
+      "maximum downtime in ms (default 30)", "MS" },
+    { "timeout", 't', 0, G_OPTION_ARG_INT, &timeout_s,
+      "give up after this many seconds (default 300)", "S" },
+    { "no-prefill", 0, 0, G_OPTION_ARG_NONE, &no_prefill,
+      "leave guest RAM zero instead of filling it", NULL },
+    { "capability", 'c', 0, G_OPTION_ARG_STRING_ARRAY, &capabilities,
+      "enable a migration capability on both sides (repeatable)", "NAME" },
+    { NULL }
+};
+
+typedef enum {
+    PATTERN_SEQ,
+    PATTERN_RANDOM,
+    PATTERN_HOT,
+} Pattern;
+
+typedef struct Writer {
+    QTestState *s;
+    Pattern pattern;
+    GRand *rand;
+    uint64_t nr_pages;
+    uint64_t next;
+    uint64_t written;
+} Writer;
+
+static int64_t now_us(void)
+{
+    return g_get_monotonic_time();
+}
+
+/* user plus system time of a process, in ms */
+static int64_t process_cpu_ms(pid_t pid)
+{
+    gchar *path, *contents, *p;
+    unsigned long utime = 0, stime = 0;
+    int64_t ms = -1;
+
+    path = g_strdup_printf("/proc/%d/stat", pid);
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        /* skip "pid (comm)", comm may contain spaces */
+        p = strrchr(contents, ')');
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                        "%lu %lu", &utime, &stime) == 2) {
+            ms = (int64_t)(utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+        }
+        g_free(contents);
+    }
+    g_free(path);
+    return ms;
+}
+
+static QDict *qmp_checked(QTestState *s, const char *cmd)
+{
+    QDict *rsp = qtest_qmp_dict(s, "%s", cmd);
+
+    if (qdict_haskey(rsp, "error")) {
+        QDict *err = qdict_get_qdict(rsp, "error");
+
+        fprintf(stderr, "migration-bench: %s: %s\n", cmd,
+                qdict_get_try_str(err, "desc") ?: "error");
+        exit(1);
+    }
+    return rsp;
+}
+
+static void qmp_simple(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+    gchar *cmd;
+
+    va_start(ap, fmt);
+    cmd = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+
+    QDECREF(qmp_checked(s, cmd));
+    g_free(cmd);
+}
+
+static void set_capabilities(QTestState *s)
+{
+    int i;
+
+    for (i = 0; capabilities && capabilities[i]; i++) {
+        qmp_simple(s, "{ 'execute': 'migrate-set-capabilities',"
+                   " 'arguments': { 'capabilities': ["
+                   " { 'capability': '%s', 'state': true } ] } }",
+                   capabilities[i]);
+    }
+}
+
+static void prefill(QTestState *s, uint64_t ram_end, GRand *rand)
+{
+    uint32_t buf[FILL_SIZE / 4];
+    uint64_t addr;
+    int i;
+
+    for (addr = RAM_START; addr < ram_end; addr += FILL_SIZE) {
+        for (i = 0; i < FILL_SIZE / 4; i++) {
+            buf[i] = g_rand_int(rand);
+        }
+        qtest_memwrite(s, addr, buf, MIN(FILL_SIZE, ram_end - addr));
+    }
+}
+
+static uint64_t writer_next_page(Writer *w)
+{
+    uint64_t hot_pages;
+
+    switch (w->pattern) {
+    case PATTERN_SEQ:
+        w->next = (w->next + 1) % w->nr_pages;
+        return w->next;
+    case PATTERN_RANDOM:
+        return ((uint64_t)g_rand_int(w->rand) << 32 | g_rand_int(w->rand)) %
+               w->nr_pages;
+    case PATTERN_HOT:
+    default:
+        /* 90% of the writes go to the hot part of RAM */
+        hot_pages = MAX(1, w->nr_pages * hot_percent / 100);
+        if (g_rand_int_range(w->rand, 0, 10) < 9) {
+            return g_rand_int_range(w->rand, 0, MIN(hot_pages, G_MAXINT32));
+        }
+        return ((uint64_t)g_rand_int(w->rand) << 32 | g_rand_int(w->rand)) %
+               w->nr_pages;
+    }
+}
+
+/* dirty pages until the count for the time since start is reached */
+static void writer_run(Writer *w, int64_t start)
+{
+    uint64_t due = (now_us() - start) * (uint64_t)dirty_rate / 1000000;
+
+    while (w->written < due) {
+        uint64_t page = writer_next_page(w);
+        uint64_t val = w->written;
+
+        qtest_memwrite(w->s, RAM_START + page * PAGE_SIZE, &val, sizeof(val));
+        w->written++;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    QTestState *src, *dst;
+    QDict *rsp, *info, *ram;
+    const char *status = "timeout";
+    gchar *args, *uri, *path;
+    Writer w;
+    uint64_t ram_end;
+    int64_t start, last_poll, src_cpu, dst_cpu;
+    int64_t transferred = 0;
+    int ret;
+
+    context = g_option_context_new("- benchmark live migration");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "migration-bench: %s\n", error->message);
+        return 1;
+    }
+
+    if (strcmp(qtest_get_arch(), "i386") && strcmp(qtest_get_arch(), "x86_64")) {
+        fprintf(stderr, "migration-bench: only i386 and x86_64 are supported\n");
+        return 1;
+    }
+
+    memset(&w, 0, sizeof(w));
+    if (!strcmp(pattern, "seq")) {
+        w.pattern = PATTERN_SEQ;
+    } else if (!strcmp(pattern, "random")) {
+        w.pattern = PATTERN_RANDOM;
+    } else if (!strcmp(pattern, "hot")) {
+        w.pattern = PATTERN_HOT;
+    } else {
+        fprintf(stderr, "migration-bench: unknown pattern %s\n", pattern);
+        return 1;
+    }
+    w.rand = g_rand_new_with_seed(0);
+    ram_end = MIN((uint64_t)ram_mb << 20, RAM_END_MAX);
+    if (ram_end <= RAM_START) {
+        fprintf(stderr, "migration-bench: not enough RAM\n");
+        return 1;
+    }
+    w.nr_pages = (ram_end - RAM_START) / PAGE_SIZE;
+
+    path = g_strdup_printf("/tmp/migration-bench-%d.sock", getpid());
+    uri = g_strdup_printf("unix:%s", path);
+
+    args = g_strdup_printf("-m %d -display none", ram_mb);
+    src = qtest_init(args);
+    g_free(args);
+    args = g_strdup_printf("-m %d -display none -incoming %s", ram_mb, uri);
+    dst = qtest_init(args);
+    g_free(args);
+    w.s = src;
+
+    set_capabilities(src);
+    set_capabilities(dst);
+    qmp_simple(src, "{ 'execute': 'migrate_set_speed',"
+               " 'arguments': { 'value': %" PRId64 " } }",
+               (int64_t)bandwidth << 20);
+    qmp_simple(src, "{ 'execute': 'migrate_set_downtime',"
+               " 'arguments': { 'value': %f } }", downtime_ms / 1000.0);
+
+    if (!no_prefill) {
+        prefill(src, ram_end, w.rand);
+    }
+
+    src_cpu = process_cpu_ms(qtest_get_pid(src));
+    dst_cpu = process_cpu_ms(qtest_get_pid(dst));
+
+    qmp_simple(src, "{ 'execute': 'migrate', 'arguments': { 'uri': '%s' } }",
+               uri);
+
+    start = last_poll = now_us();
+    info = NULL;
+    while (now_us() - start < (int64_t)timeout_s * 1000000) {
+        writer_run(&w, start);
+
+        if (now_us() - last_poll >= POLL_US) {
+            last_poll = now_us();
+            rsp = qmp_checked(src, "{ 'execute': 'query-migrate' }");
+            info = qdict_get_qdict(rsp, "return");
+            QINCREF(info);
+            QDECREF(rsp);
+            status = qdict_get_try_str(info, "status");
+            if (status && strcmp(status, "active")) {
+                break;
+            }
+            QDECREF(info);
+            info = NULL;
+            status = "timeout";
+        }
+        g_usleep(dirty_rate ? TICK_US : POLL_US);
+    }
+
+    src_cpu = process_cpu_ms(qtest_get_pid(src)) - src_cpu;
+    dst_cpu = process_cpu_ms(qtest_get_pid(dst)) - dst_cpu;
+
+    if (!info) {
+        qmp_simple(src, "{ 'execute': 'migrate_cancel' }");
+    }
+
+    ram = info && qdict_haskey(info, "ram") ? qdict_get_qdict(info, "ram")
+                                             : NULL;
+    if (ram) {
+        transferred = qdict_get_try_int(ram, "transferred", 0);
+    }
+
+    printf("{ \"status\": \"%s\", \"ram-mb\": %d, \"pattern\": \"%s\", "
+           "\"dirty-rate\": %d, \"dirtied-pages\": %" PRIu64 ", "
+           "\"total-time-ms\": %" PRId64 ", \"downtime-ms\": %" PRId64 ", "
+           "\"bytes\": %" PRId64 ", \"iterations\": %" PRId64 ", "
+           "\"duplicate-pages\": %" PRId64 ", \"normal-pages\": %" PRId64 ", "
+           "\"src-cpu-ms\": %" PRId64 ", \"dst-cpu-ms\": %" PRId64 ", "
+           "\"src-cpu-ns-per-byte\": %.3f }\n",
+           status, ram_mb, pattern, dirty_rate, w.written,
+           info ? qdict_get_try_int(info, "total-time", -1) : -1,
+           info ? qdict_get_try_int(info, "downtime", -1) : -1,
+           transferred,
+           ram ? qdict_get_try_int(ram, "dirty-sync-count", -1) : -1,
+           ram ? qdict_get_try_int(ram, "duplicate", -1) : -1,
+           ram ? qdict_get_try_int(ram, "normal", -1) : -1,
+           src_cpu, dst_cpu,
+           transferred ? src_cpu * 1e6 / transferred : 0.0);
+
+    /* status points into info */
+    ret = strcmp(status, "completed") ? 1 : 0;
+    QDECREF(info);
+    qtest_quit(src);
+    qtest_quit(dst);
+    g_rand_free(w.rand);
+    unlink(path);
+    g_free(path);
+    g_free(uri);
+
+    return ret;
+}
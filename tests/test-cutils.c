@@ -226,6 +226,24 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static void test_buffer_find_nonzero_offset(void)
+{
+    size_t len = 16 * BUFFER_FIND_NONZERO_OFFSET_CHUNK;
+    uint8_t *buf = g_malloc0(len);
+    size_t i;
+
+    g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+
+    for (i = 0; i < len; i++) {
+        buf[i] = 1;
+        g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==,
+                        i - i % BUFFER_FIND_NONZERO_OFFSET_CHUNK);
+        buf[i] = 0;
+    }
+
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -247,5 +265,8 @@ int main(int argc, char **argv)
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
 
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
+
     return g_test_run();
 }
@@ -179,6 +179,41 @@ static void test_encode_decode(void)
     }
 }
 
+/* Short runs at every offset, so that runs start and end inside and across
+ * the blocks compared by the vectorized run detection. */
+static void test_encode_decode_short_runs(void)
+{
+    uint8_t *buffer = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc0(PAGE_SIZE);
+    int i, start, len, dlen, rc;
+
+    for (start = 0; start < 64; start++) {
+        for (len = 1; len < 40; len++) {
+            memset(test, 0, PAGE_SIZE);
+            memset(buffer, 0, PAGE_SIZE);
+            for (i = start; i < PAGE_SIZE - len; i += 2 * len + start % 7) {
+                memset(buffer + i, len, len);
+            }
+
+            dlen = xbzrle_encode_buffer(test, buffer, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+            if (dlen == -1) {
+                continue;
+            }
+            g_assert(dlen > 0);
+
+            rc = xbzrle_decode_buffer(compressed, dlen, test, PAGE_SIZE);
+            g_assert(rc > 0 && rc <= PAGE_SIZE);
+            g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +226,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_short_runs",
+                    test_encode_decode_short_runs);
 
     return g_test_run();
 }
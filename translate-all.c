@@ -36,6 +36,7 @@
 #include "disas/disas.h"
 #include "tcg.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #if defined(CONFIG_USER_ONLY)
@@ -75,17 +76,110 @@
 /* Code generation and translation blocks */
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-static int nb_tbs;
+/* Physical hash table of the TBs.  It is only modified under the TB
+   lock, but tb_phys_hash_lookup() walks it without any lock.  */
+TBPhysHashTable *tb_phys_hash;
+/* tables replaced by a resize, freed at the next tb_flush() or
+   tb_evict_region() */
+static TBPhysHashTable *tb_phys_hash_retired;
+static unsigned int tb_phys_hash_count;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
+/* Multi-threaded TCG: one host thread per vCPU */
+bool mttcg_enabled;
+
+/* Number of executions after which a TB is retranslated as a superblock,
+   0 to disable the second translation tier.  */
+int tcg_superblock_threshold;
+
+bool tcg_superblocks_supported(void)
+{
+#if defined(TARGET_SUPPORTS_SUPERBLOCKS)
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Multi-threaded TCG needs a real thread-local cpu_single_env, a target
+   whose atomic instructions are serialized between threads and a host
+   backend that patches direct jumps atomically.  */
+bool mttcg_supported(void)
+{
+#if !defined(CONFIG_USER_ONLY) && defined(__linux__) && \
+    defined(TARGET_SUPPORTS_MTTCG) && !defined(CONFIG_TCG_INTERPRETER) && \
+    (defined(__i386__) || defined(__x86_64__))
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if !defined(CONFIG_USER_ONLY)
+/* With one thread per vCPU, the tbs, the page table, tcg_ctx and the code
+   buffer are shared between threads and protected by tb_mutex.  The lock
+   is recursive so that the translation and invalidation entry points can
+   take it unconditionally.  */
+static QemuMutex tb_mutex;
+static DEFINE_TLS(int, tb_lock_depth);
+
+/* Set when tb_flush() or tb_evict_region() was called while other vCPU
+   threads might still be executing translated code; the work is then
+   done by the first vCPU thread that leaves cpu_exec(), inside an
+   exclusive section.  */
+volatile bool tb_flush_requested;
+volatile bool tb_evict_requested;
+
+void qemu_mutex_lock_tb(void)
+{
+    if (mttcg_enabled && tls_var(tb_lock_depth)++ == 0) {
+        qemu_mutex_lock(&tb_mutex);
+    }
+}
+
+void qemu_mutex_unlock_tb(void)
+{
+    if (mttcg_enabled && --tls_var(tb_lock_depth) == 0) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+/* Called by cpu_exec() when an exception longjmp()ed out of a section
+   that held one of the locks above.  */
+void tb_lock_reset(void)
+{
+    if (tls_var(tb_lock_depth)) {
+        tls_var(tb_lock_depth) = 0;
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+#endif
+
 uint8_t *code_gen_prologue;
 static uint8_t *code_gen_buffer;
 static size_t code_gen_buffer_size;
-/* threshold to flush the translated code buffer */
-static size_t code_gen_buffer_max_size;
-static uint8_t *code_gen_ptr;
+
+/* The code buffer and tbs[] are split into regions that are filled in
+   turn.  When the current region is full, the oldest one is recycled by
+   invalidating its TBs, so that the rest of the translated code stays
+   warm instead of being thrown away by a tb_flush().  */
+#define CODE_GEN_MAX_REGIONS 8
+
+typedef struct CodeGenRegion {
+    uint8_t *start;         /* first byte of the region */
+    uint8_t *ptr;           /* next free byte */
+    TranslationBlock *tbs;  /* this region's slice of tbs[] */
+    int nb_tbs;
+} CodeGenRegion;
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+static int code_gen_nb_regions;
+/* region being filled */
+static int code_gen_cur_region;
+/* threshold to move on to the next region */
+static size_t code_gen_region_max_size;
+static int code_gen_region_max_blocks;
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -135,7 +229,10 @@ static void *l1_map[V_L1_SIZE];
 
 /* statistics */
 static int tb_flush_count;
+static int tb_evict_count;
+static int tb_superblock_count;
 static int tb_phys_invalidate_count;
+static int tb_phys_hash_resize_count;
 
 /* code generation context */
 TCGContext tcg_ctx;
@@ -271,12 +368,13 @@ bool cpu_restore_state(CPUArchState *env, uintptr_t retaddr)
 {
     TranslationBlock *tb;
 
+    qemu_mutex_lock_tb();
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(tb, env, retaddr);
-        return true;
     }
-    return false;
+    qemu_mutex_unlock_tb();
+    return tb != NULL;
 }
 
 #ifdef _WIN32
@@ -574,6 +672,9 @@ static inline void *alloc_code_gen_buffer(void)
 
 static inline void code_gen_alloc(size_t tb_size)
 {
+    size_t region_size;
+    int i, n;
+
     code_gen_buffer_size = size_code_gen_buffer(tb_size);
     code_gen_buffer = alloc_code_gen_buffer();
     if (code_gen_buffer == NULL) {
@@ -591,10 +692,36 @@ static inline void code_gen_alloc(size_t tb_size)
     code_gen_prologue = code_gen_buffer + code_gen_buffer_size - 1024;
     code_gen_buffer_size -= 1024;
 
-    code_gen_buffer_max_size = code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
     tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+
+    /* Every region must leave room for the largest possible TB, so only
+       split the buffer when each part stays several times bigger.  */
+    n = CODE_GEN_MAX_REGIONS;
+    while (n > 1 &&
+           code_gen_buffer_size / n < 8 * TCG_MAX_OP_SIZE * OPC_BUF_SIZE) {
+        n /= 2;
+    }
+    region_size = (code_gen_buffer_size / n) & ~(size_t)(CODE_GEN_ALIGN - 1);
+    code_gen_nb_regions = n;
+    code_gen_region_max_size = region_size - (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    code_gen_region_max_blocks = code_gen_max_blocks / n;
+    for (i = 0; i < n; i++) {
+        code_gen_regions[i].start = code_gen_buffer + i * region_size;
+        code_gen_regions[i].ptr = code_gen_regions[i].start;
+        code_gen_regions[i].tbs = tbs + i * code_gen_region_max_blocks;
+        code_gen_regions[i].nb_tbs = 0;
+    }
+    code_gen_cur_region = 0;
+}
+
+static TBPhysHashTable *tb_phys_hash_alloc(unsigned int size)
+{
+    TBPhysHashTable *ht;
+
+    ht = g_malloc0(sizeof(*ht) + size * sizeof(TranslationBlock *));
+    ht->mask = size - 1;
+    return ht;
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -604,9 +731,12 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    code_gen_ptr = code_gen_buffer;
     tcg_register_jit(code_gen_buffer, code_gen_buffer_size);
     page_init();
+    tb_phys_hash = tb_phys_hash_alloc(CODE_GEN_PHYS_HASH_SIZE);
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+#endif
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -619,19 +749,23 @@ bool tcg_enabled(void)
     return code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region. Return NULL if
+   it has too many translation blocks or too much generated code, in which
+   case a region must be evicted. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    CodeGenRegion *r = &code_gen_regions[code_gen_cur_region];
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size) {
+    if (r->nb_tbs >= code_gen_region_max_blocks ||
+        (r->ptr - r->start) >= code_gen_region_max_size) {
         return NULL;
     }
-    tb = &tbs[nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = 0;
+    tb->hot_count = tcg_superblock_threshold;
     return tb;
 }
 
@@ -640,9 +774,11 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
-        code_gen_ptr = tb->tc_ptr;
-        nb_tbs--;
+    CodeGenRegion *r = &code_gen_regions[code_gen_cur_region];
+
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
+        r->ptr = tb->tc_ptr;
+        r->nb_tbs--;
     }
 }
 
@@ -688,35 +824,121 @@ static void page_flush_tb(void)
     }
 }
 
+/* Free the hash tables replaced by a resize.  Only safe when no vCPU can
+   be inside tb_phys_hash_lookup().  */
+static void tb_phys_hash_free_retired(void)
+{
+    TBPhysHashTable *ht;
+
+    while (tb_phys_hash_retired) {
+        ht = tb_phys_hash_retired;
+        tb_phys_hash_retired = ht->retired_next;
+        g_free(ht);
+    }
+}
+
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
+/* XXX: tb_flush is currently not thread safe in user mode */
 void tb_flush(CPUArchState *env1)
 {
     CPUArchState *env;
+    CodeGenRegion *r;
+    int i;
 
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled && !cpu_in_exclusive_context()) {
+        /* other vCPU threads may be running code from the buffer */
+        tb_flush_requested = true;
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            cpu_exit(env);
+        }
+        return;
+    }
+    qemu_mutex_lock_tb();
+#endif
+    r = &code_gen_regions[code_gen_cur_region];
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+    printf("qemu: flush region=%d code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
+           code_gen_cur_region, (unsigned long)(r->ptr - r->start),
+           r->nb_tbs, r->nb_tbs > 0 ?
+           ((unsigned long)(r->ptr - r->start)) / r->nb_tbs : 0);
 #endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer)
-        > code_gen_buffer_size) {
+    if ((unsigned long)(r->ptr - code_gen_buffer) > code_gen_buffer_size) {
         cpu_abort(env1, "Internal error: code buffer overflow\n");
     }
-    nb_tbs = 0;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        code_gen_regions[i].ptr = code_gen_regions[i].start;
+        code_gen_regions[i].nb_tbs = 0;
+    }
+    code_gen_cur_region = 0;
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
     }
 
-    memset(tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+    tb_phys_hash_free_retired();
+    memset(tb_phys_hash->buckets, 0,
+           (tb_phys_hash->mask + 1) * sizeof(TranslationBlock *));
+    tb_phys_hash_count = 0;
     page_flush_tb();
 
-    code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+#if !defined(CONFIG_USER_ONLY)
+    tb_flush_requested = false;
+    tb_evict_requested = false;
+    qemu_mutex_unlock_tb();
+#endif
+}
+
+/* Make room in the code buffer by recycling the oldest region: its TBs
+   are invalidated one by one, which also unlinks every jump into them
+   from the other regions.  */
+void tb_evict_region(CPUArchState *env1)
+{
+    CodeGenRegion *r;
+    TranslationBlock *tb;
+    int i, next;
+
+#if !defined(CONFIG_USER_ONLY)
+    CPUArchState *env;
+
+    if (mttcg_enabled && !cpu_in_exclusive_context()) {
+        /* other vCPU threads may be running code from the region */
+        tb_evict_requested = true;
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            cpu_exit(env);
+        }
+        return;
+    }
+#endif
+    if (code_gen_nb_regions == 1) {
+        tb_flush(env1);
+        return;
+    }
+    qemu_mutex_lock_tb();
+    next = (code_gen_cur_region + 1) % code_gen_nb_regions;
+    r = &code_gen_regions[next];
+#if defined(DEBUG_FLUSH)
+    printf("qemu: evict region=%d code_size=%ld nb_tbs=%d\n",
+           next, (unsigned long)(r->ptr - r->start), r->nb_tbs);
+#endif
+    for (i = 0; i < r->nb_tbs; i++) {
+        tb = &r->tbs[i];
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    r->ptr = r->start;
+    r->nb_tbs = 0;
+    code_gen_cur_region = next;
+    tb_phys_hash_free_retired();
+    tb_evict_count++;
+#if !defined(CONFIG_USER_ONLY)
+    tb_evict_requested = false;
+#endif
+    qemu_mutex_unlock_tb();
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -727,8 +949,9 @@ static void tb_invalidate_check(target_ulong address)
     int i;
 
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i <= tb_phys_hash->mask; i++) {
+        for (tb = tb_phys_hash->buckets[i]; tb != NULL;
+             tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -745,8 +968,9 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i <= tb_phys_hash->mask; i++) {
+        for (tb = tb_phys_hash->buckets[i]; tb != NULL;
+             tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
             if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
@@ -759,6 +983,9 @@ static void tb_page_check(void)
 
 #endif
 
+/* Unlink a TB from its chain.  The TB keeps its own phys_hash_next, so
+   that a concurrent lookup standing on it can still reach the rest of
+   the chain.  */
 static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -766,11 +993,12 @@ static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
     for (;;) {
         tb1 = *ptb;
         if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
+            atomic_set(ptb, tb1->phys_hash_next);
             break;
         }
         ptb = &tb1->phys_hash_next;
     }
+    tb_phys_hash_count--;
 }
 
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
@@ -832,13 +1060,14 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUArchState *env;
     PageDesc *p;
     unsigned int h, n1;
-    tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    qemu_mutex_lock_tb();
+
     /* remove the TB from the hash list */
-    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tb_phys_hash[h], tb);
+    tb->invalid = 1;
+    tb_hash_remove(&tb_phys_hash->buckets[tb->phys_hash & tb_phys_hash->mask],
+                   tb);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -882,6 +1111,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
     tb_phys_invalidate_count++;
+    qemu_mutex_unlock_tb();
 }
 
 static inline void set_bits(uint8_t *tab, int start, int len)
@@ -940,34 +1170,57 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* Pages with code are protected against writes through the TLBs.  */
+static bool tb_page_is_protected(tb_page_addr_t page_addr)
+{
+    PageDesc *p = page_find(page_addr >> TARGET_PAGE_BITS);
+
+    return p && p->first_tb;
+}
+#endif
+
 TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
 {
     TranslationBlock *tb;
+    CodeGenRegion *r;
     uint8_t *tc_ptr;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
 
+    qemu_mutex_lock_tb();
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#if !defined(CONFIG_USER_ONLY)
+        if (mttcg_enabled && !cpu_in_exclusive_context()) {
+            /* A region can only be evicted once the other vCPU threads
+               have left translated code: request the eviction and retry
+               this TB afterwards.  cpu_exec() drops the TB lock.  */
+            tb_evict_region(env);
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+#endif
+        /* make room in the next region */
+        tb_evict_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
-    tc_ptr = code_gen_ptr;
+    r = &code_gen_regions[code_gen_cur_region];
+    tc_ptr = r->ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
     cpu_gen_code(env, tb, &code_gen_size);
-    code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size +
-                             CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    r->ptr = (void *)(((uintptr_t)r->ptr + code_gen_size +
+                       CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -975,10 +1228,47 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled && !cpu_in_exclusive_context() &&
+        (!tb_page_is_protected(phys_pc) ||
+         (phys_page2 != -1 && !tb_page_is_protected(phys_page2)))) {
+        /* Protecting a new code page writes the TLBs of the other vCPUs,
+           which is only safe while they are stopped: drop the TB and
+           translate it again in an exclusive section.  cpu_exec() drops
+           the TB lock.  */
+        tb_free(tb);
+        env->exception_index = EXCP_ATOMIC;
+        cpu_loop_exit(env);
+    }
+#endif
     tb_link_page(tb, phys_pc, phys_page2);
+    qemu_mutex_unlock_tb();
     return tb;
 }
 
+/* Retranslate a TB whose execution counter ran out as a superblock.  The
+   original is invalidated, which unlinks the jumps into it, so that
+   lookups and new chains reach the superblock instead.  */
+void tb_promote(CPUArchState *env, TranslationBlock *tb)
+{
+    target_ulong pc, cs_base;
+    uint64_t flags;
+    int cflags;
+
+    qemu_mutex_lock_tb();
+    /* another vCPU may have promoted it already */
+    if (!tb->invalid) {
+        pc = tb->pc;
+        cs_base = tb->cs_base;
+        flags = tb->flags;
+        cflags = tb->cflags;
+        tb_phys_invalidate(tb, -1);
+        tb_gen_code(env, pc, cs_base, flags, cflags | CF_SUPERBLOCK);
+        tb_superblock_count++;
+    }
+    qemu_mutex_unlock_tb();
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1020,8 +1310,10 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    qemu_mutex_lock_tb();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        qemu_mutex_unlock_tb();
         return;
     }
     if (!p->code_bitmap &&
@@ -1106,9 +1398,11 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
            itself */
         env->current_tb = NULL;
         tb_gen_code(env, current_pc, current_cs_base, current_flags, 1);
+        /* cpu_exec() drops the TB lock */
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    qemu_mutex_unlock_tb();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1126,8 +1420,10 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   (intptr_t)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    qemu_mutex_lock_tb();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        qemu_mutex_unlock_tb();
         return;
     }
     if (p->code_bitmap) {
@@ -1140,6 +1436,7 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    qemu_mutex_unlock_tb();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1263,22 +1560,111 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif /* TARGET_HAS_SMC */
 }
 
+/* Find a valid TB for the given CPU state.  This does not take the TB
+   lock: insertions publish fully initialized TBs, and removals leave the
+   removed TB pointing into its old chain, so a concurrent walk never
+   sees a dangling pointer.  It can however miss a TB that is being
+   inserted or moved by a resize, so callers that are about to translate
+   must look again under the TB lock.  */
+TranslationBlock *tb_phys_hash_lookup(CPUArchState *env,
+                                      tb_page_addr_t phys_pc, target_ulong pc,
+                                      target_ulong cs_base, uint64_t flags)
+{
+    TBPhysHashTable *ht;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_page1, phys_page2;
+    target_ulong virt_page2;
+    uint32_t h;
+    unsigned long steps = 0;
+
+    phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_phys_hash_func(phys_pc, pc, flags, cs_base);
+    env->tb_phys_hash_lookups++;
+
+    ht = atomic_read(&tb_phys_hash);
+    smp_rmb();
+    tb = atomic_read(&ht->buckets[h & ht->mask]);
+    for (; tb != NULL; tb = atomic_read(&tb->phys_hash_next)) {
+        smp_rmb();
+        steps++;
+        if (tb->phys_hash != h ||
+            tb->pc != pc ||
+            tb->page_addr[0] != phys_page1 ||
+            tb->cs_base != cs_base ||
+            tb->flags != flags ||
+            tb->invalid) {
+            continue;
+        }
+        /* check next page if needed */
+        if (tb->page_addr[1] != -1) {
+            virt_page2 = (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(env, virt_page2);
+            if (tb->page_addr[1] != phys_page2) {
+                continue;
+            }
+        }
+        env->tb_phys_hash_hits++;
+        env->tb_phys_hash_steps += steps;
+        return tb;
+    }
+    env->tb_phys_hash_steps += steps;
+    return NULL;
+}
+
+/* Double the number of buckets.  The new table is filled completely
+   before it is published, and the old one is kept for the lookups that
+   may still be walking it.  Called with the TB lock held.  */
+static void tb_phys_hash_resize(void)
+{
+    TBPhysHashTable *old = tb_phys_hash, *ht;
+    TranslationBlock *tb, *next, **ptb;
+    unsigned int i;
+
+    ht = tb_phys_hash_alloc((old->mask + 1) * 2);
+    for (i = 0; i <= old->mask; i++) {
+        for (tb = old->buckets[i]; tb != NULL; tb = next) {
+            next = tb->phys_hash_next;
+            ptb = &ht->buckets[tb->phys_hash & ht->mask];
+            atomic_set(&tb->phys_hash_next, *ptb);
+            *ptb = tb;
+        }
+    }
+    smp_wmb();
+    atomic_set(&tb_phys_hash, ht);
+
+    if (mttcg_enabled) {
+        old->retired_next = tb_phys_hash_retired;
+        tb_phys_hash_retired = old;
+    } else {
+        /* the only reader is the vCPU that is resizing */
+        g_free(old);
+    }
+    tb_phys_hash_resize_count++;
+}
+
+static void tb_phys_hash_insert(TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    TranslationBlock **ptb;
+
+    tb->phys_hash = tb_phys_hash_func(phys_pc, tb->pc, tb->flags,
+                                      tb->cs_base);
+    if (++tb_phys_hash_count > tb_phys_hash->mask + 1) {
+        tb_phys_hash_resize();
+    }
+    ptb = &tb_phys_hash->buckets[tb->phys_hash & tb_phys_hash->mask];
+    tb->phys_hash_next = *ptb;
+    smp_wmb();
+    atomic_set(ptb, tb);
+}
+
 /* add a new TB and link it to the physical page tables. phys_page2 is
    (-1) to indicate that only one page contains the TB. */
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1300,6 +1686,10 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the physical hash table last: from then on, other vCPU
+       threads may find the TB and jump to it */
+    tb_phys_hash_insert(tb, phys_pc);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1311,7 +1701,7 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 bool is_tcg_gen_code(uintptr_t tc_ptr)
 {
     /* This can be called during code generation, code_gen_buffer_size
-       is used instead of code_gen_ptr for upper boundary checking */
+       is used instead of the region pointers for upper boundary checking */
     return (tc_ptr >= (uintptr_t)code_gen_buffer &&
             tc_ptr < (uintptr_t)(code_gen_buffer + code_gen_buffer_size));
 }
@@ -1321,23 +1711,29 @@ bool is_tcg_gen_code(uintptr_t tc_ptr)
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    int m_min, m_max, m, i;
     uintptr_t v;
     TranslationBlock *tb;
-
-    if (nb_tbs <= 0) {
-        return NULL;
+    CodeGenRegion *r;
+
+    /* TBs are only sorted by tc_ptr within a region */
+    r = NULL;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        if (tc_ptr >= (uintptr_t)code_gen_regions[i].start &&
+            tc_ptr < (uintptr_t)code_gen_regions[i].ptr) {
+            r = &code_gen_regions[i];
+            break;
+        }
     }
-    if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+    if (r == NULL || r->nb_tbs <= 0) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1347,7 +1743,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1372,6 +1768,7 @@ void tb_check_watchpoint(CPUArchState *env)
 {
     TranslationBlock *tb;
 
+    qemu_mutex_lock_tb();
     tb = tb_find_pc(env->mem_io_pc);
     if (!tb) {
         cpu_abort(env, "check_watchpoint: could not find TB for pc=%p",
@@ -1379,6 +1776,7 @@ void tb_check_watchpoint(CPUArchState *env)
     }
     cpu_restore_state_from_tb(tb, env, env->mem_io_pc);
     tb_phys_invalidate(tb, -1);
+    qemu_mutex_unlock_tb();
 }
 
 #ifndef CONFIG_USER_ONLY
@@ -1490,44 +1888,73 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
-    int direct_jmp_count, direct_jmp2_count, cross_page;
+    int i, j, target_code_size, max_target_code_size;
+    int direct_jmp_count, direct_jmp2_count, cross_page, nb_tbs;
+    unsigned int hash_used, hash_max_chain, chain, h;
+    unsigned long hash_lookups = 0, hash_hits = 0, hash_steps = 0;
+    ptrdiff_t code_size;
+    CodeGenRegion *r;
     TranslationBlock *tb;
+    CPUArchState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
+    nb_tbs = 0;
+    code_size = 0;
+    for (j = 0; j < code_gen_nb_regions; j++) {
+        r = &code_gen_regions[j];
+        nb_tbs += r->nb_tbs;
+        code_size += r->ptr - r->start;
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
+            }
         }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
+    }
+    hash_used = 0;
+    hash_max_chain = 0;
+    /* not allocated unless TCG is in use */
+    for (h = 0; tb_phys_hash && h <= tb_phys_hash->mask; h++) {
+        chain = 0;
+        for (tb = tb_phys_hash->buckets[h]; tb != NULL;
+             tb = tb->phys_hash_next) {
+            chain++;
         }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
-            }
+        if (chain) {
+            hash_used++;
+        }
+        if (chain > hash_max_chain) {
+            hash_max_chain = chain;
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%zd\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+                code_size, code_gen_buffer_size);
+    cpu_fprintf(f, "code regions        %d (filling %d)\n",
+                code_gen_nb_regions, code_gen_cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer)
-                / target_code_size : 0);
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -1536,10 +1963,31 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+    if (tb_phys_hash) {
+        cpu_fprintf(f, "TB hash buckets     %u/%u (%u%% used, %d resizes)\n",
+                    hash_used, tb_phys_hash->mask + 1,
+                    (hash_used * 100) / (tb_phys_hash->mask + 1),
+                    tb_phys_hash_resize_count);
+        cpu_fprintf(f, "TB hash chain       avg %0.2f max=%u\n",
+                    hash_used ? (double) tb_phys_hash_count / hash_used : 0,
+                    hash_max_chain);
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        hash_lookups += env->tb_phys_hash_lookups;
+        hash_hits += env->tb_phys_hash_hits;
+        hash_steps += env->tb_phys_hash_steps;
+    }
+    cpu_fprintf(f, "TB hash lookups     %lu (%lu%% hit, %0.2f steps each)\n",
+                hash_lookups,
+                hash_lookups ? (hash_hits * 100) / hash_lookups : 0,
+                hash_lookups ? (double) hash_steps / hash_lookups : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB evict count      %d\n", tb_evict_count);
+    cpu_fprintf(f, "superblock count    %d\n", tb_superblock_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    tlb_dump_stats(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
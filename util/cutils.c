@@ -177,6 +177,139 @@ bool buffer_is_zero(const void *buf, size_t len)
     return true;
 }
 
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+
+#ifndef bit_AVX2
+#define bit_AVX2 (1 << 5)
+#endif
+
+/*
+ * Checks if the host CPU and OS support AVX2
+ */
+bool host_has_avx2(void)
+{
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    /* the OS must save the YMM registers too */
+    asm("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    if ((a & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+#else
+bool host_has_avx2(void)
+{
+    return false;
+}
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static size_t buffer_find_nonzero_offset_vec(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i < len; i += BUFFER_FIND_NONZERO_OFFSET_CHUNK) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+                         _mm_loadu_si128((const __m128i *)(p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+                         _mm_loadu_si128((const __m128i *)(p + i + 48))));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) {
+            break;
+        }
+    }
+    return i;
+}
+#else
+static size_t buffer_find_nonzero_offset_vec(const void *buf, size_t len)
+{
+    const long *p = buf;
+    size_t i, n = BUFFER_FIND_NONZERO_OFFSET_CHUNK / sizeof(long);
+
+    for (i = 0; i < len / sizeof(long); i += n) {
+        size_t j;
+        long v = 0;
+
+        for (j = 0; j < n; j++) {
+            v |= p[i + j];
+        }
+        if (v) {
+            break;
+        }
+    }
+    return i * sizeof(long);
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i += BUFFER_FIND_NONZERO_OFFSET_CHUNK) {
+        __m256i v = _mm256_or_si256(
+            _mm256_loadu_si256((const __m256i *)(p + i)),
+            _mm256_loadu_si256((const __m256i *)(p + i + 32)));
+
+        if (!_mm256_testz_si256(v, v)) {
+            break;
+        }
+    }
+    return i;
+}
+#pragma GCC pop_options
+#endif
+
+static size_t (*buffer_find_nonzero_offset_fn)(const void *buf, size_t len) =
+    buffer_find_nonzero_offset_vec;
+
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+static void __attribute__((constructor)) buffer_find_nonzero_offset_init(void)
+{
+    if (host_has_avx2()) {
+        buffer_find_nonzero_offset_fn = buffer_find_nonzero_offset_avx2;
+    }
+}
+#endif
+
+/*
+ * Searches for non-zero content in a buffer
+ *
+ * Returns the offset of the first BUFFER_FIND_NONZERO_OFFSET_CHUNK sized
+ * chunk that is not all zeroes, or len if the whole buffer is zero.
+ *
+ * Attention! The len must be a multiple of BUFFER_FIND_NONZERO_OFFSET_CHUNK
+ * and buf must be aligned to sizeof(long).  The widest vector instructions
+ * supported by the host are used.
+ */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    assert(len % BUFFER_FIND_NONZERO_OFFSET_CHUNK == 0);
+    assert(((uintptr_t)buf % sizeof(long)) == 0);
+
+    return buffer_find_nonzero_offset_fn(buf, len);
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -387,6 +387,14 @@ static QemuOptsList qemu_machine_opts = {
             .name = "kvm_shadow_mem",
             .type = QEMU_OPT_SIZE,
             .help = "KVM shadow MMU size",
+        }, {
+            .name = "tcg_threads",
+            .type = QEMU_OPT_STRING,
+            .help = "run TCG vCPUs in a single thread or one thread each",
+        }, {
+            .name = "tcg_superblocks",
+            .type = QEMU_OPT_NUMBER,
+            .help = "retranslate TBs run this many times as superblocks",
         }, {
             .name = "kernel",
             .type = QEMU_OPT_STRING,
@@ -2583,6 +2591,36 @@ static QEMUMachine *machine_parse(const char *name)
 
 static int tcg_init(void)
 {
+    QemuOpts *opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    const char *threads = opts ? qemu_opt_get(opts, "tcg_threads") : NULL;
+    uint64_t superblocks = opts ?
+        qemu_opt_get_number(opts, "tcg_superblocks", 0) : 0;
+
+    if (threads && strcmp(threads, "single") != 0) {
+        if (strcmp(threads, "multi") != 0) {
+            fprintf(stderr, "Invalid tcg_threads value: %s\n", threads);
+            exit(1);
+        }
+        if (!mttcg_supported()) {
+            fprintf(stderr, "tcg_threads=multi is not supported "
+                    "for this target and host\n");
+            exit(1);
+        }
+        mttcg_enabled = true;
+    }
+    if (superblocks) {
+        if (!tcg_superblocks_supported()) {
+            fprintf(stderr, "tcg_superblocks is not supported "
+                    "for this target\n");
+            exit(1);
+        }
+        if (superblocks > INT32_MAX) {
+            fprintf(stderr, "Invalid tcg_superblocks value: %" PRIu64 "\n",
+                    superblocks);
+            exit(1);
+        }
+        tcg_superblock_threshold = superblocks;
+    }
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
     return 0;
 }
@@ -4064,6 +4102,10 @@ int main(int argc, char **argv, char **envp)
         fprintf(stderr, "-icount is not allowed with kvm or xen\n");
         exit(1);
     }
+    if (icount_option && mttcg_enabled) {
+        fprintf(stderr, "-icount is not allowed with tcg_threads=multi\n");
+        exit(1);
+    }
     configure_icount(icount_option);
 
     /* clean up network at qemu process termination */
@@ -13,6 +13,166 @@
 #include "qemu-common.h"
 #include "include/migration/migration.h"
 
+#include "qemu/host-utils.h"
+
+/*
+ * Run detection.  zrun_end() returns the first offset at or after @i where
+ * the two buffers differ, nzrun_end() the first one where they are equal;
+ * both return @slen if there is none.  The buffers are aligned to
+ * sizeof(long) and so is @slen.
+ */
+static int zrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i % sizeof(long) && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed */
+    if (!(i % sizeof(long))) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i % sizeof(long) && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!(i % sizeof(long))) {
+        /* truncation to 32-bit long okay */
+        long mask = (long)0x0101010101010101ULL;
+        while (i < slen) {
+            long xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                break;
+            }
+            i += sizeof(long);
+        }
+    }
+
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Bit n of the result is set if byte n of the two blocks is equal */
+static inline uint32_t cmpeq_mask_sse2(const uint8_t *a, const uint8_t *b)
+{
+    __m128i x = _mm_loadu_si128((const __m128i *)a);
+    __m128i y = _mm_loadu_si128((const __m128i *)b);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+}
+
+static int zrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint32_t eq = cmpeq_mask_sse2(old_buf + i, new_buf + i);
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return zrun_end_long(old_buf, new_buf, i, slen);
+}
+
+static int nzrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint32_t eq = cmpeq_mask_sse2(old_buf + i, new_buf + i);
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return nzrun_end_long(old_buf, new_buf, i, slen);
+}
+
+#define zrun_end_default  zrun_end_sse2
+#define nzrun_end_default nzrun_end_sse2
+#else
+#define zrun_end_default  zrun_end_long
+#define nzrun_end_default nzrun_end_long
+#endif
+
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint32_t cmpeq_mask_avx2(const uint8_t *a, const uint8_t *b)
+{
+    __m256i x = _mm256_loadu_si256((const __m256i *)a);
+    __m256i y = _mm256_loadu_si256((const __m256i *)b);
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+}
+
+static int zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t eq = cmpeq_mask_avx2(old_buf + i, new_buf + i);
+
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return zrun_end_default(old_buf, new_buf, i, slen);
+}
+
+static int nzrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t eq = cmpeq_mask_avx2(old_buf + i, new_buf + i);
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return nzrun_end_default(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+#endif
+
+static int (*zrun_end)(const uint8_t *old_buf, const uint8_t *new_buf,
+                       int i, int slen) = zrun_end_default;
+static int (*nzrun_end)(const uint8_t *old_buf, const uint8_t *new_buf,
+                        int i, int slen) = nzrun_end_default;
+
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+static void __attribute__((constructor)) xbzrle_init_accel(void)
+{
+    if (host_has_avx2()) {
+        zrun_end = zrun_end_avx2;
+        nzrun_end = nzrun_end_avx2;
+    }
+}
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -27,8 +187,7 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
+    int d = 0, i = 0, j;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -40,28 +199,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        j = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = j - i;
+        i = j;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,40 +215,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        j = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = j - i;
+        i = j;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -117,7 +233,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;